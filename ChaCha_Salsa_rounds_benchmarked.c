@@ -0,0 +1,487 @@
+/*
+ * Reduced-round ChaCha and Salsa20 with the round count fixed at compile time.
+ *
+ * ChaCha8/12/20 and Salsa20/8/12/20 are generated from one macro each, so every
+ * variant gets its own block function with all double rounds unrolled and no
+ * loop counter or round parameter left at run time. They are reached through
+ * one API (stream_init / stream_xor / stream_keystream) that takes the variant
+ * as an enum. Reduced-round variants are meant for non-secret PRNG workloads
+ * (simulations, randomized tests), not for encrypting data.
+ *
+ * The unrolling buys no measurable speed. With gcc 12 -O3 on x86-64 the
+ * unrolled variants and the same rounds in a loop with a run-time count
+ * have minimums within 0.1 cycles/byte of each other in every row (trials
+ * interleaved). The loop branch is one in ~130 instructions. The unrolled
+ * body spills fewer of the 16 state words, which do not all fit in the
+ * integer registers either way, but at 3.7 KB per ChaCha20 block function it
+ * likely runs from the legacy decoders rather than the uop cache. Two double
+ * rounds per loop iteration measured the same as both. What the macro
+ * family does give is one API over six variants with no round argument
+ * threaded through.
+ *
+ * Both ciphers use the original 64-bit nonce and 64-bit block counter layout.
+ * For ChaCha20 this gives the RFC 8439 keystream whenever the first 4 bytes of
+ * the RFC's 96-bit nonce are zero.
+ *
+ * RC4 from rc4.h is benchmarked in the same units after them: one stream, and
+ * 4, 6 and 8 independent streams interleaved in one loop.
+ *
+ * Build:
+ *   gcc -O3 -o arx_rounds ChaCha_Salsa_rounds_benchmarked.c
+ * Run:
+ *   ./arx_rounds
+ *
+ * Note: RDTSC measures CPU cycles (x86 only) and varies with Turbo Boost etc.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <x86intrin.h>  // For __rdtsc() to measure CPU cycles (x86-specific)
+#include "rc4.h"
+
+#define ROTL(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+
+// ChaCha quarter-round (RFC 8439 section 2.1)
+#define CHACHA_QR(a, b, c, d) \
+    a += b; d ^= a; d = ROTL(d, 16); \
+    c += d; b ^= c; b = ROTL(b, 12); \
+    a += b; d ^= a; d = ROTL(d, 8); \
+    c += d; b ^= c; b = ROTL(b, 7);
+
+// Salsa20 quarter-round, same as QR in Salsa20 (gmp).c
+#define SALSA_QR(a, b, c, d) \
+    b ^= ROTL(a + d, 7); \
+    c ^= ROTL(b + a, 9); \
+    d ^= ROTL(c + b, 13); \
+    a ^= ROTL(d + c, 18);
+
+// One column round followed by one diagonal round
+#define CHACHA_DOUBLEROUND(x) \
+    CHACHA_QR(x[0], x[4], x[8], x[12]) \
+    CHACHA_QR(x[1], x[5], x[9], x[13]) \
+    CHACHA_QR(x[2], x[6], x[10], x[14]) \
+    CHACHA_QR(x[3], x[7], x[11], x[15]) \
+    CHACHA_QR(x[0], x[5], x[10], x[15]) \
+    CHACHA_QR(x[1], x[6], x[11], x[12]) \
+    CHACHA_QR(x[2], x[7], x[8], x[13]) \
+    CHACHA_QR(x[3], x[4], x[9], x[14])
+
+// One column round followed by one row round
+#define SALSA_DOUBLEROUND(x) \
+    SALSA_QR(x[0], x[4], x[8], x[12]) \
+    SALSA_QR(x[5], x[9], x[13], x[1]) \
+    SALSA_QR(x[10], x[14], x[2], x[6]) \
+    SALSA_QR(x[15], x[3], x[7], x[11]) \
+    SALSA_QR(x[0], x[1], x[2], x[3]) \
+    SALSA_QR(x[5], x[6], x[7], x[4]) \
+    SALSA_QR(x[10], x[11], x[8], x[9]) \
+    SALSA_QR(x[15], x[12], x[13], x[14])
+
+// Textual repetition, so the double rounds are unrolled by the preprocessor
+#define REPEAT_4(m, x) m(x) m(x) m(x) m(x)
+#define REPEAT_6(m, x) REPEAT_4(m, x) m(x) m(x)
+#define REPEAT_10(m, x) REPEAT_6(m, x) REPEAT_4(m, x)
+
+/*
+Generates NAME_block (one 64-byte block, feedforward included) and
+NAME_xor_blocks (XOR nblocks consecutive blocks into a buffer and advance the
+64-bit counter held in words CTR and CTR + 1).
+DOUBLE_ROUNDS is the round count divided by two, written out as a literal.
+*/
+#define DEFINE_STREAM(NAME, DOUBLEROUND, DOUBLE_ROUNDS, CTR) \
+static void NAME##_block(uint32_t out[16], const uint32_t in[16]) { \
+    uint32_t x[16]; \
+    for (int i = 0; i < 16; i++) x[i] = in[i]; \
+    REPEAT_##DOUBLE_ROUNDS(DOUBLEROUND, x) \
+    for (int i = 0; i < 16; i++) out[i] = x[i] + in[i]; \
+} \
+\
+static void NAME##_xor_blocks(uint32_t state[16], const uint8_t *in, uint8_t *out, size_t nblocks) { \
+    uint32_t keystream[16]; \
+    while (nblocks > 0) { \
+        NAME##_block(keystream, state); \
+        for (int i = 0; i < 16; i++) { \
+            uint32_t word; \
+            memcpy(&word, in + 4 * i, 4); \
+            word ^= keystream[i];   /* little-endian host (x86) */ \
+            memcpy(out + 4 * i, &word, 4); \
+        } \
+        if (++state[CTR] == 0) state[CTR + 1]++; \
+        in += 64; \
+        out += 64; \
+        nblocks--; \
+    } \
+}
+
+DEFINE_STREAM(chacha8, CHACHA_DOUBLEROUND, 4, 12)
+DEFINE_STREAM(chacha12, CHACHA_DOUBLEROUND, 6, 12)
+DEFINE_STREAM(chacha20, CHACHA_DOUBLEROUND, 10, 12)
+DEFINE_STREAM(salsa20_8, SALSA_DOUBLEROUND, 4, 8)
+DEFINE_STREAM(salsa20_12, SALSA_DOUBLEROUND, 6, 8)
+DEFINE_STREAM(salsa20_20, SALSA_DOUBLEROUND, 10, 8)
+
+static uint32_t load32_le(const uint8_t *p) {
+    return ((uint32_t)p[0]) | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// "expand 32-byte k"
+static const uint32_t sigma[4] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+
+// ChaCha: constants, key, 64-bit counter, 64-bit nonce, in that order
+static void chacha_setup(uint32_t s[16], const uint8_t key[32], const uint8_t nonce[8], uint64_t counter) {
+    for (int i = 0; i < 4; i++) s[i] = sigma[i];
+    for (int i = 0; i < 8; i++) s[4 + i] = load32_le(key + 4 * i);
+    s[12] = (uint32_t)counter;
+    s[13] = (uint32_t)(counter >> 32);
+    s[14] = load32_le(nonce);
+    s[15] = load32_le(nonce + 4);
+}
+
+// Salsa20: constants on the diagonal, key around them, nonce and counter in the middle
+static void salsa_setup(uint32_t s[16], const uint8_t key[32], const uint8_t nonce[8], uint64_t counter) {
+    s[0] = sigma[0]; s[5] = sigma[1]; s[10] = sigma[2]; s[15] = sigma[3];
+    for (int i = 0; i < 4; i++) s[1 + i] = load32_le(key + 4 * i);
+    for (int i = 0; i < 4; i++) s[11 + i] = load32_le(key + 16 + 4 * i);
+    s[6] = load32_le(nonce);
+    s[7] = load32_le(nonce + 4);
+    s[8] = (uint32_t)counter;
+    s[9] = (uint32_t)(counter >> 32);
+}
+
+/* ------------------------------- One API -------------------------------- */
+typedef enum { CHACHA8, CHACHA12, CHACHA20, SALSA20_8, SALSA20_12, SALSA20_20, STREAM_VARIANTS } stream_variant;
+
+typedef struct {
+    const char *name;
+    int rounds;
+    void (*setup)(uint32_t s[16], const uint8_t key[32], const uint8_t nonce[8], uint64_t counter);
+    void (*xor_blocks)(uint32_t state[16], const uint8_t *in, uint8_t *out, size_t nblocks);
+} stream_info;
+
+static const stream_info stream_variants[STREAM_VARIANTS] = {
+    { "ChaCha8",    8,  chacha_setup, chacha8_xor_blocks },
+    { "ChaCha12",   12, chacha_setup, chacha12_xor_blocks },
+    { "ChaCha20",   20, chacha_setup, chacha20_xor_blocks },
+    { "Salsa20/8",  8,  salsa_setup,  salsa20_8_xor_blocks },
+    { "Salsa20/12", 12, salsa_setup,  salsa20_12_xor_blocks },
+    { "Salsa20/20", 20, salsa_setup,  salsa20_20_xor_blocks },
+};
+
+// The variant is looked up once per call, never per block
+typedef struct {
+    const stream_info *info;
+    uint32_t state[16];
+    uint8_t keystream[64];
+    size_t keystream_pos;       // 64 = nothing buffered
+} stream_ctx;
+
+void stream_init(stream_ctx *ctx, stream_variant variant, const uint8_t key[32], const uint8_t nonce[8], uint64_t counter) {
+    ctx->info = &stream_variants[variant];
+    ctx->info->setup(ctx->state, key, nonce, counter);
+    ctx->keystream_pos = 64;
+}
+
+// Encrypts or decrypts len bytes; calls of any length continue the same stream
+void stream_xor(stream_ctx *ctx, const uint8_t *in, uint8_t *out, size_t len) {
+    while (len > 0 && ctx->keystream_pos < 64) {
+        *out++ = *in++ ^ ctx->keystream[ctx->keystream_pos++];
+        len--;
+    }
+
+    size_t nblocks = len / 64;
+    ctx->info->xor_blocks(ctx->state, in, out, nblocks);
+    in += 64 * nblocks;
+    out += 64 * nblocks;
+    len -= 64 * nblocks;
+
+    if (len > 0) {
+        uint8_t zeros[64] = {0};
+        ctx->info->xor_blocks(ctx->state, zeros, ctx->keystream, 1);
+        for (size_t i = 0; i < len; i++) out[i] = in[i] ^ ctx->keystream[i];
+        ctx->keystream_pos = len;
+    }
+}
+
+// Raw keystream, for PRNG use
+void stream_keystream(stream_ctx *ctx, uint8_t *out, size_t len) {
+    memset(out, 0, len);
+    stream_xor(ctx, out, out, len);
+}
+
+/* ------------------ Runtime round count, for comparison ------------------ */
+// What a single function with a round parameter looks like: the same double
+// round, but the loop bound is only known at run time.
+static void chacha_block_rounds(uint32_t out[16], const uint32_t in[16], int rounds) {
+    uint32_t x[16];
+    for (int i = 0; i < 16; i++) x[i] = in[i];
+    for (int r = 0; r < rounds; r += 2) {
+        CHACHA_DOUBLEROUND(x)
+    }
+    for (int i = 0; i < 16; i++) out[i] = x[i] + in[i];
+}
+
+static void salsa_block_rounds(uint32_t out[16], const uint32_t in[16], int rounds) {
+    uint32_t x[16];
+    for (int i = 0; i < 16; i++) x[i] = in[i];
+    for (int r = 0; r < rounds; r += 2) {
+        SALSA_DOUBLEROUND(x)
+    }
+    for (int i = 0; i < 16; i++) out[i] = x[i] + in[i];
+}
+
+static void runtime_xor_blocks(const stream_info *info, uint32_t state[16], const uint8_t *in, uint8_t *out, size_t nblocks) {
+    int is_chacha = info->setup == chacha_setup;
+    int ctr = is_chacha ? 12 : 8;
+    uint32_t keystream[16];
+    while (nblocks > 0) {
+        if (is_chacha) {
+            chacha_block_rounds(keystream, state, info->rounds);
+        } else {
+            salsa_block_rounds(keystream, state, info->rounds);
+        }
+        for (int i = 0; i < 16; i++) {
+            uint32_t word;
+            memcpy(&word, in + 4 * i, 4);
+            word ^= keystream[i];
+            memcpy(out + 4 * i, &word, 4);
+        }
+        if (++state[ctr] == 0) state[ctr + 1]++;
+        in += 64;
+        out += 64;
+        nblocks--;
+    }
+}
+
+/* ---------------------------- Known answers ------------------------------ */
+// First keystream block, nonce and counter zero. ChaCha uses the all-zero key,
+// Salsa20 the eSTREAM set 1 vector 0 key (0x80 followed by zeros).
+static const uint8_t chacha8_kat[64] = {
+0x3e, 0x00, 0xef, 0x2f, 0x89, 0x5f, 0x40, 0xd6, 0x7f, 0x5b, 0xb8, 0xe8, 0x1f, 0x09, 0xa5, 0xa1,
+0x2c, 0x84, 0x0e, 0xc3, 0xce, 0x9a, 0x7f, 0x3b, 0x18, 0x1b, 0xe1, 0x88, 0xef, 0x71, 0x1a, 0x1e,
+0x98, 0x4c, 0xe1, 0x72, 0xb9, 0x21, 0x6f, 0x41, 0x9f, 0x44, 0x53, 0x67, 0x45, 0x6d, 0x56, 0x19,
+0x31, 0x4a, 0x42, 0xa3, 0xda, 0x86, 0xb0, 0x01, 0x38, 0x7b, 0xfd, 0xb8, 0x0e, 0x0c, 0xfe, 0x42
+};
+static const uint8_t chacha12_kat[64] = {
+0x9b, 0xf4, 0x9a, 0x6a, 0x07, 0x55, 0xf9, 0x53, 0x81, 0x1f, 0xce, 0x12, 0x5f, 0x26, 0x83, 0xd5,
+0x04, 0x29, 0xc3, 0xbb, 0x49, 0xe0, 0x74, 0x14, 0x7e, 0x00, 0x89, 0xa5, 0x2e, 0xae, 0x15, 0x5f,
+0x05, 0x64, 0xf8, 0x79, 0xd2, 0x7a, 0xe3, 0xc0, 0x2c, 0xe8, 0x28, 0x34, 0xac, 0xfa, 0x8c, 0x79,
+0x3a, 0x62, 0x9f, 0x2c, 0xa0, 0xde, 0x69, 0x19, 0x61, 0x0b, 0xe8, 0x2f, 0x41, 0x13, 0x26, 0xbe
+};
+static const uint8_t chacha20_kat[64] = {
+0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90, 0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28,
+0xbd, 0xd2, 0x19, 0xb8, 0xa0, 0x8d, 0xed, 0x1a, 0xa8, 0x36, 0xef, 0xcc, 0x8b, 0x77, 0x0d, 0xc7,
+0xda, 0x41, 0x59, 0x7c, 0x51, 0x57, 0x48, 0x8d, 0x77, 0x24, 0xe0, 0x3f, 0xb8, 0xd8, 0x4a, 0x37,
+0x6a, 0x43, 0xb8, 0xf4, 0x15, 0x18, 0xa1, 0x1c, 0xc3, 0x87, 0xb6, 0x69, 0xb2, 0xee, 0x65, 0x86
+};
+static const uint8_t salsa20_8_kat[64] = {
+0xb1, 0xf5, 0x99, 0xe9, 0xb0, 0xd9, 0x6d, 0xf4, 0x36, 0xae, 0x31, 0xf5, 0xef, 0x58, 0x95, 0x65,
+0xb9, 0x2d, 0x24, 0x5d, 0xb5, 0xa1, 0xd4, 0xc7, 0xa7, 0x8e, 0x5e, 0x8d, 0x01, 0x46, 0xf8, 0xa4,
+0x9d, 0x32, 0x6c, 0x1a, 0x3b, 0xf5, 0x0c, 0x05, 0x2c, 0x9c, 0x8f, 0x11, 0x4d, 0xc7, 0x49, 0x72,
+0xc4, 0x46, 0x95, 0x91, 0xe3, 0x1c, 0x9e, 0xd1, 0x19, 0x27, 0xaa, 0x98, 0x71, 0xf3, 0x85, 0x83
+};
+static const uint8_t salsa20_12_kat[64] = {
+0xaf, 0xe4, 0x11, 0xed, 0x1c, 0x4e, 0x07, 0xe4, 0xd0, 0xcd, 0xe3, 0xb3, 0x3e, 0x31, 0xec, 0x19,
+0x0f, 0xa4, 0xcc, 0x79, 0x6a, 0x58, 0xba, 0xfb, 0x84, 0x8e, 0xad, 0x8d, 0x07, 0xd0, 0x2c, 0xd2,
+0xd4, 0xb6, 0xf9, 0xf3, 0x0c, 0xb0, 0xb5, 0x70, 0x07, 0xe3, 0x73, 0x38, 0x95, 0xcc, 0x8d, 0x10,
+0x60, 0x10, 0x79, 0x75, 0xac, 0xae, 0xeb, 0x68, 0x9b, 0x6c, 0xf6, 0x14, 0xab, 0x64, 0xa3, 0xd6
+};
+static const uint8_t salsa20_20_kat[64] = {
+0xe3, 0xbe, 0x8f, 0xdd, 0x8b, 0xec, 0xa2, 0xe3, 0xea, 0x8e, 0xf9, 0x47, 0x5b, 0x29, 0xa6, 0xe7,
+0x00, 0x39, 0x51, 0xe1, 0x09, 0x7a, 0x5c, 0x38, 0xd2, 0x3b, 0x7a, 0x5f, 0xad, 0x9f, 0x68, 0x44,
+0xb2, 0x2c, 0x97, 0x55, 0x9e, 0x27, 0x23, 0xc7, 0xcb, 0xbd, 0x3f, 0xe4, 0xfc, 0x8d, 0x9a, 0x07,
+0x44, 0x65, 0x2a, 0x83, 0xe7, 0x2a, 0x9c, 0x46, 0x18, 0x76, 0xaf, 0x4d, 0x7e, 0xf1, 0xa1, 0x17
+};
+
+static const uint8_t *known_answers[STREAM_VARIANTS] = {
+    chacha8_kat, chacha12_kat, chacha20_kat, salsa20_8_kat, salsa20_12_kat, salsa20_20_kat
+};
+
+/*
+RC4: the three examples on Wikipedia's RC4 page, the first 32 keystream
+bytes for the 40-bit key 0102030405 from RFC 6229, and RC4-drop[1536] with
+the 128-bit key 0102...10, which must give RFC 6229's bytes at offset 1536.
+*/
+static int rc4_kats(void) {
+    static const struct {
+        const char *key;
+        const char *plaintext;
+        uint8_t ciphertext[16];
+    } wiki[] = {
+        { "Key", "Plaintext", { 0xbb, 0xf3, 0x16, 0xe8, 0xd9, 0x40, 0xaf, 0x0a, 0xd3 } },
+        { "Wiki", "pedia", { 0x10, 0x21, 0xbf, 0x04, 0x20 } },
+        { "Secret", "Attack at dawn",
+          { 0x45, 0xa0, 0x1f, 0x64, 0x5f, 0xc3, 0x5b, 0x38, 0x35, 0x52, 0x54, 0x4b, 0x9b, 0xf5 } },
+    };
+    static const uint8_t key40[5] = { 0x01, 0x02, 0x03, 0x04, 0x05 };
+    static const uint8_t key40_stream[32] = {
+    0xb2, 0x39, 0x63, 0x05, 0xf0, 0x3d, 0xc0, 0x27, 0xcc, 0xc3, 0x52, 0x4a, 0x0a, 0x11, 0x18, 0xa8,
+    0x69, 0x82, 0x94, 0x4f, 0x18, 0xfc, 0x82, 0xd5, 0x89, 0xc4, 0x03, 0xa4, 0x7a, 0x0d, 0x09, 0x19
+    };
+    static const uint8_t key128_stream_1536[16] = {
+    0xff, 0xa0, 0xb5, 0x14, 0x64, 0x7e, 0xc0, 0x4f, 0x63, 0x06, 0xb8, 0x92, 0xae, 0x66, 0x11, 0x81
+    };
+    uint8_t buf[32], key128[16];
+    rc4_ctx ctx;
+    int ok = 1;
+
+    for (size_t t = 0; t < sizeof wiki / sizeof wiki[0]; t++) {
+        size_t len = strlen(wiki[t].plaintext);
+        rc4_init(&ctx, (const uint8_t *)wiki[t].key, strlen(wiki[t].key));
+        rc4_xor(&ctx, (const uint8_t *)wiki[t].plaintext, buf, len);
+        ok &= memcmp(buf, wiki[t].ciphertext, len) == 0;
+    }
+
+    // In two uneven calls, so the stream has to carry over
+    memset(buf, 0, sizeof buf);
+    rc4_init(&ctx, key40, sizeof key40);
+    rc4_xor(&ctx, buf, buf, 7);
+    rc4_xor(&ctx, buf + 7, buf + 7, 25);
+    ok &= memcmp(buf, key40_stream, 32) == 0;
+
+    for (int i = 0; i < 16; i++) key128[i] = (uint8_t)(i + 1);
+    memset(buf, 0, 16);
+    rc4_init_drop(&ctx, key128, sizeof key128, 1536);
+    rc4_xor(&ctx, buf, buf, 16);
+    ok &= memcmp(buf, key128_stream_1536, 16) == 0;
+    return ok;
+}
+
+// Every lane of the multi-stream engine against rc4_xor with the same key
+static int rc4_multi_matches(int lanes) {
+    uint8_t keys[RC4_MAX_LANES][16], in[RC4_MAX_LANES][1000], out[RC4_MAX_LANES][1000], expected[1000];
+    const uint8_t *key_ptrs[RC4_MAX_LANES], *in_ptrs[RC4_MAX_LANES];
+    uint8_t *out_ptrs[RC4_MAX_LANES];
+    size_t key_lens[RC4_MAX_LANES];
+    rc4_multi_ctx multi;
+    int ok = 1;
+
+    for (int l = 0; l < lanes; l++) {
+        for (int i = 0; i < 16; i++) keys[l][i] = (uint8_t)(31 * l + 7 * i);
+        for (int i = 0; i < 1000; i++) in[l][i] = (uint8_t)(l + i);
+        key_ptrs[l] = keys[l];
+        key_lens[l] = 5 + l;    // different key lengths too
+        in_ptrs[l] = in[l];
+        out_ptrs[l] = out[l];
+    }
+    rc4_multi_init(&multi, lanes, key_ptrs, key_lens, 768);
+    rc4_multi_xor(&multi, in_ptrs, out_ptrs, 333);
+    for (int l = 0; l < lanes; l++) {
+        in_ptrs[l] += 333;
+        out_ptrs[l] += 333;
+    }
+    rc4_multi_xor(&multi, in_ptrs, out_ptrs, 1000 - 333);
+
+    for (int l = 0; l < lanes; l++) {
+        rc4_ctx ctx;
+        rc4_init_drop(&ctx, keys[l], key_lens[l], 768);
+        rc4_xor(&ctx, in[l], expected, 1000);
+        ok &= memcmp(out[l], expected, 1000) == 0;
+    }
+    return ok;
+}
+
+/* ------------------------------- Benchmark ------------------------------- */
+#define BENCH_BYTES (64 * 1024)     // stays in L2, so the rounds dominate
+#define BENCH_TRIALS 2000
+
+/*
+RC4 over the same 64 KiB per trial. With several lanes each lane gets its
+own slice of the buffer, so cycles per byte count the bytes of all lanes.
+Returns 1 if all known answers matched.
+*/
+static int benchmark_rc4(uint8_t *buffer) {
+    static const int lane_counts[] = { 1, 4, 6, 8 };
+    int all_ok = rc4_kats();
+
+    printf("\n%-11s %6s %6s %13s %13s %13s\n", "variant", "lanes", "KAT", "min cyc/B", "avg cyc/B", "max cyc/B");
+    for (size_t v = 0; v < sizeof lane_counts / sizeof lane_counts[0]; v++) {
+        int lanes = lane_counts[v];
+        size_t lane_bytes = BENCH_BYTES / (size_t)lanes;
+        const uint8_t *keys[RC4_MAX_LANES], *in[RC4_MAX_LANES];
+        uint8_t *out[RC4_MAX_LANES], key[16] = {0};
+        size_t key_lens[RC4_MAX_LANES];
+        rc4_multi_ctx multi;
+        rc4_ctx single;
+
+        for (int l = 0; l < lanes; l++) {
+            keys[l] = key;
+            key_lens[l] = sizeof key;
+            in[l] = buffer + l * lane_bytes;
+            out[l] = buffer + l * lane_bytes;
+        }
+        rc4_init(&single, key, sizeof key);
+        rc4_multi_init(&multi, lanes, keys, key_lens, 0);
+        int ok = lanes == 1 ? all_ok : rc4_multi_matches(lanes);
+        all_ok &= ok;
+
+        unsigned long long min_cycles = ULLONG_MAX, max_cycles = 0, total_cycles = 0;
+        for (int t = 0; t < BENCH_TRIALS; t++) {
+            unsigned long long start = __rdtsc();
+            if (lanes == 1) rc4_xor(&single, buffer, buffer, BENCH_BYTES);
+            else rc4_multi_xor(&multi, in, out, lane_bytes);
+            unsigned long long cycles = __rdtsc() - start;
+            if (cycles < min_cycles) min_cycles = cycles;
+            if (cycles > max_cycles) max_cycles = cycles;
+            total_cycles += cycles;
+        }
+        size_t bytes = lanes * lane_bytes;
+        printf("%-11s %6d %6s %13.2f %13.2f %13.2f\n", "RC4", lanes, ok ? "OK" : "FAIL",
+               (double)min_cycles / bytes, (double)total_cycles / BENCH_TRIALS / bytes, (double)max_cycles / bytes);
+    }
+    return all_ok;
+}
+
+int main(void) {
+    static uint8_t buffer[BENCH_BYTES];
+    uint8_t key[32] = {0}, nonce[8] = {0}, first[64];
+    stream_ctx ctx;
+    int all_ok = 1;
+
+    printf("%-11s %6s %6s %13s %13s %13s %13s %13s\n", "variant", "rounds", "KAT",
+           "min cyc/B", "avg cyc/B", "max cyc/B", "runtime min", "runtime avg");
+
+    for (int v = 0; v < STREAM_VARIANTS; v++) {
+        const stream_info *info = &stream_variants[v];
+
+        memset(key, 0, sizeof key);
+        if (info->setup == salsa_setup) key[0] = 0x80;
+        stream_init(&ctx, v, key, nonce, 0);
+        stream_keystream(&ctx, first, sizeof first);
+        int ok = memcmp(first, known_answers[v], 64) == 0;
+        all_ok &= ok;
+
+        // Compile-time variant through the API against the same rounds with the
+        // count as a run-time parameter, over the same 64 KiB buffer. Trials
+        // alternate so both see the same clock and cache conditions
+        uint32_t state[16];
+        info->setup(state, key, nonce, 0);
+        unsigned long long min_cycles = ULLONG_MAX, max_cycles = 0, total_cycles = 0;
+        unsigned long long runtime_min = ULLONG_MAX, runtime_total = 0;
+        for (int t = 0; t < BENCH_TRIALS; t++) {
+            unsigned long long start = __rdtsc();
+            stream_xor(&ctx, buffer, buffer, BENCH_BYTES);
+            unsigned long long cycles = __rdtsc() - start;
+            if (cycles < min_cycles) min_cycles = cycles;
+            if (cycles > max_cycles) max_cycles = cycles;
+            total_cycles += cycles;
+
+            start = __rdtsc();
+            runtime_xor_blocks(info, state, buffer, buffer, BENCH_BYTES / 64);
+            cycles = __rdtsc() - start;
+            if (cycles < runtime_min) runtime_min = cycles;
+            runtime_total += cycles;
+        }
+
+        printf("%-11s %6d %6s %13.2f %13.2f %13.2f %13.2f %13.2f\n", info->name, info->rounds, ok ? "OK" : "FAIL",
+               (double)min_cycles / BENCH_BYTES, (double)total_cycles / BENCH_TRIALS / BENCH_BYTES,
+               (double)max_cycles / BENCH_BYTES, (double)runtime_min / BENCH_BYTES,
+               (double)runtime_total / BENCH_TRIALS / BENCH_BYTES);
+    }
+
+    all_ok &= benchmark_rc4(buffer);
+
+    printf("\n%s\n", all_ok ? "All known-answer tests passed." : "Some known-answer tests FAILED!");
+    return all_ok ? 0 : 1;
+}
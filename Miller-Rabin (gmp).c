@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <x86intrin.h>
 #include <time.h>
+#include "chacha_rng.h"
+#include "prime_sieve.h"
 
 #define PRIME_BITS 256     // size of primes
 #define RUNS 100000          // number of MR trials on composite
@@ -11,14 +13,14 @@
 //------------------------------------------------------------
 // Miller-Rabin test (one iteration)
 //------------------------------------------------------------
-int millerTest(const mpz_t d, const mpz_t n, gmp_randstate_t state) {
+int millerTest(const mpz_t d, const mpz_t n, chacha_rng *rng) {
     mpz_t a, x, n_minus_1, temp;
     mpz_inits(a, x, n_minus_1, temp, NULL);
 
     mpz_sub_ui(n_minus_1, n, 1);
 
     // Random base in [2, n-2]
-    mpz_urandomm(a, state, n_minus_1);
+    chacha_rng_urandomm(a, rng, n_minus_1);
     if (mpz_cmp_ui(a, 2) < 0) mpz_add_ui(a, a, 2);
 
     mpz_powm(x, a, d, n);
@@ -50,7 +52,7 @@ int millerTest(const mpz_t d, const mpz_t n, gmp_randstate_t state) {
 //------------------------------------------------------------
 // Miller-Rabin primality test (k iterations)
 //------------------------------------------------------------
-int isPrime(const mpz_t n, int k, gmp_randstate_t state) {
+int isPrime(const mpz_t n, int k, chacha_rng *rng) {
     if (mpz_cmp_ui(n, 1) <= 0) return 0;
     if (mpz_cmp_ui(n, 3) <= 0) return 1;
 
@@ -63,7 +65,7 @@ int isPrime(const mpz_t n, int k, gmp_randstate_t state) {
         mpz_divexact_ui(d, d, 2);
 
     for (int i = 0; i < k; i++) {
-        if (!millerTest(d, n, state)) {
+        if (!millerTest(d, n, rng)) {
             mpz_clears(d, n_minus_1, NULL);
             return 0;
         }
@@ -74,30 +76,45 @@ int isPrime(const mpz_t n, int k, gmp_randstate_t state) {
 }
 
 //------------------------------------------------------------
-// Generate a random probable prime of given bit size
+// Sieve survivor test: one Miller-Rabin round, one powm
 //------------------------------------------------------------
-void generate_prime(mpz_t prime, int bits, gmp_randstate_t state) {
-    do {
-        mpz_urandomb(prime, state, bits);
-        mpz_setbit(prime, bits - 1); // force MSB
-        mpz_setbit(prime, 0);        // force odd
-    } while (!isPrime(prime, 1, state)); // 20 rounds for generation
+static int sieve_test(const mpz_t n, void *arg, uint64_t *powm_calls) {
+    (*powm_calls)++;
+    return isPrime(n, 1, (chacha_rng *)arg);
+}
+
+//------------------------------------------------------------
+// Generate a random probable prime of the sieve's bit size:
+// sieve survivors from a random base go to one MR round
+//------------------------------------------------------------
+void generate_prime(mpz_t prime, prime_sieve *sieve, chacha_rng *rng) {
+    prime_sieve_next(sieve, prime, rng, sieve_test, rng);
 }
 
 //------------------------------------------------------------
 // Main
 //------------------------------------------------------------
 int main() {
-    gmp_randstate_t state;
-    gmp_randinit_mt(state);
-    gmp_randseed_ui(state, time(NULL));
+    // ChaCha20 CSPRNG seeded from getrandom (see chacha_rng.h)
+    chacha_rng rng;
+    if (chacha_rng_init(&rng) != 0) {
+        perror("getrandom");
+        return 1;
+    }
+
+    prime_sieve sieve;
+    if (prime_sieve_init(&sieve, PRIME_BITS, 0) != 0) {
+        fprintf(stderr, "prime_sieve_init failed\n");
+        return 1;
+    }
 
     mpz_t p, q, n, d, n_minus_1;
     mpz_inits(p, q, n, d, n_minus_1, NULL);
 
     // Step 1: generate two 256-bit primes
-    generate_prime(p, PRIME_BITS, state);
-    generate_prime(q, PRIME_BITS, state);
+    generate_prime(p, &sieve, &rng);
+    generate_prime(q, &sieve, &rng);
+    prime_sieve_report(&sieve, "Prime generation");
 
     // Step 2: multiply to get composite
     mpz_mul(n, p, q);
@@ -123,7 +140,7 @@ int main() {
     // Step 4: run many single-round MR tests
     int lies = 0;
     for (int i = 0; i < RUNS; i++) {
-        if (millerTest(d, n, state)) {
+        if (millerTest(d, n, &rng)) {
             lies++;
         }
     }
@@ -139,7 +156,8 @@ int main() {
 
     // Cleanup
     mpz_clears(p, q, n, d, n_minus_1, NULL);
-    gmp_randclear(state);
+    prime_sieve_free(&sieve);
+    chacha_rng_wipe(&rng, sizeof rng);
 
     return 0;
 }
@@ -1,7 +1,28 @@
+/*
+ * Salsa20 stream cipher (256-bit key, 64-bit nonce, 64-bit block counter)
+ * with scalar, SSE2 and AVX2 multi-block kernels, HSalsa20/XSalsa20 and the
+ * NaCl secretbox (XSalsa20-Poly1305) with batched open, and the scrypt KDF
+ * on the Salsa20/8 core.
+ *
+ * Build:
+ *   gcc -O3 -pthread "Salsa20 (gmp).c" -o salsa20
+ *
+ * Run:
+ *   ./salsa20        test vectors, kernel cross-check and benchmarks
+ */
+
 #include <stdint.h>  // For fixed-width integer types like uint32_t
 #include <stdio.h>   // For printf in the main function
+#include <stdlib.h>  // For malloc in the benchmarks
+#include <string.h>  // For memcmp / memcpy
 #include <x86intrin.h>  // For __rdtsc() to measure CPU cycles (x86-specific)
 #include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "poly1305.h"
 
 // Macro for left rotation of a 32-bit value 'a' by 'b' bits.
 // This is a common operation in ARX-based ciphers like Salsa20.
@@ -24,13 +45,11 @@
 // Salsa20/r uses r rounds; 20 is the standard for 256-bit security.
 #define ROUNDS 20
 
-// Core Salsa20 block function.
-// Inputs: 'in' is a 16-element array of 32-bit words (512 bits total),
-//         derived from the 256-bit key, 64-bit nonce, and 64-bit counter.
-// Outputs: 'out' is the 512-bit keystream block.
-// This function performs the Salsa20 hash: mixes the input over 20 rounds,
-// then adds back the original input to make it a one-way function.
-void salsa20_block(uint32_t out[16], const uint32_t in[16]) {
+// Salsa20 core with a given (even) number of rounds.
+// Inputs: 'in' is a 16-element array of 32-bit words (512 bits total).
+// Outputs: 'out' is the mixed block with the input added back.
+// salsa20_block uses 20 rounds; scrypt uses the same core with 8.
+static inline void salsa20_core(uint32_t out[16], const uint32_t in[16], int rounds) {
     int i;
     uint32_t x[16];  // Working copy of the input to mix in-place.
 
@@ -40,12 +59,12 @@ void salsa20_block(uint32_t out[16], const uint32_t in[16]) {
         x[i] = in[i];
     }
 
-    // Perform 20 rounds of mixing.
+    // Perform the rounds of mixing.
     // Loops in steps of 2: each iteration does an "odd" (column) round
     // followed by an "even" (row) round. This double-round structure
     // alternates between updating columns and rows of the 4x4 matrix
     // (viewed as 32-bit words) for full diffusion.
-    for (i = 0; i < ROUNDS; i += 2) {
+    for (i = 0; i < rounds; i += 2) {
         // Odd round: Apply QR to each column of the 4x4 matrix.
         // This mixes vertically.
         QR(x[ 0], x[ 4], x[ 8], x[12]);  // Column 0
@@ -69,21 +88,1463 @@ void salsa20_block(uint32_t out[16], const uint32_t in[16]) {
     }
 }
 
-// Example main function to demonstrate usage and measure performance.
-// This sets up a dummy input (all zeros for simplicity), runs the block
-// function 100,000 times, and measures CPU cycles using RDTSC (x86 only).
-// Compile with: gcc -O3 -o salsa20 salsa20.c
+// Core Salsa20 block function.
+// Inputs: 'in' is a 16-element array of 32-bit words (512 bits total),
+//         derived from the 256-bit key, 64-bit nonce, and 64-bit counter.
+// Outputs: 'out' is the 512-bit keystream block.
+// This function performs the Salsa20 hash: mixes the input over 20 rounds,
+// then adds back the original input to make it a one-way function.
+void salsa20_block(uint32_t out[16], const uint32_t in[16]) {
+    salsa20_core(out, in, ROUNDS);
+}
+
+
+static uint32_t load32_le(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Moves the 64-bit block counter (words 8 and 9, low word first) on by n
+static void salsa20_advance(uint32_t state[16], uint64_t n) {
+    uint64_t counter = (((uint64_t)state[9] << 32) | state[8]) + n;
+    state[8] = (uint32_t)counter;
+    state[9] = (uint32_t)(counter >> 32);
+}
+
+/*
+Builds the input block from the key, nonce and block counter.
+The four "expand 32-byte k" constants sit on the diagonal (words 0, 5, 10, 15),
+the key fills words 1..4 and 11..14, the nonce words 6..7 and the 64-bit
+counter words 8..9.
+*/
+void salsa20_setup(uint32_t state[16], const uint8_t key[32], const uint8_t nonce[8], uint64_t counter) {
+    state[0] = 0x61707865;  // "expa"
+    state[5] = 0x3320646e;  // "nd 3"
+    state[10] = 0x79622d32; // "2-by"
+    state[15] = 0x6b206574; // "te k"
+    for (int i = 0; i < 4; i++) {
+        state[1 + i] = load32_le(key + 4 * i);
+        state[11 + i] = load32_le(key + 16 + 4 * i);
+    }
+    state[6] = load32_le(nonce);
+    state[7] = load32_le(nonce + 4);
+    state[8] = (uint32_t)counter;
+    state[9] = (uint32_t)(counter >> 32);
+}
+
+/*
+Scalar multi-block path: XORs nblocks * 64 bytes of 'in' with consecutive
+salsa20_block outputs and steps the counter. It is also the tail path of the
+SIMD kernels, for the blocks left over after their 4- or 8-block steps.
+*/
+static void salsa20_blocks_scalar(uint32_t state[16], const uint8_t *in, uint8_t *out, size_t nblocks) {
+    uint32_t block[16];
+
+    while (nblocks > 0) {
+        salsa20_block(block, state);
+        for (int i = 0; i < 16; i++) {
+            out[4 * i] = in[4 * i] ^ (uint8_t)block[i];
+            out[4 * i + 1] = in[4 * i + 1] ^ (uint8_t)(block[i] >> 8);
+            out[4 * i + 2] = in[4 * i + 2] ^ (uint8_t)(block[i] >> 16);
+            out[4 * i + 3] = in[4 * i + 3] ^ (uint8_t)(block[i] >> 24);
+        }
+        salsa20_advance(state, 1);
+        in += 64;
+        out += 64;
+        nblocks--;
+    }
+}
+
+/*
+SSE2 kernel: 4 blocks per step, each block in the diagonal-word layout.
+A block lives in four vectors arranged so that the four quarter-rounds of a
+column round line up lane by lane:
+    a0 = (x0, x5, x10, x15)    a1 = (x12, x1, x6, x11)
+    a2 = (x8, x13, x2, x7)     a3 = (x4, x9, x14, x3)
+For the row round, a1..a3 are rotated by one, two and three lanes (one
+pshufd each) and rotated back afterwards. The four blocks are independent,
+so their instruction streams interleave and hide the latency of each chain.
+*/
+#define ROTL_SSE2(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+#define DOUBLEROUND_SSE2(a0, a1, a2, a3) \
+    a3 = _mm_xor_si128(a3, ROTL_SSE2(_mm_add_epi32(a0, a1), 7)); \
+    a2 = _mm_xor_si128(a2, ROTL_SSE2(_mm_add_epi32(a3, a0), 9)); \
+    a1 = _mm_xor_si128(a1, ROTL_SSE2(_mm_add_epi32(a2, a3), 13)); \
+    a0 = _mm_xor_si128(a0, ROTL_SSE2(_mm_add_epi32(a1, a2), 18)); \
+    a1 = _mm_shuffle_epi32(a1, 0x39); \
+    a2 = _mm_shuffle_epi32(a2, 0x4e); \
+    a3 = _mm_shuffle_epi32(a3, 0x93); \
+    a1 = _mm_xor_si128(a1, ROTL_SSE2(_mm_add_epi32(a0, a3), 7)); \
+    a2 = _mm_xor_si128(a2, ROTL_SSE2(_mm_add_epi32(a1, a0), 9)); \
+    a3 = _mm_xor_si128(a3, ROTL_SSE2(_mm_add_epi32(a2, a1), 13)); \
+    a0 = _mm_xor_si128(a0, ROTL_SSE2(_mm_add_epi32(a3, a2), 18)); \
+    a1 = _mm_shuffle_epi32(a1, 0x93); \
+    a2 = _mm_shuffle_epi32(a2, 0x4e); \
+    a3 = _mm_shuffle_epi32(a3, 0x39);
+
+#define DIAGONAL_SSE2(x, a) \
+    a[0] = _mm_setr_epi32((int)x[0], (int)x[5], (int)x[10], (int)x[15]); \
+    a[1] = _mm_setr_epi32((int)x[12], (int)x[1], (int)x[6], (int)x[11]); \
+    a[2] = _mm_setr_epi32((int)x[8], (int)x[13], (int)x[2], (int)x[7]); \
+    a[3] = _mm_setr_epi32((int)x[4], (int)x[9], (int)x[14], (int)x[3]);
+
+// Lane j of p, q, r, s for j = 0, 1, 2, 3: one row of the block in natural order
+#define SELECT_SSE2(p, q, r, s) \
+    _mm_or_si128(_mm_or_si128(_mm_and_si128(p, lane[0]), _mm_and_si128(q, lane[1])), \
+                 _mm_or_si128(_mm_and_si128(r, lane[2]), _mm_and_si128(s, lane[3])))
+
+#define XOR16_SSE2(dst, src, v) \
+    _mm_storeu_si128((__m128i *)(dst), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src)), v))
+
+// Feedforward, back to natural word order, and XOR into one 64-byte block
+#define OUTPUT_SSE2(x, input, dst, src) do { \
+    __m128i x0 = _mm_add_epi32(x[0], input[0]), x1 = _mm_add_epi32(x[1], input[1]); \
+    __m128i x2 = _mm_add_epi32(x[2], input[2]), x3 = _mm_add_epi32(x[3], input[3]); \
+    XOR16_SSE2(dst, src, SELECT_SSE2(x0, x1, x2, x3)); \
+    XOR16_SSE2((dst) + 16, (src) + 16, SELECT_SSE2(x3, x0, x1, x2)); \
+    XOR16_SSE2((dst) + 32, (src) + 32, SELECT_SSE2(x2, x3, x0, x1)); \
+    XOR16_SSE2((dst) + 48, (src) + 48, SELECT_SSE2(x1, x2, x3, x0)); \
+} while (0)
+
+static void salsa20_blocks_sse2(uint32_t state[16], const uint8_t *in, uint8_t *out, size_t nblocks) {
+    const __m128i lane[4] = {
+        _mm_setr_epi32(-1, 0, 0, 0), _mm_setr_epi32(0, -1, 0, 0),
+        _mm_setr_epi32(0, 0, -1, 0), _mm_setr_epi32(0, 0, 0, -1)
+    };
+    __m128i input[4][4], a[4], b[4], c[4], d[4];
+    int i;
+
+    while (nblocks >= 4) {
+        for (i = 0; i < 4; i++) {
+            DIAGONAL_SSE2(state, input[i]);
+            salsa20_advance(state, 1);
+        }
+        for (i = 0; i < 4; i++) {
+            a[i] = input[0][i];
+            b[i] = input[1][i];
+            c[i] = input[2][i];
+            d[i] = input[3][i];
+        }
+
+        for (i = 0; i < ROUNDS; i += 2) {
+            DOUBLEROUND_SSE2(a[0], a[1], a[2], a[3]);
+            DOUBLEROUND_SSE2(b[0], b[1], b[2], b[3]);
+            DOUBLEROUND_SSE2(c[0], c[1], c[2], c[3]);
+            DOUBLEROUND_SSE2(d[0], d[1], d[2], d[3]);
+        }
+
+        OUTPUT_SSE2(a, input[0], out, in);
+        OUTPUT_SSE2(b, input[1], out + 64, in + 64);
+        OUTPUT_SSE2(c, input[2], out + 128, in + 128);
+        OUTPUT_SSE2(d, input[3], out + 192, in + 192);
+        in += 256;
+        out += 256;
+        nblocks -= 4;
+    }
+}
+
+/*
+AVX2 kernel: 8 consecutive blocks (512 bytes) per step, word-sliced:
+v[i] holds word i of all 8 blocks, one block per 32-bit lane, so the scalar
+QR index pattern is used unchanged on whole vectors and no shuffles are
+needed inside the rounds. The 64-bit counter is split per lane with a carry
+into word 9, and the output is transposed back to block order at the end.
+*/
+#define ROTL_AVX2(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+
+#define QR_AVX2(a, b, c, d) \
+    b = _mm256_xor_si256(b, ROTL_AVX2(_mm256_add_epi32(a, d), 7)); \
+    c = _mm256_xor_si256(c, ROTL_AVX2(_mm256_add_epi32(b, a), 9)); \
+    d = _mm256_xor_si256(d, ROTL_AVX2(_mm256_add_epi32(c, b), 13)); \
+    a = _mm256_xor_si256(a, ROTL_AVX2(_mm256_add_epi32(d, c), 18));
+
+// Transposes 8 vectors of "word i of blocks 0..7" into 8 vectors of "words of block j"
+#define TRANSPOSE8_AVX2(x0, x1, x2, x3, x4, x5, x6, x7) do { \
+    __m256i t0 = _mm256_unpacklo_epi32(x0, x1), t1 = _mm256_unpackhi_epi32(x0, x1); \
+    __m256i t2 = _mm256_unpacklo_epi32(x2, x3), t3 = _mm256_unpackhi_epi32(x2, x3); \
+    __m256i t4 = _mm256_unpacklo_epi32(x4, x5), t5 = _mm256_unpackhi_epi32(x4, x5); \
+    __m256i t6 = _mm256_unpacklo_epi32(x6, x7), t7 = _mm256_unpackhi_epi32(x6, x7); \
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2); \
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3); \
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6); \
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7); \
+    x0 = _mm256_permute2x128_si256(u0, u4, 0x20); x4 = _mm256_permute2x128_si256(u0, u4, 0x31); \
+    x1 = _mm256_permute2x128_si256(u1, u5, 0x20); x5 = _mm256_permute2x128_si256(u1, u5, 0x31); \
+    x2 = _mm256_permute2x128_si256(u2, u6, 0x20); x6 = _mm256_permute2x128_si256(u2, u6, 0x31); \
+    x3 = _mm256_permute2x128_si256(u3, u7, 0x20); x7 = _mm256_permute2x128_si256(u3, u7, 0x31); \
+} while (0)
+
+#define XOR32_AVX2(dst, src, v) \
+    _mm256_storeu_si256((__m256i *)(dst), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src)), v))
+
+__attribute__((target("avx2")))
+static void salsa20_blocks_avx2(uint32_t state[16], const uint8_t *in, uint8_t *out, size_t nblocks) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i sign = _mm256_set1_epi32((int)0x80000000);
+    __m256i input[16], v[16];
+    int i;
+
+    for (i = 0; i < 16; i++) input[i] = _mm256_set1_epi32((int)state[i]);
+
+    while (nblocks >= 8) {
+        // Low counter word per lane; lanes that wrapped past 2^32 carry into word 9
+        __m256i low = _mm256_set1_epi32((int)state[8]);
+        input[8] = _mm256_add_epi32(low, lanes);
+        __m256i carry = _mm256_cmpgt_epi32(_mm256_xor_si256(low, sign), _mm256_xor_si256(input[8], sign));
+        input[9] = _mm256_sub_epi32(_mm256_set1_epi32((int)state[9]), carry);
+        for (i = 0; i < 16; i++) v[i] = input[i];
+
+        for (i = 0; i < ROUNDS; i += 2) {
+            QR_AVX2(v[0], v[4], v[8], v[12]);
+            QR_AVX2(v[5], v[9], v[13], v[1]);
+            QR_AVX2(v[10], v[14], v[2], v[6]);
+            QR_AVX2(v[15], v[3], v[7], v[11]);
+            QR_AVX2(v[0], v[1], v[2], v[3]);
+            QR_AVX2(v[5], v[6], v[7], v[4]);
+            QR_AVX2(v[10], v[11], v[8], v[9]);
+            QR_AVX2(v[15], v[12], v[13], v[14]);
+        }
+
+        for (i = 0; i < 16; i++) v[i] = _mm256_add_epi32(v[i], input[i]);
+
+        // After the transposes v[j] is the first half of block j and v[8 + j] the second
+        TRANSPOSE8_AVX2(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
+        TRANSPOSE8_AVX2(v[8], v[9], v[10], v[11], v[12], v[13], v[14], v[15]);
+        for (i = 0; i < 8; i++) {
+            XOR32_AVX2(out + 64 * i, in + 64 * i, v[i]);
+            XOR32_AVX2(out + 64 * i + 32, in + 64 * i + 32, v[8 + i]);
+        }
+
+        salsa20_advance(state, 8);
+        in += 512;
+        out += 512;
+        nblocks -= 8;
+    }
+}
+
+/*
+Backend selection. SSE2 is part of x86-64, so it is the floor; AVX2 is
+picked at run time when the CPU has it. main() can override salsa20_backend
+to compare kernels against each other.
+*/
+enum { SALSA20_SCALAR, SALSA20_SSE2, SALSA20_AVX2 };
+static const char *salsa20_backend_names[] = { "scalar", "SSE2", "AVX2" };
+static int salsa20_backend = -1;
+
+static int salsa20_best_backend(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SALSA20_AVX2;
+    return SALSA20_SSE2;
+}
+
+/*
+Multi-block core: XORs nblocks * 64 bytes of 'in' with consecutive keystream
+blocks starting at the counter in state[8..9], and leaves the counter at the
+next unused block. 'in' and 'out' may be the same buffer.
+*/
+void salsa20_blocks(uint32_t state[16], const uint8_t *in, uint8_t *out, size_t nblocks) {
+    if (salsa20_backend < 0) salsa20_backend = salsa20_best_backend();
+
+    if (salsa20_backend == SALSA20_AVX2 && nblocks >= 8) {
+        size_t bulk = nblocks & ~(size_t)7;
+        salsa20_blocks_avx2(state, in, out, bulk);
+        in += 64 * bulk;
+        out += 64 * bulk;
+        nblocks -= bulk;
+    }
+    if (salsa20_backend >= SALSA20_SSE2 && nblocks >= 4) {
+        size_t bulk = nblocks & ~(size_t)3;
+        salsa20_blocks_sse2(state, in, out, bulk);
+        in += 64 * bulk;
+        out += 64 * bulk;
+        nblocks -= bulk;
+    }
+    salsa20_blocks_scalar(state, in, out, nblocks);
+}
+
+/*
+Streaming context: set up once by salsa20_init, then any number of
+salsa20_update calls of any length continue the same keystream.
+keystream[] keeps the unused tail of the last partial block; keystream_pos is
+how much of it is already consumed (64 means nothing is buffered).
+*/
+typedef struct {
+    uint32_t state[16];
+    uint8_t keystream[64];
+    size_t keystream_pos;
+} salsa20_ctx;
+
+void salsa20_init(salsa20_ctx *ctx, const uint8_t key[32], const uint8_t nonce[8], uint64_t counter) {
+    salsa20_setup(ctx->state, key, nonce, counter);
+    ctx->keystream_pos = 64;
+}
+
+void salsa20_update(salsa20_ctx *ctx, const uint8_t *in, uint8_t *out, size_t len) {
+    // First use up whatever is left of the previous block
+    while (len > 0 && ctx->keystream_pos < 64) {
+        *out++ = *in++ ^ ctx->keystream[ctx->keystream_pos++];
+        len--;
+    }
+
+    // Whole blocks go straight through the multi-block core
+    size_t nblocks = len / 64;
+    if (nblocks > 0) {
+        salsa20_blocks(ctx->state, in, out, nblocks);
+        in += 64 * nblocks;
+        out += 64 * nblocks;
+        len -= 64 * nblocks;
+    }
+
+    // Tail: generate one more block and keep the unused part for the next call
+    if (len > 0) {
+        uint8_t zeros[64] = {0};
+        salsa20_blocks(ctx->state, zeros, ctx->keystream, 1);
+        for (size_t i = 0; i < len; i++) {
+            out[i] = in[i] ^ ctx->keystream[i];
+        }
+        ctx->keystream_pos = len;
+    }
+}
+
+/*
+One-shot encryption starting at block 'counter' (0 for a fresh message).
+Salsa20 is a stream cipher, so decryption is the same operation.
+*/
+void salsa20_encrypt(const uint8_t *plaintext, uint8_t *ciphertext, size_t len,
+                     const uint8_t key[32], const uint8_t nonce[8], uint64_t counter) {
+    salsa20_ctx ctx;
+    salsa20_init(&ctx, key, nonce, counter);
+    salsa20_update(&ctx, plaintext, ciphertext, len);
+}
+
+void salsa20_decrypt(const uint8_t *ciphertext, uint8_t *plaintext, size_t len,
+                     const uint8_t key[32], const uint8_t nonce[8], uint64_t counter) {
+    salsa20_encrypt(ciphertext, plaintext, len, key, nonce, counter);
+}
+
+/*
+HSalsa20: the Salsa20 rounds used as a hash from (key, 128-bit nonce) to a
+new 256-bit key. The nonce takes words 6..9, the rounds run as usual, and the
+output is words 0, 5, 10, 15, 6, 7, 8, 9 without the feedforward. It is
+computed through salsa20_block by subtracting the input words back out.
+*/
+void hsalsa20(uint8_t subkey[32], const uint8_t key[32], const uint8_t nonce[16]) {
+    static const int pick[8] = {0, 5, 10, 15, 6, 7, 8, 9};
+    uint32_t in[16], out[16];
+
+    salsa20_setup(in, key, nonce, 0);
+    in[8] = load32_le(nonce + 8);
+    in[9] = load32_le(nonce + 12);
+    salsa20_block(out, in);
+    for (int i = 0; i < 8; i++) {
+        uint32_t w = out[pick[i]] - in[pick[i]];
+        subkey[4 * i] = (uint8_t)w;
+        subkey[4 * i + 1] = (uint8_t)(w >> 8);
+        subkey[4 * i + 2] = (uint8_t)(w >> 16);
+        subkey[4 * i + 3] = (uint8_t)(w >> 24);
+    }
+}
+
+/*
+XSalsa20: a 192-bit nonce, so nonces can be picked at random. The first 16
+nonce bytes go through HSalsa20 to give a subkey, and the last 8 are the
+Salsa20 nonce under that subkey.
+*/
+void xsalsa20_init(salsa20_ctx *ctx, const uint8_t key[32], const uint8_t nonce[24], uint64_t counter) {
+    uint8_t subkey[32];
+    hsalsa20(subkey, key, nonce);
+    salsa20_init(ctx, subkey, nonce + 16, counter);
+    memset(subkey, 0, sizeof subkey);
+}
+
+void xsalsa20_encrypt(const uint8_t *plaintext, uint8_t *ciphertext, size_t len,
+                      const uint8_t key[32], const uint8_t nonce[24], uint64_t counter) {
+    salsa20_ctx ctx;
+    xsalsa20_init(&ctx, key, nonce, counter);
+    salsa20_update(&ctx, plaintext, ciphertext, len);
+}
+
+/*
+NaCl secretbox (crypto_secretbox_xsalsa20poly1305), in detached form: the
+first 32 bytes of XSalsa20 keystream block 0 are the Poly1305 key, the
+message is encrypted from keystream byte 32 onwards, and the tag is Poly1305
+over the ciphertext. NaCl's combined box is the 16-byte tag followed by the
+ciphertext. As in the ChaCha20-Poly1305 AEAD, encryption and MAC run over
+the same chunk while it is still in L1.
+*/
+#define SECRETBOX_CHUNK 4096
+
+static void secretbox_setup(salsa20_ctx *cipher, poly1305_ctx *mac, const uint8_t key[32],
+                            const uint8_t nonce[24]) {
+    uint8_t zeros[32] = {0};
+    uint8_t mac_key[32];
+
+    xsalsa20_init(cipher, key, nonce, 0);
+    salsa20_update(cipher, zeros, mac_key, 32);
+    poly1305_init(mac, mac_key);
+    memset(mac_key, 0, sizeof mac_key);
+}
+
+void secretbox_seal(uint8_t *ciphertext, uint8_t tag[16], const uint8_t *plaintext, size_t len,
+                    const uint8_t key[32], const uint8_t nonce[24]) {
+    salsa20_ctx cipher;
+    poly1305_ctx mac;
+
+    secretbox_setup(&cipher, &mac, key, nonce);
+    for (size_t offset = 0; offset < len; offset += SECRETBOX_CHUNK) {
+        size_t n = len - offset < SECRETBOX_CHUNK ? len - offset : SECRETBOX_CHUNK;
+        salsa20_update(&cipher, plaintext + offset, ciphertext + offset, n);
+        poly1305_update(&mac, ciphertext + offset, n);
+    }
+    poly1305_final(&mac, tag);
+}
+
+static int tags_differ(const uint8_t a[16], const uint8_t b[16]) {
+    uint8_t diff = 0;
+    for (int i = 0; i < 16; i++) diff |= a[i] ^ b[i];    // constant time
+    return diff != 0;
+}
+
+/*
+Returns 0 and the plaintext if the tag verifies. Otherwise returns -1 and the
+output buffer is wiped, so unauthenticated plaintext is never handed out.
+*/
+int secretbox_open(uint8_t *plaintext, const uint8_t *ciphertext, size_t len, const uint8_t tag[16],
+                   const uint8_t key[32], const uint8_t nonce[24]) {
+    salsa20_ctx cipher;
+    poly1305_ctx mac;
+    uint8_t computed[16];
+
+    secretbox_setup(&cipher, &mac, key, nonce);
+    for (size_t offset = 0; offset < len; offset += SECRETBOX_CHUNK) {
+        size_t n = len - offset < SECRETBOX_CHUNK ? len - offset : SECRETBOX_CHUNK;
+        poly1305_update(&mac, ciphertext + offset, n);
+        salsa20_update(&cipher, ciphertext + offset, plaintext + offset, n);
+    }
+    poly1305_final(&mac, computed);
+
+    if (tags_differ(computed, tag)) {
+        memset(plaintext, 0, len);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+Batch open for high message rates: every box has its own key and nonce, so
+the fixed cost per box is two Salsa20 cores (HSalsa20 for the subkey, then
+block 0 for the Poly1305 key) before any payload is touched. For short
+messages that dominates. The batch runs both cores for 8 boxes at a time
+through the word-sliced AVX2 rounds, one box per lane, then verifies each
+box and decrypts the payload from keystream block 1 with salsa20_blocks.
+Each job gets status 0 or -1 exactly as secretbox_open would return it; the
+return value is the number of boxes that failed.
+*/
+typedef struct {
+    const uint8_t *key;         // 32 bytes
+    const uint8_t *nonce;       // 24 bytes
+    const uint8_t *ciphertext;
+    const uint8_t *tag;         // 16 bytes
+    uint8_t *plaintext;         // may equal ciphertext
+    size_t len;
+    int status;
+} secretbox_job;
+
+// x[i][j] is word i of lane j; runs the Salsa20 rounds on all 8 lanes at once
+__attribute__((target("avx2")))
+static void salsa20_core_x8(uint32_t x[16][8], int feedforward) {
+    __m256i input[16], v[16];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        input[i] = _mm256_loadu_si256((const __m256i *)x[i]);
+        v[i] = input[i];
+    }
+    for (i = 0; i < ROUNDS; i += 2) {
+        QR_AVX2(v[0], v[4], v[8], v[12]);
+        QR_AVX2(v[5], v[9], v[13], v[1]);
+        QR_AVX2(v[10], v[14], v[2], v[6]);
+        QR_AVX2(v[15], v[3], v[7], v[11]);
+        QR_AVX2(v[0], v[1], v[2], v[3]);
+        QR_AVX2(v[5], v[6], v[7], v[4]);
+        QR_AVX2(v[10], v[11], v[8], v[9]);
+        QR_AVX2(v[15], v[12], v[13], v[14]);
+    }
+    for (i = 0; i < 16; i++) {
+        if (feedforward) v[i] = _mm256_add_epi32(v[i], input[i]);
+        _mm256_storeu_si256((__m256i *)x[i], v[i]);
+    }
+}
+
+size_t secretbox_open_batch(secretbox_job *jobs, size_t njobs) {
+    static const int pick[8] = {0, 5, 10, 15, 6, 7, 8, 9};
+    size_t failed = 0;
+
+    if (salsa20_backend < 0) salsa20_backend = salsa20_best_backend();
+    if (salsa20_backend != SALSA20_AVX2) {
+        for (size_t n = 0; n < njobs; n++) {
+            secretbox_job *job = &jobs[n];
+            job->status = secretbox_open(job->plaintext, job->ciphertext, job->len, job->tag, job->key, job->nonce);
+            if (job->status != 0) failed++;
+        }
+        return failed;
+    }
+
+    for (size_t base = 0; base < njobs; base += 8) {
+        size_t lanes = njobs - base < 8 ? njobs - base : 8;
+        uint32_t x[16][8] = {{0}}, block0[16][8];
+        uint32_t subkey[8][8];  // word i of lane j
+        size_t i, j;
+
+        // HSalsa20 for every lane
+        for (j = 0; j < lanes; j++) {
+            uint32_t s[16];
+            salsa20_setup(s, jobs[base + j].key, jobs[base + j].nonce, 0);
+            s[8] = load32_le(jobs[base + j].nonce + 8);
+            s[9] = load32_le(jobs[base + j].nonce + 12);
+            for (i = 0; i < 16; i++) x[i][j] = s[i];
+        }
+        salsa20_core_x8(x, 0);
+        for (i = 0; i < 8; i++) {
+            for (j = 0; j < 8; j++) subkey[i][j] = x[pick[i]][j];
+        }
+
+        // Keystream block 0 under each subkey: Salsa20 layout, counter 0
+        for (j = 0; j < 8; j++) {
+            const uint8_t *tail = j < lanes ? jobs[base + j].nonce + 16 : NULL;
+            block0[0][j] = 0x61707865;
+            block0[5][j] = 0x3320646e;
+            block0[10][j] = 0x79622d32;
+            block0[15][j] = 0x6b206574;
+            for (i = 0; i < 4; i++) {
+                block0[1 + i][j] = subkey[i][j];
+                block0[11 + i][j] = subkey[4 + i][j];
+            }
+            block0[6][j] = tail ? load32_le(tail) : 0;
+            block0[7][j] = tail ? load32_le(tail + 4) : 0;
+            block0[8][j] = 0;
+            block0[9][j] = 0;
+        }
+        memcpy(x, block0, sizeof x);
+        salsa20_core_x8(x, 1);
+
+        for (j = 0; j < lanes; j++) {
+            secretbox_job *job = &jobs[base + j];
+            uint8_t keystream[64], computed[16];
+            poly1305_ctx mac;
+
+            for (i = 0; i < 16; i++) {
+                keystream[4 * i] = (uint8_t)x[i][j];
+                keystream[4 * i + 1] = (uint8_t)(x[i][j] >> 8);
+                keystream[4 * i + 2] = (uint8_t)(x[i][j] >> 16);
+                keystream[4 * i + 3] = (uint8_t)(x[i][j] >> 24);
+            }
+            poly1305_init(&mac, keystream);
+            poly1305_update(&mac, job->ciphertext, job->len);
+            poly1305_final(&mac, computed);
+
+            if (tags_differ(computed, job->tag)) {
+                memset(job->plaintext, 0, job->len);
+                job->status = -1;
+                failed++;
+                continue;
+            }
+
+            // Bytes 32..63 of block 0, then blocks 1.. through the streaming context
+            size_t head = job->len < 32 ? job->len : 32;
+            for (i = 0; i < head; i++) job->plaintext[i] = job->ciphertext[i] ^ keystream[32 + i];
+            if (job->len > 32) {
+                salsa20_ctx ctx;
+                for (i = 0; i < 16; i++) ctx.state[i] = block0[i][j];
+                ctx.state[8] = 1;
+                ctx.keystream_pos = 64;
+                salsa20_update(&ctx, job->ciphertext + 32, job->plaintext + 32, job->len - 32);
+                memset(&ctx, 0, sizeof ctx);
+            }
+            memset(keystream, 0, sizeof keystream);
+            job->status = 0;
+        }
+        memset(x, 0, sizeof x);
+        memset(block0, 0, sizeof block0);
+        memset(subkey, 0, sizeof subkey);
+    }
+    return failed;
+}
+
+/*
+SHA-256 (FIPS 180-4), HMAC-SHA256 and PBKDF2-HMAC-SHA256 (RFC 8018), which
+scrypt uses to spread the password over its lanes and to squeeze out the
+final key. Both PBKDF2 calls in scrypt run a single iteration, so none of
+this is on the hot path.
+*/
+
+/*
+Zeroes secrets so that the compiler cannot drop the stores: a plain memset
+right before free() or the end of a scope is a dead store to GCC. The empty
+asm claims to read the memory, so the zeros must really be written. Unlike
+a volatile byte loop it keeps memset's speed, which matters for scrypt's V.
+*/
+static void secure_wipe(void *p, size_t len) {
+    memset(p, 0, len);
+    __asm__ __volatile__("" : : "r"(p) : "memory");
+}
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t length;            // bytes hashed so far
+    uint8_t buffer[64];
+    size_t buffered;
+} sha256_ctx;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(a, b) (((a) >> (b)) | ((a) << (32 - (b))))
+
+static uint32_t load32_be(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void store32_be(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void sha256_compress(uint32_t h[8], const uint8_t block[64]) {
+    uint32_t w[64], a, b, c, d, e, f, g, k;
+    int i;
+
+    for (i = 0; i < 16; i++) w[i] = load32_be(block + 4 * i);
+    for (i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4]; f = h[5]; g = h[6]; k = h[7];
+    for (i = 0; i < 64; i++) {
+        uint32_t t1 = k + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void sha256_init(sha256_ctx *ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->h, iv, sizeof iv);
+    ctx->length = 0;
+    ctx->buffered = 0;
+}
+
+static void sha256_update(sha256_ctx *ctx, const uint8_t *data, size_t len) {
+    ctx->length += len;
+    if (ctx->buffered > 0) {
+        size_t want = 64 - ctx->buffered;
+        if (want > len) want = len;
+        memcpy(ctx->buffer + ctx->buffered, data, want);
+        ctx->buffered += want;
+        data += want;
+        len -= want;
+        if (ctx->buffered < 64) return;
+        sha256_compress(ctx->h, ctx->buffer);
+        ctx->buffered = 0;
+    }
+    while (len >= 64) {
+        sha256_compress(ctx->h, data);
+        data += 64;
+        len -= 64;
+    }
+    memcpy(ctx->buffer, data, len);
+    ctx->buffered = len;
+}
+
+static void sha256_final(sha256_ctx *ctx, uint8_t digest[32]) {
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad = 0x80, zero = 0, length[8];
+
+    sha256_update(ctx, &pad, 1);
+    while (ctx->buffered != 56) sha256_update(ctx, &zero, 1);
+    for (int i = 0; i < 8; i++) length[i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha256_update(ctx, length, 8);
+    for (int i = 0; i < 8; i++) store32_be(digest + 4 * i, ctx->h[i]);
+    memset(ctx, 0, sizeof *ctx);
+}
+
+// Inner and outer hashes with the keyed pads already absorbed
+typedef struct {
+    sha256_ctx inner, outer;
+} hmac_sha256_ctx;
+
+static void hmac_sha256_init(hmac_sha256_ctx *ctx, const uint8_t *key, size_t key_len) {
+    uint8_t block[64] = {0}, pad[64];
+
+    if (key_len > 64) {
+        sha256_init(&ctx->inner);
+        sha256_update(&ctx->inner, key, key_len);
+        sha256_final(&ctx->inner, block);
+    } else {
+        memcpy(block, key, key_len);
+    }
+    for (int i = 0; i < 64; i++) pad[i] = block[i] ^ 0x36;
+    sha256_init(&ctx->inner);
+    sha256_update(&ctx->inner, pad, 64);
+    for (int i = 0; i < 64; i++) pad[i] = block[i] ^ 0x5c;
+    sha256_init(&ctx->outer);
+    sha256_update(&ctx->outer, pad, 64);
+    secure_wipe(block, sizeof block);
+    secure_wipe(pad, sizeof pad);
+}
+
+static void hmac_sha256_final(hmac_sha256_ctx *ctx, uint8_t mac[32]) {
+    uint8_t inner[32];
+    sha256_final(&ctx->inner, inner);
+    sha256_update(&ctx->outer, inner, 32);
+    sha256_final(&ctx->outer, mac);
+    secure_wipe(inner, sizeof inner);
+}
+
+void pbkdf2_sha256(const uint8_t *passwd, size_t passwd_len, const uint8_t *salt, size_t salt_len,
+                   uint64_t iterations, uint8_t *out, size_t out_len) {
+    hmac_sha256_ctx keyed, ctx;
+    uint8_t u[32], t[32], index[4];
+
+    // The keyed pads are the same for every block and iteration
+    hmac_sha256_init(&keyed, passwd, passwd_len);
+    for (uint32_t block = 1; out_len > 0; block++) {
+        store32_be(index, block);
+        ctx = keyed;
+        sha256_update(&ctx.inner, salt, salt_len);
+        sha256_update(&ctx.inner, index, 4);
+        hmac_sha256_final(&ctx, u);
+        memcpy(t, u, 32);
+        for (uint64_t i = 1; i < iterations; i++) {
+            ctx = keyed;
+            sha256_update(&ctx.inner, u, 32);
+            hmac_sha256_final(&ctx, u);
+            for (int k = 0; k < 32; k++) t[k] ^= u[k];
+        }
+        size_t n = out_len < 32 ? out_len : 32;
+        memcpy(out, t, n);
+        out += n;
+        out_len -= n;
+    }
+    secure_wipe(&keyed, sizeof keyed);
+    secure_wipe(&ctx, sizeof ctx);
+    secure_wipe(u, sizeof u);
+    secure_wipe(t, sizeof t);
+}
+
+/*
+scrypt (RFC 7914): ROMix fills V with N successive BlockMix outputs of a
+128*r byte block, then makes N data-dependent reads back into V. BlockMix
+runs Salsa20/8 over the 2r 64-byte sub-blocks in a chain, so the core itself
+cannot be spread over several blocks at once; the SIMD win comes from the
+diagonal-word layout of the SSE2 kernel above, which runs one block with no
+scalar work in the rounds. Each block is permuted into that layout once when
+ROMix starts and back when it ends, so V, X and every BlockMix step stay
+permuted. Word 0 stays in place, so Integerify reads it directly.
+
+The p lanes are independent ROMix runs over their own slice of B and go to
+worker threads, each with its own V. That memory, N * 128 * r bytes per
+worker (128 MiB per worker at N = 2^17, r = 8), comes from an scrypt_arena
+that keeps its mapping between calls. The pages are faulted in once and
+reused, and the arena asks for 2 MiB huge pages (MAP_HUGETLB, else
+transparent huge pages via madvise) to cut TLB misses on the random reads.
+
+V[0] of every lane is PBKDF2(password, salt) output, so a V left in memory
+would let anyone who reads it test password guesses with one PBKDF2 and
+skip the memory-hard part. Each worker therefore wipes the V and XY it used
+before scrypt returns (in parallel, while its pages are still mapped), for
+caller arenas that are kept between calls as well as temporary ones.
+*/
+#define SCRYPT_MAX_THREADS 64
+
+typedef struct {
+    uint8_t *base;
+    size_t size;
+    const char *kind;           // which pages the mapping got
+} scrypt_arena;
+
+void scrypt_arena_init(scrypt_arena *arena) {
+    arena->base = NULL;
+    arena->size = 0;
+    arena->kind = "none";
+}
+
+void scrypt_arena_free(scrypt_arena *arena) {
+    if (arena->base) munmap(arena->base, arena->size);
+    scrypt_arena_init(arena);
+}
+
+// Makes sure the arena holds at least 'bytes'; returns 0, or -1 if it cannot
+static int scrypt_arena_reserve(scrypt_arena *arena, size_t bytes) {
+    const size_t huge = (size_t)2 << 20;
+    if (arena->size >= bytes) return 0;
+
+    scrypt_arena_free(arena);
+    size_t size = (bytes + huge - 1) & ~(huge - 1);
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        arena->kind = "hugetlb 2 MiB pages";
+    } else {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return -1;
+        arena->kind = madvise(p, size, MADV_HUGEPAGE) == 0 ? "transparent huge pages" : "4 KiB pages";
+    }
+    arena->base = p;
+    arena->size = size;
+    return 0;
+}
+
+static int scrypt_simd = 1;     // main() may turn this off to time the scalar core
+
+// Salsa20/8 on one block in the diagonal layout
+static inline void salsa20_8_sse2(__m128i x[4]) {
+    __m128i a0 = x[0], a1 = x[1], a2 = x[2], a3 = x[3];
+    for (int i = 0; i < 8; i += 2) {
+        DOUBLEROUND_SSE2(a0, a1, a2, a3);
+    }
+    x[0] = _mm_add_epi32(x[0], a0);
+    x[1] = _mm_add_epi32(x[1], a1);
+    x[2] = _mm_add_epi32(x[2], a2);
+    x[3] = _mm_add_epi32(x[3], a3);
+}
+
+// out = BlockMix(in), both 2r permuted blocks; even outputs go to the first half
+static void scrypt_blockmix_sse2(const __m128i *in, __m128i *out, uint32_t r) {
+    __m128i x[4];
+    for (int k = 0; k < 4; k++) x[k] = in[(2 * r - 1) * 4 + k];
+    for (uint32_t i = 0; i < 2 * r; i++) {
+        for (int k = 0; k < 4; k++) x[k] = _mm_xor_si128(x[k], in[4 * i + k]);
+        salsa20_8_sse2(x);
+        __m128i *y = out + 4 * ((i & 1) * r + i / 2);
+        for (int k = 0; k < 4; k++) y[k] = x[k];
+    }
+}
+
+// Same as scrypt_blockmix_sse2 with in ^= v folded into the first pass
+static void scrypt_blockmix_xor_sse2(const __m128i *in, const __m128i *v, __m128i *out, uint32_t r) {
+    __m128i x[4];
+    for (int k = 0; k < 4; k++) x[k] = _mm_xor_si128(in[(2 * r - 1) * 4 + k], v[(2 * r - 1) * 4 + k]);
+    for (uint32_t i = 0; i < 2 * r; i++) {
+        for (int k = 0; k < 4; k++) x[k] = _mm_xor_si128(x[k], _mm_xor_si128(in[4 * i + k], v[4 * i + k]));
+        salsa20_8_sse2(x);
+        __m128i *y = out + 4 * ((i & 1) * r + i / 2);
+        for (int k = 0; k < 4; k++) y[k] = x[k];
+    }
+}
+
+static void scrypt_romix_sse2(uint8_t *b, uint64_t n, uint32_t r, __m128i *v, __m128i *xy) {
+    static const int diagonal[16] = {0, 5, 10, 15, 12, 1, 6, 11, 8, 13, 2, 7, 4, 9, 14, 3};
+    size_t words = (size_t)32 * r, vectors = (size_t)8 * r;
+    __m128i *x = xy, *y = xy + vectors;
+    uint32_t *xw = (uint32_t *)x;
+
+    for (size_t i = 0; i < words; i++) xw[i] = load32_le(b + 4 * ((i & ~(size_t)15) + diagonal[i & 15]));
+
+    for (uint64_t i = 0; i < n; i += 2) {
+        memcpy(v + i * vectors, x, vectors * sizeof(__m128i));
+        scrypt_blockmix_sse2(x, y, r);
+        memcpy(v + (i + 1) * vectors, y, vectors * sizeof(__m128i));
+        scrypt_blockmix_sse2(y, x, r);
+    }
+    for (uint64_t i = 0; i < n; i += 2) {
+        // V[j] is a random 128r-byte block; start all of its lines loading at once
+        uint64_t j = (uint32_t)_mm_cvtsi128_si32(x[(2 * r - 1) * 4]) & (n - 1);
+        for (size_t k = 0; k < vectors; k += 4) _mm_prefetch((const char *)(v + j * vectors + k), _MM_HINT_T0);
+        scrypt_blockmix_xor_sse2(x, v + j * vectors, y, r);
+        j = (uint32_t)_mm_cvtsi128_si32(y[(2 * r - 1) * 4]) & (n - 1);
+        for (size_t k = 0; k < vectors; k += 4) _mm_prefetch((const char *)(v + j * vectors + k), _MM_HINT_T0);
+        scrypt_blockmix_xor_sse2(y, v + j * vectors, x, r);
+    }
+
+    for (size_t i = 0; i < words; i++) {
+        uint32_t w = xw[i];
+        uint8_t *p = b + 4 * ((i & ~(size_t)15) + diagonal[i & 15]);
+        p[0] = (uint8_t)w;
+        p[1] = (uint8_t)(w >> 8);
+        p[2] = (uint8_t)(w >> 16);
+        p[3] = (uint8_t)(w >> 24);
+    }
+}
+
+// Plain RFC 7914 ROMix on the scalar core, kept as the reference
+static void scrypt_romix_scalar(uint8_t *b, uint64_t n, uint32_t r, uint32_t *v, uint32_t *xy) {
+    size_t words = (size_t)32 * r;
+    uint32_t *x = xy, *y = xy + words, t[16];
+
+    for (size_t i = 0; i < words; i++) x[i] = load32_le(b + 4 * i);
+    for (uint64_t i = 0; i < 2 * n; i++) {
+        if (i < n) {
+            memcpy(v + i * words, x, words * 4);
+        } else {
+            uint64_t j = x[(2 * r - 1) * 16] & (n - 1);
+            for (size_t k = 0; k < words; k++) x[k] ^= v[j * words + k];
+        }
+        memcpy(t, x + (2 * r - 1) * 16, 64);
+        for (uint32_t k = 0; k < 2 * r; k++) {
+            for (int w = 0; w < 16; w++) t[w] ^= x[16 * k + w];
+            salsa20_core(t, t, 8);
+            memcpy(y + 16 * ((k & 1) * r + k / 2), t, 64);
+        }
+        memcpy(x, y, words * 4);
+    }
+    secure_wipe(t, sizeof t);
+    for (size_t i = 0; i < words; i++) {
+        b[4 * i] = (uint8_t)x[i];
+        b[4 * i + 1] = (uint8_t)(x[i] >> 8);
+        b[4 * i + 2] = (uint8_t)(x[i] >> 16);
+        b[4 * i + 3] = (uint8_t)(x[i] >> 24);
+    }
+}
+
+// Lanes are handed out to the workers through a shared counter
+typedef struct {
+    uint8_t *b;
+    uint64_t n;
+    uint32_t r, p;
+    uint8_t *memory;            // one V + XY slice per worker
+    size_t slice;
+    _Atomic uint32_t next_lane;
+} scrypt_job;
+
+typedef struct {
+    scrypt_job *job;
+    int worker;
+} scrypt_worker;
+
+static void *scrypt_lanes(void *arg) {
+    scrypt_worker *w = arg;
+    scrypt_job *job = w->job;
+    uint8_t *v = job->memory + w->worker * job->slice;
+    uint8_t *xy = v + job->slice - (size_t)256 * job->r;
+    int used = 0;
+
+    for (;;) {
+        uint32_t lane = atomic_fetch_add(&job->next_lane, 1);
+        if (lane >= job->p) break;
+        uint8_t *b = job->b + (size_t)128 * job->r * lane;
+        if (scrypt_simd) scrypt_romix_sse2(b, job->n, job->r, (__m128i *)v, (__m128i *)xy);
+        else scrypt_romix_scalar(b, job->n, job->r, (uint32_t *)v, (uint32_t *)xy);
+        used = 1;
+    }
+    if (used) secure_wipe(v, job->slice);
+    return NULL;
+}
+
+/*
+Derives dk_len bytes from the password and salt. N must be a power of two
+greater than 1, and r * p < 2^30. Memory comes from 'arena', which can be
+reused across calls; with a NULL arena a temporary one is mapped and unmapped
+again. Either way the memory used is wiped before scrypt returns. 'threads'
+caps the number of lanes run at once (0: one per lane, up to
+SCRYPT_MAX_THREADS). Returns 0, or -1 for bad parameters or no memory.
+*/
+int scrypt(const uint8_t *passwd, size_t passwd_len, const uint8_t *salt, size_t salt_len,
+           uint64_t n, uint32_t r, uint32_t p, int threads, uint8_t *dk, size_t dk_len, scrypt_arena *arena) {
+    if (n < 2 || (n & (n - 1)) != 0 || r == 0 || p == 0 || (uint64_t)r * p >= (1u << 30)) return -1;
+    if (n > SIZE_MAX / 128 / r / 2) return -1;
+
+    int workers = threads > 0 && (uint32_t)threads < p ? threads : (int)p;
+    if (workers > SCRYPT_MAX_THREADS) workers = SCRYPT_MAX_THREADS;
+    size_t slice = (size_t)128 * r * n + (size_t)256 * r;
+
+    scrypt_arena temporary;
+    scrypt_arena *memory = arena;
+    if (!memory) {
+        scrypt_arena_init(&temporary);
+        memory = &temporary;
+    }
+    size_t b_len = (size_t)128 * r * p;
+    uint8_t *b = malloc(b_len);
+    if (!b || scrypt_arena_reserve(memory, slice * workers) != 0) {
+        free(b);
+        if (!arena) scrypt_arena_free(&temporary);
+        return -1;
+    }
+
+    pbkdf2_sha256(passwd, passwd_len, salt, salt_len, 1, b, b_len);
+
+    scrypt_job job = { b, n, r, p, memory->base, slice, 0 };
+    scrypt_worker worker[SCRYPT_MAX_THREADS];
+    pthread_t thread[SCRYPT_MAX_THREADS];
+    int started = 1;
+    for (int i = 0; i < workers; i++) worker[i] = (scrypt_worker){ &job, i };
+    for (; started < workers; started++) {
+        if (pthread_create(&thread[started], NULL, scrypt_lanes, &worker[started]) != 0) break;
+    }
+    scrypt_lanes(&worker[0]);   // the caller is worker 0; lanes left by failed threads fall to it
+    for (int i = 1; i < started; i++) pthread_join(thread[i], NULL);
+
+    pbkdf2_sha256(passwd, passwd_len, b, b_len, 1, dk, dk_len);
+    secure_wipe(b, b_len);
+    free(b);
+    if (!arena) scrypt_arena_free(&temporary);
+    return 0;
+}
+
+/*
+eSTREAM known-answer tests (256-bit key, verified.test-vectors):
+Set 1 vector 0 at stream offsets 0, 192, 256 and 448, and Set 6 vector 0 at
+offsets 0 and 65472, which is block 1023 and so goes through every kernel.
+Each window is the keystream, i.e. the encryption of zeros.
+*/
+typedef struct {
+    const char *name;
+    uint8_t key[32];
+    uint8_t nonce[8];
+    size_t offset;
+    uint8_t stream[64];
+} salsa20_kat;
+
+static const salsa20_kat salsa20_kats[] = {
+    { "Set 1, vector 0, stream[0..63]",
+      { 0x80 }, { 0 }, 0, {
+    0xe3, 0xbe, 0x8f, 0xdd, 0x8b, 0xec, 0xa2, 0xe3, 0xea, 0x8e, 0xf9, 0x47, 0x5b, 0x29, 0xa6, 0xe7,
+    0x00, 0x39, 0x51, 0xe1, 0x09, 0x7a, 0x5c, 0x38, 0xd2, 0x3b, 0x7a, 0x5f, 0xad, 0x9f, 0x68, 0x44,
+    0xb2, 0x2c, 0x97, 0x55, 0x9e, 0x27, 0x23, 0xc7, 0xcb, 0xbd, 0x3f, 0xe4, 0xfc, 0x8d, 0x9a, 0x07,
+    0x44, 0x65, 0x2a, 0x83, 0xe7, 0x2a, 0x9c, 0x46, 0x18, 0x76, 0xaf, 0x4d, 0x7e, 0xf1, 0xa1, 0x17
+    } },
+    { "Set 1, vector 0, stream[192..255]",
+      { 0x80 }, { 0 }, 192, {
+    0x57, 0xbe, 0x81, 0xf4, 0x7b, 0x17, 0xd9, 0xae, 0x7c, 0x4f, 0xf1, 0x54, 0x29, 0xa7, 0x3e, 0x10,
+    0xac, 0xf2, 0x50, 0xed, 0x3a, 0x90, 0xa9, 0x3c, 0x71, 0x13, 0x08, 0xa7, 0x4c, 0x62, 0x16, 0xa9,
+    0xed, 0x84, 0xcd, 0x12, 0x6d, 0xa7, 0xf2, 0x8e, 0x8a, 0xbf, 0x8b, 0xb6, 0x35, 0x17, 0xe1, 0xca,
+    0x98, 0xe7, 0x12, 0xf4, 0xfb, 0x2e, 0x1a, 0x6a, 0xed, 0x9f, 0xdc, 0x73, 0x29, 0x1f, 0xaa, 0x17
+    } },
+    { "Set 1, vector 0, stream[256..319]",
+      { 0x80 }, { 0 }, 256, {
+    0x95, 0x82, 0x11, 0xc4, 0xba, 0x2e, 0xbd, 0x58, 0x38, 0xc6, 0x35, 0xed, 0xb8, 0x1f, 0x51, 0x3a,
+    0x91, 0xa2, 0x94, 0xe1, 0x94, 0xf1, 0xc0, 0x39, 0xae, 0xec, 0x65, 0x7d, 0xce, 0x40, 0xaa, 0x7e,
+    0x7c, 0x0a, 0xf5, 0x7c, 0xac, 0xef, 0xa4, 0x0c, 0x9f, 0x14, 0xb7, 0x1a, 0x4b, 0x34, 0x56, 0xa6,
+    0x3e, 0x16, 0x2e, 0xc7, 0xd8, 0xd1, 0x0b, 0x8f, 0xfb, 0x18, 0x10, 0xd7, 0x10, 0x01, 0xb6, 0x18
+    } },
+    { "Set 1, vector 0, stream[448..511]",
+      { 0x80 }, { 0 }, 448, {
+    0x69, 0x6a, 0xfc, 0xfd, 0x0c, 0xdd, 0xcc, 0x83, 0xc7, 0xe7, 0x7f, 0x11, 0xa6, 0x49, 0xd7, 0x9a,
+    0xcd, 0xc3, 0x35, 0x4e, 0x96, 0x35, 0xff, 0x13, 0x7e, 0x92, 0x99, 0x33, 0xa0, 0xbd, 0x6f, 0x53,
+    0x77, 0xef, 0xa1, 0x05, 0xa3, 0xa4, 0x26, 0x6b, 0x7c, 0x0d, 0x08, 0x9d, 0x08, 0xf1, 0xe8, 0x55,
+    0xcc, 0x32, 0xb1, 0x5b, 0x93, 0x78, 0x4a, 0x36, 0xe5, 0x6a, 0x76, 0xcc, 0x64, 0xbc, 0x84, 0x77
+    } },
+    { "Set 6, vector 0, stream[0..63]",
+      { 0x00, 0x53, 0xa6, 0xf9, 0x4c, 0x9f, 0xf2, 0x45, 0x98, 0xeb, 0x3e, 0x91, 0xe4, 0x37, 0x8a, 0xdd,
+        0x30, 0x83, 0xd6, 0x29, 0x7c, 0xcf, 0x22, 0x75, 0xc8, 0x1b, 0x6e, 0xc1, 0x14, 0x67, 0xba, 0x0d },
+      { 0x0d, 0x74, 0xdb, 0x42, 0xa9, 0x10, 0x77, 0xde }, 0, {
+    0xf5, 0xfa, 0xd5, 0x3f, 0x79, 0xf9, 0xdf, 0x58, 0xc4, 0xae, 0xa0, 0xd0, 0xed, 0x9a, 0x96, 0x01,
+    0xf2, 0x78, 0x11, 0x2c, 0xa7, 0x18, 0x0d, 0x56, 0x5b, 0x42, 0x0a, 0x48, 0x01, 0x96, 0x70, 0xea,
+    0xf2, 0x4c, 0xe4, 0x93, 0xa8, 0x62, 0x63, 0xf6, 0x77, 0xb4, 0x6a, 0xce, 0x19, 0x24, 0x77, 0x3d,
+    0x2b, 0xb2, 0x55, 0x71, 0xe1, 0xaa, 0x85, 0x93, 0x75, 0x8f, 0xc3, 0x82, 0xb1, 0x28, 0x0b, 0x71
+    } },
+    { "Set 6, vector 0, stream[65472..65535]",
+      { 0x00, 0x53, 0xa6, 0xf9, 0x4c, 0x9f, 0xf2, 0x45, 0x98, 0xeb, 0x3e, 0x91, 0xe4, 0x37, 0x8a, 0xdd,
+        0x30, 0x83, 0xd6, 0x29, 0x7c, 0xcf, 0x22, 0x75, 0xc8, 0x1b, 0x6e, 0xc1, 0x14, 0x67, 0xba, 0x0d },
+      { 0x0d, 0x74, 0xdb, 0x42, 0xa9, 0x10, 0x77, 0xde }, 65472, {
+    0xb7, 0x0c, 0x50, 0x13, 0x9c, 0x63, 0x33, 0x2e, 0xf6, 0xe7, 0x7a, 0xc5, 0x43, 0x38, 0xa4, 0x07,
+    0x9b, 0x82, 0xbe, 0xc9, 0xf9, 0xa4, 0x03, 0xdf, 0xea, 0x82, 0x1b, 0x83, 0xf7, 0x86, 0x07, 0x91,
+    0x65, 0x0e, 0xf1, 0xb2, 0x48, 0x9d, 0x05, 0x90, 0xb1, 0xde, 0x77, 0x2e, 0xed, 0xa4, 0xe3, 0xbc,
+    0xd6, 0x0f, 0xa7, 0xce, 0x9c, 0xd6, 0x23, 0xd9, 0xd2, 0xfd, 0x57, 0x58, 0xb8, 0x65, 0x3e, 0x70
+    } },
+};
+
+// Runs every known-answer test on the current backend; returns 1 if all pass
+static int salsa20_check_kats(void) {
+    static uint8_t zeros[65536], stream[65536];
+    int ok = 1;
+
+    for (size_t t = 0; t < sizeof salsa20_kats / sizeof salsa20_kats[0]; t++) {
+        const salsa20_kat *kat = &salsa20_kats[t];
+        size_t len = kat->offset + 64;
+        salsa20_encrypt(zeros, stream, len, kat->key, kat->nonce, 0);
+        if (memcmp(stream + kat->offset, kat->stream, 64) != 0) {
+            printf("  %s: MISMATCH\n", kat->name);
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+/*
+Kernel cross-check: a buffer is encrypted by the scalar path in one call and
+by each SIMD backend in ragged pieces through one context, starting just
+below a 2^32 block boundary so the counter carry into word 9 is exercised.
+*/
+#define CROSS_BYTES (64 * 1000 + 37)
+
+static int salsa20_cross_check(int best) {
+    uint8_t key[32], nonce[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint64_t counter = 0xfffffff0ULL;
+    uint8_t *plaintext = malloc(CROSS_BYTES), *reference = malloc(CROSS_BYTES), *ciphertext = malloc(CROSS_BYTES);
+    int ok = 1;
+
+    if (!plaintext || !reference || !ciphertext) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < 32; i++) key[i] = (uint8_t)(i * 11 + 5);
+    for (size_t i = 0; i < CROSS_BYTES; i++) plaintext[i] = (uint8_t)(i * 131 + 7);
+
+    salsa20_backend = SALSA20_SCALAR;
+    salsa20_encrypt(plaintext, reference, CROSS_BYTES, key, nonce, counter);
+
+    for (int backend = SALSA20_SSE2; backend <= best; backend++) {
+        salsa20_ctx ctx;
+        size_t done = 0, piece = 1;
+        salsa20_backend = backend;
+        salsa20_init(&ctx, key, nonce, counter);
+        while (done < CROSS_BYTES) {
+            size_t n = piece < CROSS_BYTES - done ? piece : CROSS_BYTES - done;
+            salsa20_update(&ctx, plaintext + done, ciphertext + done, n);
+            done += n;
+            piece = piece * 3 + 1;
+        }
+        int match = memcmp(ciphertext, reference, CROSS_BYTES) == 0;
+        salsa20_decrypt(ciphertext, ciphertext, CROSS_BYTES, key, nonce, counter);
+        match &= memcmp(ciphertext, plaintext, CROSS_BYTES) == 0;
+        printf("%-8s matches the scalar path across the 2^32 counter boundary: %s\n",
+               salsa20_backend_names[backend], match ? "yes" : "NO");
+        ok &= match;
+    }
+
+    free(plaintext);
+    free(reference);
+    free(ciphertext);
+    return ok;
+}
+
+#define BULK_BYTES (4 << 20)
+#define BULK_TRIALS 50
+
+static void salsa20_benchmark_bulk(int best) {
+    uint8_t key[32] = {0x80}, nonce[8] = {0};
+    uint8_t *buffer = malloc(BULK_BYTES);
+    if (!buffer) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(buffer, 0, BULK_BYTES);
+
+    printf("\nBulk encryption of %d bytes, %d trials:\n", BULK_BYTES, BULK_TRIALS);
+    for (int backend = SALSA20_SCALAR; backend <= best; backend++) {
+        unsigned long long min_cycles = ULLONG_MAX;
+        unsigned long long max_cycles = 0;
+        unsigned long long total_cycles = 0;
+
+        salsa20_backend = backend;
+        for (int i = 0; i < BULK_TRIALS; ++i) {
+            unsigned long long start = __rdtsc();
+            salsa20_encrypt(buffer, buffer, BULK_BYTES, key, nonce, 0);
+            unsigned long long cycles = __rdtsc() - start;
+            if (cycles < min_cycles) min_cycles = cycles;
+            if (cycles > max_cycles) max_cycles = cycles;
+            total_cycles += cycles;
+        }
+        printf("%-8s cycles/byte: min %.2f  avg %.2f  max %.2f\n", salsa20_backend_names[backend],
+               (double)min_cycles / BULK_BYTES, (double)total_cycles / BULK_TRIALS / BULK_BYTES,
+               (double)max_cycles / BULK_BYTES);
+    }
+    free(buffer);
+}
+
+/*
+NaCl known answers (tests/core1.c, core2.c and secretbox.c): HSalsa20 from
+the shared secret to firstkey, then to the XSalsa20 subkey, and the 131-byte
+secretbox. Then a batch of BOX_COUNT boxes of 64..1024 bytes, each with its
+own key and nonce and every 97th one tampered with, opened one at a time and
+through secretbox_open_batch; both must agree on every byte and every status.
+*/
+#define BOX_COUNT 16384
+#define BOX_TRIALS 10
+
+static int test_secretbox(void) {
+    static const uint8_t shared[32] = {
+    0x4a, 0x5d, 0x9d, 0x5b, 0xa4, 0xce, 0x2d, 0xe1, 0x72, 0x8e, 0x3b, 0xf4, 0x80, 0x35, 0x0f, 0x25,
+    0xe0, 0x7e, 0x21, 0xc9, 0x47, 0xd1, 0x9e, 0x33, 0x76, 0xf0, 0x9b, 0x3c, 0x1e, 0x16, 0x17, 0x42
+    };
+    static const uint8_t firstkey[32] = {
+    0x1b, 0x27, 0x55, 0x64, 0x73, 0xe9, 0x85, 0xd4, 0x62, 0xcd, 0x51, 0x19, 0x7a, 0x9a, 0x46, 0xc7,
+    0x60, 0x09, 0x54, 0x9e, 0xac, 0x64, 0x74, 0xf2, 0x06, 0xc4, 0xee, 0x08, 0x44, 0xf6, 0x83, 0x89
+    };
+    static const uint8_t secondkey[32] = {
+    0xdc, 0x90, 0x8d, 0xda, 0x0b, 0x93, 0x44, 0xa9, 0x53, 0x62, 0x9b, 0x73, 0x38, 0x20, 0x77, 0x88,
+    0x80, 0xf3, 0xce, 0xb4, 0x21, 0xbb, 0x61, 0xb9, 0x1c, 0xbd, 0x4c, 0x3e, 0x66, 0x25, 0x6c, 0xe4
+    };
+    static const uint8_t nonce[24] = {
+    0x69, 0x69, 0x6e, 0xe9, 0x55, 0xb6, 0x2b, 0x73, 0xcd, 0x62, 0xbd, 0xa8, 0x75, 0xfc, 0x73, 0xd6,
+    0x82, 0x19, 0xe0, 0x03, 0x6b, 0x7a, 0x0b, 0x37
+    };
+    static const uint8_t message[131] = {
+    0xbe, 0x07, 0x5f, 0xc5, 0x3c, 0x81, 0xf2, 0xd5, 0xcf, 0x14, 0x13, 0x16, 0xeb, 0xeb, 0x0c, 0x7b,
+    0x52, 0x28, 0xc5, 0x2a, 0x4c, 0x62, 0xcb, 0xd4, 0x4b, 0x66, 0x84, 0x9b, 0x64, 0x24, 0x4f, 0xfc,
+    0xe5, 0xec, 0xba, 0xaf, 0x33, 0xbd, 0x75, 0x1a, 0x1a, 0xc7, 0x28, 0xd4, 0x5e, 0x6c, 0x61, 0x29,
+    0x6c, 0xdc, 0x3c, 0x01, 0x23, 0x35, 0x61, 0xf4, 0x1d, 0xb6, 0x6c, 0xce, 0x31, 0x4a, 0xdb, 0x31,
+    0x0e, 0x3b, 0xe8, 0x25, 0x0c, 0x46, 0xf0, 0x6d, 0xce, 0xea, 0x3a, 0x7f, 0xa1, 0x34, 0x80, 0x57,
+    0xe2, 0xf6, 0x55, 0x6a, 0xd6, 0xb1, 0x31, 0x8a, 0x02, 0x4a, 0x83, 0x8f, 0x21, 0xaf, 0x1f, 0xde,
+    0x04, 0x89, 0x77, 0xeb, 0x48, 0xf5, 0x9f, 0xfd, 0x49, 0x24, 0xca, 0x1c, 0x60, 0x90, 0x2e, 0x52,
+    0xf0, 0xa0, 0x89, 0xbc, 0x76, 0x89, 0x70, 0x40, 0xe0, 0x82, 0xf9, 0x37, 0x76, 0x38, 0x48, 0x64,
+    0x5e, 0x07, 0x05
+    };
+    static const uint8_t expected_tag[16] = {
+    0xf3, 0xff, 0xc7, 0x70, 0x3f, 0x94, 0x00, 0xe5, 0x2a, 0x7d, 0xfb, 0x4b, 0x3d, 0x33, 0x05, 0xd9
+    };
+    static const uint8_t expected[131] = {
+    0x8e, 0x99, 0x3b, 0x9f, 0x48, 0x68, 0x12, 0x73, 0xc2, 0x96, 0x50, 0xba, 0x32, 0xfc, 0x76, 0xce,
+    0x48, 0x33, 0x2e, 0xa7, 0x16, 0x4d, 0x96, 0xa4, 0x47, 0x6f, 0xb8, 0xc5, 0x31, 0xa1, 0x18, 0x6a,
+    0xc0, 0xdf, 0xc1, 0x7c, 0x98, 0xdc, 0xe8, 0x7b, 0x4d, 0xa7, 0xf0, 0x11, 0xec, 0x48, 0xc9, 0x72,
+    0x71, 0xd2, 0xc2, 0x0f, 0x9b, 0x92, 0x8f, 0xe2, 0x27, 0x0d, 0x6f, 0xb8, 0x63, 0xd5, 0x17, 0x38,
+    0xb4, 0x8e, 0xee, 0xe3, 0x14, 0xa7, 0xcc, 0x8a, 0xb9, 0x32, 0x16, 0x45, 0x48, 0xe5, 0x26, 0xae,
+    0x90, 0x22, 0x43, 0x68, 0x51, 0x7a, 0xcf, 0xea, 0xbd, 0x6b, 0xb3, 0x73, 0x2b, 0xc0, 0xe9, 0xda,
+    0x99, 0x83, 0x2b, 0x61, 0xca, 0x01, 0xb6, 0xde, 0x56, 0x24, 0x4a, 0x9e, 0x88, 0xd5, 0xf9, 0xb3,
+    0x79, 0x73, 0xf6, 0x22, 0xa4, 0x3d, 0x14, 0xa6, 0x59, 0x9b, 0x1f, 0x65, 0x4c, 0xb4, 0x5a, 0x74,
+    0xe3, 0x55, 0xa5
+    };
+    uint8_t subkey[32], ciphertext[131], opened[131], tag[16];
+    int ok = 1;
+
+    hsalsa20(subkey, shared, (const uint8_t[16]){0});
+    int core1 = memcmp(subkey, firstkey, 32) == 0;
+    hsalsa20(subkey, firstkey, nonce);
+    int core2 = memcmp(subkey, secondkey, 32) == 0;
+    printf("\nHSalsa20 NaCl core1 %s, core2 %s\n", core1 ? "matches" : "does NOT match",
+           core2 ? "matches" : "does NOT match");
+    ok &= core1 && core2;
+
+    secretbox_seal(ciphertext, tag, message, sizeof message, firstkey, nonce);
+    int sealed = memcmp(ciphertext, expected, sizeof expected) == 0 && memcmp(tag, expected_tag, 16) == 0;
+    int open_ok = secretbox_open(opened, ciphertext, sizeof ciphertext, tag, firstkey, nonce) == 0 &&
+                  memcmp(opened, message, sizeof message) == 0;
+    ciphertext[77] ^= 0x20;
+    int rejected = secretbox_open(opened, ciphertext, sizeof ciphertext, tag, firstkey, nonce) != 0;
+    printf("secretbox NaCl seal %s, open %s, tampered box %s\n", sealed ? "matches" : "does NOT match",
+           open_ok ? "OK" : "FAILED", rejected ? "rejected" : "ACCEPTED");
+    ok &= sealed && open_ok && rejected;
+
+    // Many small boxes
+    size_t total = 0, offset = 0;
+    size_t *lengths = malloc(BOX_COUNT * sizeof(size_t));
+    uint8_t *keys = malloc(BOX_COUNT * 32), *nonces = malloc(BOX_COUNT * 24), *tags = malloc(BOX_COUNT * 16);
+    secretbox_job *jobs = malloc(BOX_COUNT * sizeof(secretbox_job));
+    if (!lengths || !keys || !nonces || !tags || !jobs) {
+        perror("malloc");
+        exit(1);
+    }
+    uint32_t seed = 2024;
+    for (int n = 0; n < BOX_COUNT; n++) {
+        seed = seed * 1103515245 + 12345;
+        lengths[n] = 64 + (seed >> 8) % (1024 - 64 + 1);
+        total += lengths[n];
+        for (int i = 0; i < 32; i++) keys[32 * n + i] = (uint8_t)(seed >> (i % 24) ^ i);
+        for (int i = 0; i < 24; i++) nonces[24 * n + i] = (uint8_t)(n >> (i % 3 * 8) ^ (i * 13));
+    }
+    uint8_t *boxes = malloc(total), *single = malloc(total), *batched = malloc(total);
+    int *single_status = malloc(BOX_COUNT * sizeof(int));
+    if (!boxes || !single || !batched || !single_status) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < total; i++) boxes[i] = (uint8_t)(i * 29 + 3);
+    for (int n = 0; n < BOX_COUNT; n++) {
+        secretbox_seal(boxes + offset, tags + 16 * n, boxes + offset, lengths[n], keys + 32 * n, nonces + 24 * n);
+        if (n % 97 == 5) boxes[offset + lengths[n] / 2] ^= 1;
+        jobs[n] = (secretbox_job){ keys + 32 * n, nonces + 24 * n, boxes + offset, tags + 16 * n,
+                                   batched + offset, lengths[n], 1 };
+        offset += lengths[n];
+    }
+
+    unsigned long long one_min = ULLONG_MAX, batch_min = ULLONG_MAX;
+    size_t single_failed = 0, batch_failed = 0;
+    for (int t = 0; t < BOX_TRIALS; t++) {
+        unsigned long long start = __rdtsc();
+        single_failed = 0;
+        for (int n = 0; n < BOX_COUNT; n++) {
+            single_status[n] = secretbox_open(single + (jobs[n].plaintext - batched), jobs[n].ciphertext,
+                                              jobs[n].len, jobs[n].tag, jobs[n].key, jobs[n].nonce);
+            if (single_status[n] != 0) single_failed++;
+        }
+        unsigned long long cycles = __rdtsc() - start;
+        if (cycles < one_min) one_min = cycles;
+
+        start = __rdtsc();
+        batch_failed = secretbox_open_batch(jobs, BOX_COUNT);
+        cycles = __rdtsc() - start;
+        if (cycles < batch_min) batch_min = cycles;
+    }
+
+    int batch_ok = memcmp(single, batched, total) == 0 && single_failed == batch_failed;
+    for (int n = 0; n < BOX_COUNT; n++) batch_ok &= jobs[n].status == single_status[n];
+    printf("\n%d boxes of 64..1024 bytes (%zu bytes), each with its own key and nonce, %zu tampered:\n",
+           BOX_COUNT, total, single_failed);
+    printf("one at a time  cycles/box: %.0f  cycles/byte: %.2f\n", (double)one_min / BOX_COUNT,
+           (double)one_min / total);
+    printf("batched        cycles/box: %.0f  cycles/byte: %.2f  (output and status %s)\n",
+           (double)batch_min / BOX_COUNT, (double)batch_min / total, batch_ok ? "match" : "do NOT match");
+    ok &= batch_ok;
+
+    free(lengths);
+    free(keys);
+    free(nonces);
+    free(tags);
+    free(jobs);
+    free(boxes);
+    free(single);
+    free(batched);
+    free(single_status);
+    return ok;
+}
+
+// Wall-clock seconds, for the scrypt timings that span threads
+static double seconds_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+scrypt checks against RFC 7914 (section 11 for PBKDF2-HMAC-SHA256, section
+12 for scrypt), each on the scalar and the SSE2 core, then hashes/second for
+N = 2^14 and 2^17 (r = 8, p = 1) with the scalar core and a fresh mapping per
+call, the SSE2 core and a fresh mapping, and the SSE2 core with one reused
+arena; and N = 2^14, p = 4 on 1 and 4 threads.
+*/
+typedef struct {
+    const char *passwd, *salt;
+    uint64_t n;
+    uint32_t r, p;
+    uint8_t dk[64];
+} scrypt_kat;
+
+static const scrypt_kat scrypt_kats[] = {
+    { "", "", 16, 1, 1, {
+    0x77, 0xd6, 0x57, 0x62, 0x38, 0x65, 0x7b, 0x20, 0x3b, 0x19, 0xca, 0x42, 0xc1, 0x8a, 0x04, 0x97,
+    0xf1, 0x6b, 0x48, 0x44, 0xe3, 0x07, 0x4a, 0xe8, 0xdf, 0xdf, 0xfa, 0x3f, 0xed, 0xe2, 0x14, 0x42,
+    0xfc, 0xd0, 0x06, 0x9d, 0xed, 0x09, 0x48, 0xf8, 0x32, 0x6a, 0x75, 0x3a, 0x0f, 0xc8, 0x1f, 0x17,
+    0xe8, 0xd3, 0xe0, 0xfb, 0x2e, 0x0d, 0x36, 0x28, 0xcf, 0x35, 0xe2, 0x0c, 0x38, 0xd1, 0x89, 0x06
+    } },
+    { "password", "NaCl", 1024, 8, 16, {
+    0xfd, 0xba, 0xbe, 0x1c, 0x9d, 0x34, 0x72, 0x00, 0x78, 0x56, 0xe7, 0x19, 0x0d, 0x01, 0xe9, 0xfe,
+    0x7c, 0x6a, 0xd7, 0xcb, 0xc8, 0x23, 0x78, 0x30, 0xe7, 0x73, 0x76, 0x63, 0x4b, 0x37, 0x31, 0x62,
+    0x2e, 0xaf, 0x30, 0xd9, 0x2e, 0x22, 0xa3, 0x88, 0x6f, 0xf1, 0x09, 0x27, 0x9d, 0x98, 0x30, 0xda,
+    0xc7, 0x27, 0xaf, 0xb9, 0x4a, 0x83, 0xee, 0x6d, 0x83, 0x60, 0xcb, 0xdf, 0xa2, 0xcc, 0x06, 0x40
+    } },
+    { "pleaseletmein", "SodiumChloride", 16384, 8, 1, {
+    0x70, 0x23, 0xbd, 0xcb, 0x3a, 0xfd, 0x73, 0x48, 0x46, 0x1c, 0x06, 0xcd, 0x81, 0xfd, 0x38, 0xeb,
+    0xfd, 0xa8, 0xfb, 0xba, 0x90, 0x4f, 0x8e, 0x3e, 0xa9, 0xb5, 0x43, 0xf6, 0x54, 0x5d, 0xa1, 0xf2,
+    0xd5, 0x43, 0x29, 0x55, 0x61, 0x3f, 0x0f, 0xcf, 0x62, 0xd4, 0x97, 0x05, 0x24, 0x2a, 0x9a, 0xf9,
+    0xe6, 0x1e, 0x85, 0xdc, 0x0d, 0x65, 0x1e, 0x40, 0xdf, 0xcf, 0x01, 0x7b, 0x45, 0x57, 0x58, 0x87
+    } },
+};
+
+// Average seconds per hash over 'runs' hashes
+static double scrypt_time(uint64_t n, uint32_t r, uint32_t p, int threads, int runs, scrypt_arena *arena) {
+    uint8_t dk[64];
+    double start = seconds_now();
+    for (int i = 0; i < runs; i++) {
+        if (scrypt((const uint8_t *)"password", 8, (const uint8_t *)"salt", 4, n, r, p, threads,
+                   dk, sizeof dk, arena) != 0) {
+            fprintf(stderr, "scrypt: out of memory\n");
+            exit(1);
+        }
+    }
+    return (seconds_now() - start) / runs;
+}
+
+static int test_scrypt(void) {
+    static const uint8_t pbkdf2_expected[64] = {
+    0x55, 0xac, 0x04, 0x6e, 0x56, 0xe3, 0x08, 0x9f, 0xec, 0x16, 0x91, 0xc2, 0x25, 0x44, 0xb6, 0x05,
+    0xf9, 0x41, 0x85, 0x21, 0x6d, 0xde, 0x04, 0x65, 0xe6, 0x8b, 0x9d, 0x57, 0xc2, 0x0d, 0xac, 0xbc,
+    0x49, 0xca, 0x9c, 0xcc, 0xf1, 0x79, 0xb6, 0x45, 0x99, 0x16, 0x64, 0xb3, 0x9d, 0x77, 0xef, 0x31,
+    0x7c, 0x71, 0xb8, 0x45, 0xb1, 0xe3, 0x0b, 0xd5, 0x09, 0x11, 0x20, 0x41, 0xd3, 0xa1, 0x97, 0x83
+    };
+    uint8_t dk[64];
+    int ok;
+
+    pbkdf2_sha256((const uint8_t *)"passwd", 6, (const uint8_t *)"salt", 4, 1, dk, 64);
+    ok = memcmp(dk, pbkdf2_expected, 64) == 0;
+    printf("\nPBKDF2-HMAC-SHA256 RFC 7914 vector %s\n", ok ? "matches" : "does NOT match");
+
+    for (scrypt_simd = 0; scrypt_simd <= 1; scrypt_simd++) {
+        int all = 1;
+        for (size_t t = 0; t < sizeof scrypt_kats / sizeof scrypt_kats[0]; t++) {
+            const scrypt_kat *kat = &scrypt_kats[t];
+            scrypt((const uint8_t *)kat->passwd, strlen(kat->passwd), (const uint8_t *)kat->salt,
+                   strlen(kat->salt), kat->n, kat->r, kat->p, 0, dk, 64, NULL);
+            all &= memcmp(dk, kat->dk, 64) == 0;
+        }
+        printf("scrypt RFC 7914 vectors, %-6s core: %s\n", scrypt_simd ? "SSE2" : "scalar",
+               all ? "all match" : "FAILED");
+        ok &= all;
+    }
+
+    scrypt_arena arena;
+    scrypt_arena_init(&arena);
+    for (int log_n = 14; log_n <= 17; log_n += 3) {
+        uint64_t n = (uint64_t)1 << log_n;
+        int runs = log_n == 14 ? 20 : 3;
+        printf("\nscrypt N = 2^%d, r = 8, p = 1 (%llu MiB)       hashes/second\n", log_n,
+               (unsigned long long)(n * 128 * 8 >> 20));
+        scrypt_simd = 0;
+        printf("scalar core, new mapping per call    %8.2f\n", 1 / scrypt_time(n, 8, 1, 0, runs, NULL));
+        scrypt_simd = 1;
+        printf("SSE2 core, new mapping per call      %8.2f\n", 1 / scrypt_time(n, 8, 1, 0, runs, NULL));
+        scrypt_time(n, 8, 1, 0, 1, &arena);     // fault the arena in once
+        printf("SSE2 core, reused arena              %8.2f  (%s)\n", 1 / scrypt_time(n, 8, 1, 0, runs, &arena),
+               arena.kind);
+    }
+
+    printf("\nscrypt N = 2^14, r = 8, p = 4                hashes/second\n");
+    for (int threads = 1; threads <= 4; threads *= 4) {
+        scrypt_time(1 << 14, 8, 4, threads, 1, &arena);
+        printf("%d thread%s                            %8.2f\n", threads, threads == 1 ? " " : "s",
+               1 / scrypt_time(1 << 14, 8, 4, threads, 10, &arena));
+    }
+    scrypt_arena_free(&arena);
+    return ok;
+}
+
+// Example main function: known-answer tests, a cross-check of the SIMD
+// kernels against the scalar path, the original single-block timing loop
+// (now on a real key/nonce/counter input) and a bulk benchmark per kernel.
+// Compile with: gcc -O3 -pthread "Salsa20 (gmp).c" -o salsa20
 // Run: ./salsa20
 // Note: RDTSC measures CPU cycles but can vary due to caching, Turbo Boost, etc.
 // For accurate results, run on a quiet system and average multiple trials.
 int main() {
-    uint32_t in[16] = {0};  // Dummy input (in practice, set from key/nonce/counter).
+    uint32_t in[16];
     uint32_t out[16];
     unsigned long long min_cycles = ULLONG_MAX;
     unsigned long long max_cycles = 0;
     unsigned long long total_cycles = 0;
     unsigned long long start, end;
-    int i;
+    int i, ok = 1;
+
+    int best = salsa20_best_backend();
+    printf("eSTREAM test vectors:\n");
+    for (int backend = SALSA20_SCALAR; backend <= best; backend++) {
+        salsa20_backend = backend;
+        int kat_ok = salsa20_check_kats();
+        printf("%-8s %s\n", salsa20_backend_names[backend], kat_ok ? "all match" : "FAILED");
+        ok &= kat_ok;
+    }
+    printf("\n");
+    ok &= salsa20_cross_check(best);
+    salsa20_backend = best;
+
+    // Set 1, vector 0 input block: key 80 00 .. 00, nonce 0, counter 0
+    uint8_t key[32] = {0x80}, nonce[8] = {0};
+    salsa20_setup(in, key, nonce, 0);
 
     for (i = 0; i < 100000; ++i) {
         start = __rdtsc();  // Read timestamp counter before the call.
@@ -96,9 +1557,16 @@ int main() {
     }
 
     double avg_cycles = (double)total_cycles / 100000;
+    printf("\nSingle salsa20_block call:\n");
     printf("Average cycles per run: %.2f\n", avg_cycles);
     printf("Minimum cycles: %llu\n", min_cycles);
     printf("Maximum cycles: %llu\n", max_cycles);
 
-    return 0;
-}
\ No newline at end of file
+    salsa20_benchmark_bulk(best);
+    salsa20_backend = best;
+
+    ok &= test_secretbox();
+    ok &= test_scrypt();
+
+    return ok ? 0 : 1;
+}
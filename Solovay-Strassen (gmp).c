@@ -3,7 +3,8 @@
  * with CPU-cycle benchmarking (min / max / avg) over RUNS runs.
  *
  * Build:
- *   gcc -O2 -Wall -Wextra -std=c11 ss_512prime_bench.c -lgmp -o ss_512prime_bench
+ *   gcc -O2 -Wall -Wextra -std=gnu11 ss_512prime_bench.c -lgmp -o ss_512prime_bench
+ *   (chacha_rng.h and prime_sieve.h must be next to the source)
  *
  * Note: this uses x86 __rdtsc / __rdtscp and thus is for x86/x86_64 platforms.
  */
@@ -15,6 +16,8 @@
 #include <unistd.h>
 #include <gmp.h>
 #include <x86intrin.h>   // for __rdtsc and __rdtscp
+#include "chacha_rng.h"
+#include "prime_sieve.h"
 
 /* ----------------------------- Tunable params ----------------------------- */
 /* Number of Solovay–Strassen rounds (higher => smaller error prob). */
@@ -26,15 +29,6 @@
 /* How many iterations to benchmark */
 #define RUNS 10000
 
-/* ----------------------------- Small primes ------------------------------- */
-/* Quick trial division by a handful of small primes makes testing faster. */
-static const unsigned small_primes[] = {
-    3, 5, 7, 11, 13, 17, 19, 23, 29, 31,
-    37, 41, 43, 47, 53, 59, 61, 67, 71, 73,
-    79, 83, 89, 97, 101, 103, 107, 109, 113
-};
-static const size_t small_primes_count = sizeof(small_primes)/sizeof(small_primes[0]);
-
 /* ------------------------------ rdtsc helpers ------------------------------ */
 /* Use __rdtsc / __rdtscp and cpuid for serialization.
    This pattern is simpler and less error-prone than writing raw asm outputs. */
@@ -52,51 +46,21 @@ static inline uint64_t rdtsc_end(void) {
 }
 
 /* ----------------------------- RNG seeding -------------------------------- */
-/* Initialize a GMP MT RNG. We mix time, pid, and clock ticks into a 64-bit seed.
-   For stronger seeding, you could use /dev/urandom. */
-static void init_rng(gmp_randstate_t st) {
-    gmp_randinit_mt(st);
-
-    uint64_t seed = 0;
-    seed ^= (uint64_t)time(NULL);
-    seed ^= (uint64_t)clock() << 32;
-    seed ^= (uint64_t)getpid() * 0x9e3779b97f4a7c15ULL;
-
-    mpz_t s;
-    mpz_init(s);
-    mpz_import(s, 1, 1, sizeof(seed), 0, 0, &seed);
-    gmp_randseed(st, s);
-    mpz_clear(s);
-}
-
-/* --------------------- 512-bit odd candidate generation ------------------- */
-/* Generate a random 512-bit integer with MSB=1 (exact size) and LSB=1 (odd). */
-static void random_odd_candidate_512(mpz_t n, gmp_randstate_t st) {
-    mpz_urandomb(n, st, PRIME_BITS);       /* n in [0, 2^512 - 1] */
-    mpz_setbit(n, PRIME_BITS - 1);         /* Ensure MSB=1 => exactly 512 bits */
-    mpz_setbit(n, 0);                      /* Ensure odd */
-}
-
-/* -------------------------- Small-prime screening ------------------------- */
-/* Quickly reject numbers divisible by any small prime. */
-static int divisible_by_small_prime(const mpz_t n) {
-    if (mpz_cmp_ui(n, 2) < 0) return 1;        /* n < 2: treat as composite for our purpose */
-    if (mpz_cmp_ui(n, 2) == 0) return 0;       /* 2 is prime (won't occur because we force odd) */
-    if (mpz_even_p(n)) return 1;               /* even => composite */
-
-    for (size_t i = 0; i < small_primes_count; ++i) {
-        unsigned p = small_primes[i];
-        unsigned long rem = mpz_fdiv_ui(n, p);
-        if (rem == 0) return 1;                /* divisible => composite */
+/* ChaCha20 CSPRNG with fast key erasure (chacha_rng.h), seeded from getrandom.
+   Exits if the kernel cannot supply a seed rather than fall back to a weak one. */
+static void init_rng(chacha_rng *st) {
+    if (chacha_rng_init(st) != 0) {
+        perror("getrandom");
+        exit(1);
     }
-    return 0;                                   /* passed quick screen */
 }
 
 /* ---------------------- Solovay–Strassen primality ------------------------ */
 /*
    Return 1 if n is a probable prime by k rounds of Solovay–Strassen, else 0.
+   Adds the number of mpz_powm calls made to *powm_calls.
 */
-static int is_probable_prime_ss(const mpz_t n, int k, gmp_randstate_t st) {
+static int is_probable_prime_ss(const mpz_t n, int k, chacha_rng *st, uint64_t *powm_calls) {
     if (mpz_cmp_ui(n, 2) < 0) return 0;
     if (mpz_cmp_ui(n, 2) == 0) return 1;
     if (mpz_even_p(n)) return 0;
@@ -109,7 +73,7 @@ static int is_probable_prime_ss(const mpz_t n, int k, gmp_randstate_t st) {
 
     for (int i = 0; i < k; ++i) {
         /* a ∈ [2, n-2]  -> create uniform a in [0, n-4], then add 2 */
-        mpz_urandomm(a, st, n_minus_3);   /* [0, n-4] */
+        chacha_rng_urandomm(a, st, n_minus_3);   /* [0, n-4] */
         mpz_add_ui(a, a, 2);              /* [2, n-2] */
 
         /* g = gcd(a, n) > 1 => composite */
@@ -130,6 +94,7 @@ static int is_probable_prime_ss(const mpz_t n, int k, gmp_randstate_t st) {
         mpz_set(exp, n_minus_1);
         mpz_fdiv_q_2exp(exp, exp, 1);   /* exp = (n-1)/2 */
         mpz_powm(p, a, exp, n);
+        (*powm_calls)++;
 
         /* Convert jac to residue mod n: -1 -> n-1, +1 -> 1 */
         if (jac == -1) {
@@ -150,23 +115,30 @@ static int is_probable_prime_ss(const mpz_t n, int k, gmp_randstate_t st) {
 }
 
 /* ------------------------- 512-bit prime generator ------------------------ */
-/* Keep drawing random 512-bit odd candidates until one passes:
-   1) small-prime screen
-   2) SS_ROUNDS rounds of Solovay–Strassen
-*/
-static void generate_prime_512(mpz_t prime, gmp_randstate_t st) {
-    for (;;) {
-        random_odd_candidate_512(prime, st);
-        if (divisible_by_small_prime(prime)) continue;
-        if (is_probable_prime_ss(prime, SS_ROUNDS, st)) return;  /* found probable prime */
-    }
+/* Sieve survivor test for prime_sieve_next: SS_ROUNDS rounds of Solovay–Strassen. */
+static int ss_sieve_test(const mpz_t n, void *arg, uint64_t *powm_calls) {
+    return is_probable_prime_ss(n, SS_ROUNDS, (chacha_rng *)arg, powm_calls);
+}
+
+/* From a random 512-bit odd base (MSB=1, LSB=1), walk the sieve survivors
+   (no factor among the first 8192 odd primes, see prime_sieve.h) until one
+   passes SS_ROUNDS rounds of Solovay–Strassen. */
+static void generate_prime_512(mpz_t prime, prime_sieve *sieve, chacha_rng *st) {
+    prime_sieve_next(sieve, prime, st, ss_sieve_test, st);
 }
 
 /* ---------------------------------- main ---------------------------------- */
 int main(void) {
-    /* Initialize RNG (Mersenne Twister in GMP) */
-    gmp_randstate_t st;
-    init_rng(st);
+    /* Initialize RNG (ChaCha20 CSPRNG) */
+    chacha_rng st;
+    init_rng(&st);
+
+    /* Sieve of small primes for PRIME_BITS candidates; no public exponent to exclude */
+    prime_sieve sieve;
+    if (prime_sieve_init(&sieve, PRIME_BITS, 0) != 0) {
+        fprintf(stderr, "prime_sieve_init failed\n");
+        return 1;
+    }
 
     mpz_t prime;
     mpz_init(prime);
@@ -178,7 +150,7 @@ int main(void) {
     /* Run the benchmark RUNS times */
     for (int i = 0; i < RUNS; ++i) {
         uint64_t start = rdtsc_start();
-        generate_prime_512(prime, st);
+        generate_prime_512(prime, &sieve, &st);
         uint64_t end = rdtsc_end();
 
         uint64_t cycles = end - start;
@@ -198,11 +170,13 @@ int main(void) {
     printf("Min cycles : %llu\n", (unsigned long long)min_cycles);
     printf("Max cycles : %llu\n", (unsigned long long)max_cycles);
     printf("Avg cycles : %.2f\n", avg);
+    prime_sieve_report(&sieve, "Sieve");
 
     /* Optionally show the last generated prime (hex) */
     gmp_printf("Last generated prime (hex):\n%Zx\n", prime);
 
     mpz_clear(prime);
-    gmp_randclear(st);
+    prime_sieve_free(&sieve);
+    chacha_rng_wipe(&st, sizeof st);
     return 0;
 }
@@ -0,0 +1,2646 @@
+/*
+ * AES (FIPS-197) in C with 128-, 192- and 256-bit keys, ported from aes.py.
+ * The key is expanded once into an aes_ctx and reused for every block (with
+ * an LRU cache of expanded keys for callers that switch among many), and
+ * blocks go through one of three backends picked at runtime:
+ *   - 32-bit T-tables: SubBytes, ShiftRows and MixColumns folded into four
+ *     1 KiB lookup tables per direction, 16 lookups per round
+ *   - bitsliced: 8 blocks at a time as bit planes in SSE registers, with
+ *     the S-box as a logic circuit; constant time, for hosts without AES-NI
+ *   - AES-NI: one aesenc per round, with 8 independent blocks in flight so
+ *     the instruction latency is hidden
+ *
+ * Modes: ECB with PKCS#7 padding (as in aes.py), CBC (serial encryption,
+ * 8-wide decryption), CTR (one-shot or streaming with seeking), XTS for
+ * sector-addressed storage, and the GCM AEAD with PCLMULQDQ GHASH, or a
+ * constant-time portable GHASH without it.
+ *
+ * Build:
+ *   gcc -O3 aes.c -o aes
+ *   gcc -O3 -shared -fPIC -DAES_NO_MAIN aes.c -o libaes.so    (native backend for aes.py)
+ *
+ * Run:
+ *   ./aes       FIPS-197, SP 800-38A, GCM, IEEE 1619 and key cache self-test,
+ *               then benchmarks of every backend and mode, of 512-byte and
+ *               4 KiB sectors, and of key switching
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <x86intrin.h>  // AES-NI intrinsics and __rdtsc()
+
+// Rijndael S-box
+static const uint8_t SBOX[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+// Round constants for the key schedule
+static const uint8_t RCON[11] = { 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+
+/*
+T-tables, filled in from SBOX before main() runs. Te0[x] is the MixColumns
+column of SubBytes(x) placed in row 0, i.e. the bytes (2s, s, s, 3s) of a
+big-endian word; Te1..Te3 are the same column rotated to rows 1..3. Td0..Td3
+do the same for InvSubBytes and InvMixColumns with (14, 9, 13, 11).
+*/
+static uint8_t INV_SBOX[256];
+static uint32_t Te0[256], Te1[256], Te2[256], Te3[256];
+static uint32_t Td0[256], Td1[256], Td2[256], Td3[256];
+
+// multiply by x in GF(2^8) with the AES polynomial x^8+x^4+x^3+x+1 (0x11b)
+static uint8_t xtime(uint8_t a) {
+    return (uint8_t)((a << 1) ^ ((a >> 7) * 0x1b));
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    uint8_t res = 0;
+    while (b) {
+        if (b & 1) res ^= a;
+        a = xtime(a);
+        b >>= 1;
+    }
+    return res;
+}
+
+#define ROR32(v, n) (((v) >> (n)) | ((v) << (32 - (n))))
+
+__attribute__((constructor))
+static void aes_tables_init(void) {
+    for (int x = 0; x < 256; x++) {
+        uint8_t s = SBOX[x];
+        INV_SBOX[s] = (uint8_t)x;
+
+        uint32_t e = ((uint32_t)gf_mul(s, 2) << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) | gf_mul(s, 3);
+        Te0[x] = e;
+        Te1[x] = ROR32(e, 8);
+        Te2[x] = ROR32(e, 16);
+        Te3[x] = ROR32(e, 24);
+    }
+    for (int x = 0; x < 256; x++) {
+        uint8_t s = INV_SBOX[x];
+        uint32_t d = ((uint32_t)gf_mul(s, 14) << 24) | ((uint32_t)gf_mul(s, 9) << 16) |
+                     ((uint32_t)gf_mul(s, 13) << 8) | gf_mul(s, 11);
+        Td0[x] = d;
+        Td1[x] = ROR32(d, 8);
+        Td2[x] = ROR32(d, 16);
+        Td3[x] = ROR32(d, 24);
+    }
+}
+
+static inline uint32_t load32_be(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void store32_be(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+/*
+Backend selection. AES-NI is picked on first use when the CPU has it, then
+the constant-time bitsliced backend; the T-table backend is fastest without
+AES-NI but its lookups leak through the cache, so it is only the last
+resort. main() can override aes_backend to compare them. Each context
+remembers the backend its round keys were laid out for.
+*/
+enum { AES_TTABLE, AES_BITSLICE, AES_NI };
+static const char *aes_backend_names[] = { "T-table", "bitslice", "AES-NI" };
+static int aes_backend = -1;
+
+static int aes_best_backend(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("aes")) return AES_NI;
+    if (__builtin_cpu_supports("ssse3")) return AES_BITSLICE;
+    return AES_TTABLE;
+}
+
+/*
+Expanded key. The T-table backend keeps round keys as big-endian words, the
+AES-NI backend as 16-byte vectors in memory order, the bitsliced backend as
+8 bit planes per round. dk holds the round keys of the equivalent inverse
+cipher (FIPS-197 section 5.3.5): the encryption keys in reverse order with
+InvMixColumns applied to all but the first and last.
+*/
+typedef struct {
+    union {
+        uint32_t w[60];
+        __m128i v[15];
+        __m128i planes[15 * 8];
+    } ek;
+    union {
+        uint32_t w[60];
+        __m128i v[15];
+    } dk;
+    int rounds;
+    int backend;
+} aes_ctx;
+
+/*
+Key schedule for nk = 4, 6 or 8 key words (AES-128 / 192 / 256), FIPS-197
+section 5.2: every nk-th word goes through SubWord(RotWord()) ^ Rcon, and
+AES-256 also applies SubWord halfway between those. rk gets 4 * (nr + 1)
+big-endian words.
+*/
+static void aes_key_words(uint32_t *rk, const uint8_t *key, int nk, int nr, uint32_t (*sub_word)(uint32_t)) {
+    int i;
+
+    for (i = 0; i < nk; i++) rk[i] = load32_be(key + 4 * i);
+    for (i = nk; i < 4 * (nr + 1); i++) {
+        uint32_t temp = rk[i - 1];
+        if (i % nk == 0) temp = sub_word((temp << 8) | (temp >> 24)) ^ ((uint32_t)RCON[i / nk] << 24);
+        else if (nk > 6 && i % nk == 4) temp = sub_word(temp);
+        rk[i] = rk[i - nk] ^ temp;
+    }
+}
+
+static uint32_t sub_word_table(uint32_t w) {
+    return ((uint32_t)SBOX[w >> 24] << 24) ^ ((uint32_t)SBOX[(w >> 16) & 0xff] << 16) ^
+           ((uint32_t)SBOX[(w >> 8) & 0xff] << 8) ^ (uint32_t)SBOX[w & 0xff];
+}
+
+static void aes_expand_ttable(aes_ctx *ctx, const uint8_t *key, int nk) {
+    uint32_t *rk = ctx->ek.w;
+    int nr = ctx->rounds;
+    int i;
+
+    aes_key_words(rk, key, nk, nr, sub_word_table);
+
+    // InvMixColumns(w) = Td(InvSubBytes(SubBytes(w))), one lookup per byte
+    uint32_t *dk = ctx->dk.w;
+    for (int r = 0; r <= nr; r++) {
+        for (i = 0; i < 4; i++) {
+            uint32_t w = rk[4 * (nr - r) + i];
+            if (r > 0 && r < nr) {
+                w = Td0[SBOX[w >> 24]] ^ Td1[SBOX[(w >> 16) & 0xff]] ^
+                    Td2[SBOX[(w >> 8) & 0xff]] ^ Td3[SBOX[w & 0xff]];
+            }
+            dk[4 * r + i] = w;
+        }
+    }
+}
+
+// k ^= k << 32 ^ k << 64 ^ k << 96, then ^= t, which holds the new word in every lane
+__attribute__((target("aes")))
+static inline __m128i aes_ni_key_step(__m128i k, __m128i t) {
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 8));
+    return _mm_xor_si128(k, t);
+}
+
+#define AES128_EXPAND_NI(k, rcon) \
+    k = aes_ni_key_step(k, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k, rcon), 0xff))
+
+/*
+AES-192 works on 6-word steps: k1 holds words 0..3 of the step and the low
+half of k2 words 4..5. Word 1 of aeskeygenassist(k2) is
+SubWord(RotWord(word 5)) ^ Rcon; the upper half of k2 ends up as junk and is
+never stored on its own.
+*/
+#define AES192_EXPAND_NI(k1, k2, rcon) do { \
+    k1 = aes_ni_key_step(k1, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k2, rcon), 0x55)); \
+    k2 = _mm_xor_si128(_mm_xor_si128(k2, _mm_slli_si128(k2, 4)), _mm_shuffle_epi32(k1, 0xff)); \
+} while (0)
+
+// Round keys straddle the 6-word steps: low half of a then low half of b, or high half of a then low half of b
+#define AES192_LOWS(a, b)     _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(a), _mm_castsi128_pd(b), 0))
+#define AES192_HIGH_LOW(a, b) _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(a), _mm_castsi128_pd(b), 1))
+
+// AES-256 alternates a SubWord(RotWord()) ^ Rcon step on k1 with a plain SubWord step on k2
+#define AES256_EXPAND_NI(k1, k2, rcon) do { \
+    k1 = aes_ni_key_step(k1, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k2, rcon), 0xff)); \
+    k2 = aes_ni_key_step(k2, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k1, 0x00), 0xaa)); \
+} while (0)
+
+__attribute__((target("aes")))
+static void aes_expand_ni(aes_ctx *ctx, const uint8_t *key, int nk) {
+    __m128i *rk = ctx->ek.v;
+    __m128i k1 = _mm_loadu_si128((const __m128i *)key);
+    int nr = ctx->rounds;
+
+    rk[0] = k1;
+    if (nk == 4) {
+        AES128_EXPAND_NI(k1, 0x01); rk[1] = k1;
+        AES128_EXPAND_NI(k1, 0x02); rk[2] = k1;
+        AES128_EXPAND_NI(k1, 0x04); rk[3] = k1;
+        AES128_EXPAND_NI(k1, 0x08); rk[4] = k1;
+        AES128_EXPAND_NI(k1, 0x10); rk[5] = k1;
+        AES128_EXPAND_NI(k1, 0x20); rk[6] = k1;
+        AES128_EXPAND_NI(k1, 0x40); rk[7] = k1;
+        AES128_EXPAND_NI(k1, 0x80); rk[8] = k1;
+        AES128_EXPAND_NI(k1, 0x1b); rk[9] = k1;
+        AES128_EXPAND_NI(k1, 0x36); rk[10] = k1;
+    } else if (nk == 6) {
+        __m128i k2 = _mm_loadl_epi64((const __m128i *)(key + 16));
+        __m128i prev = k2;
+        AES192_EXPAND_NI(k1, k2, 0x01); rk[1] = AES192_LOWS(prev, k1); rk[2] = AES192_HIGH_LOW(k1, k2);
+        AES192_EXPAND_NI(k1, k2, 0x02); rk[3] = k1; prev = k2;
+        AES192_EXPAND_NI(k1, k2, 0x04); rk[4] = AES192_LOWS(prev, k1); rk[5] = AES192_HIGH_LOW(k1, k2);
+        AES192_EXPAND_NI(k1, k2, 0x08); rk[6] = k1; prev = k2;
+        AES192_EXPAND_NI(k1, k2, 0x10); rk[7] = AES192_LOWS(prev, k1); rk[8] = AES192_HIGH_LOW(k1, k2);
+        AES192_EXPAND_NI(k1, k2, 0x20); rk[9] = k1; prev = k2;
+        AES192_EXPAND_NI(k1, k2, 0x40); rk[10] = AES192_LOWS(prev, k1); rk[11] = AES192_HIGH_LOW(k1, k2);
+        AES192_EXPAND_NI(k1, k2, 0x80); rk[12] = k1;
+    } else {
+        __m128i k2 = _mm_loadu_si128((const __m128i *)(key + 16));
+        rk[1] = k2;
+        AES256_EXPAND_NI(k1, k2, 0x01); rk[2] = k1; rk[3] = k2;
+        AES256_EXPAND_NI(k1, k2, 0x02); rk[4] = k1; rk[5] = k2;
+        AES256_EXPAND_NI(k1, k2, 0x04); rk[6] = k1; rk[7] = k2;
+        AES256_EXPAND_NI(k1, k2, 0x08); rk[8] = k1; rk[9] = k2;
+        AES256_EXPAND_NI(k1, k2, 0x10); rk[10] = k1; rk[11] = k2;
+        AES256_EXPAND_NI(k1, k2, 0x20); rk[12] = k1; rk[13] = k2;
+        k1 = aes_ni_key_step(k1, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k2, 0x40), 0xff));
+        rk[14] = k1;
+    }
+
+    ctx->dk.v[0] = rk[nr];
+    for (int r = 1; r < nr; r++) ctx->dk.v[r] = _mm_aesimc_si128(rk[nr - r]);
+    ctx->dk.v[nr] = rk[0];
+}
+
+/*
+Bitsliced AES for hosts without AES-NI, in the layout of Kasper and Schwabe:
+8 blocks are processed together, and register q[j] holds bit j of all 128
+state bytes, one byte of the register per state byte with one bit per block.
+SubBytes is then a fixed circuit of AND/XOR/NOT over the 8 registers (the
+Boyar-Peralta S-box), ShiftRows and the row rotations of MixColumns are byte
+shuffles, and nothing indexes memory with key or data bits, so there is no
+cache-timing leak. SSSE3 is needed for pshufb. The registers are combined
+with GCC's vector operators, which compile to the plain SSE2 instructions.
+*/
+
+// t = ((a >> n) ^ b) & mask; swaps the mask bits of b with the bits n above them in a
+#define BS_SWAPMOVE(a, b, mask, n) do { \
+    __m128i t = ((__m128i)_mm_srli_epi64(a, n) ^ (b)) & (mask); \
+    b ^= t; \
+    a ^= (__m128i)_mm_slli_epi64(t, n); \
+} while (0)
+
+// 8x8 bit transpose at every byte position: bit i of q[j] <-> bit j of q[i]; its own inverse
+static inline void bs_ortho(__m128i q[8]) {
+    const __m128i m1 = _mm_set1_epi8(0x55), m2 = _mm_set1_epi8(0x33), m4 = _mm_set1_epi8(0x0f);
+
+    BS_SWAPMOVE(q[0], q[1], m1, 1);
+    BS_SWAPMOVE(q[2], q[3], m1, 1);
+    BS_SWAPMOVE(q[4], q[5], m1, 1);
+    BS_SWAPMOVE(q[6], q[7], m1, 1);
+    BS_SWAPMOVE(q[0], q[2], m2, 2);
+    BS_SWAPMOVE(q[1], q[3], m2, 2);
+    BS_SWAPMOVE(q[4], q[6], m2, 2);
+    BS_SWAPMOVE(q[5], q[7], m2, 2);
+    BS_SWAPMOVE(q[0], q[4], m4, 4);
+    BS_SWAPMOVE(q[1], q[5], m4, 4);
+    BS_SWAPMOVE(q[2], q[6], m4, 4);
+    BS_SWAPMOVE(q[3], q[7], m4, 4);
+}
+
+/*
+The AES S-box as the 113-gate circuit of Boyar and Peralta: a linear layer,
+the GF(2^8) inversion in tower-field form, and a second linear layer that
+includes the affine map. x0 is the most significant bit.
+*/
+static inline void bs_sbox(__m128i q[8]) {
+    __m128i x0 = q[7], x1 = q[6], x2 = q[5], x3 = q[4], x4 = q[3], x5 = q[2], x6 = q[1], x7 = q[0];
+    __m128i y1, y2, y3, y4, y5, y6, y7, y8, y9, y10, y11, y12, y13, y14, y15, y16, y17, y18, y19, y20, y21;
+    __m128i z0, z1, z2, z3, z4, z5, z6, z7, z8, z9, z10, z11, z12, z13, z14, z15, z16, z17;
+    __m128i t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+    __m128i t20, t21, t22, t23, t24, t25, t26, t27, t28, t29, t30, t31, t32, t33, t34, t35, t36, t37;
+    __m128i t38, t39, t40, t41, t42, t43, t44, t45, t46, t47, t48, t49, t50, t51, t52, t53, t54, t55;
+    __m128i t56, t57, t58, t59, t60, t61, t62, t63, t64, t65, t66, t67;
+    __m128i s0, s1, s2, s3, s4, s5, s6, s7;
+
+    // Top linear transformation
+    y14 = x3 ^ x5;
+    y13 = x0 ^ x6;
+    y9 = x0 ^ x3;
+    y8 = x0 ^ x5;
+    t0 = x1 ^ x2;
+    y1 = t0 ^ x7;
+    y4 = y1 ^ x3;
+    y12 = y13 ^ y14;
+    y2 = y1 ^ x0;
+    y5 = y1 ^ x6;
+    y3 = y5 ^ y8;
+    t1 = x4 ^ y12;
+    y15 = t1 ^ x5;
+    y20 = t1 ^ x1;
+    y6 = y15 ^ x7;
+    y10 = y15 ^ t0;
+    y11 = y20 ^ y9;
+    y7 = x7 ^ y11;
+    y17 = y10 ^ y11;
+    y19 = y10 ^ y8;
+    y16 = t0 ^ y11;
+    y21 = y13 ^ y16;
+    y18 = x0 ^ y16;
+
+    // Non-linear section
+    t2 = y12 & y15;
+    t3 = y3 & y6;
+    t4 = t3 ^ t2;
+    t5 = y4 & x7;
+    t6 = t5 ^ t2;
+    t7 = y13 & y16;
+    t8 = y5 & y1;
+    t9 = t8 ^ t7;
+    t10 = y2 & y7;
+    t11 = t10 ^ t7;
+    t12 = y9 & y11;
+    t13 = y14 & y17;
+    t14 = t13 ^ t12;
+    t15 = y8 & y10;
+    t16 = t15 ^ t12;
+    t17 = t4 ^ t14;
+    t18 = t6 ^ t16;
+    t19 = t9 ^ t14;
+    t20 = t11 ^ t16;
+    t21 = t17 ^ y20;
+    t22 = t18 ^ y19;
+    t23 = t19 ^ y21;
+    t24 = t20 ^ y18;
+
+    t25 = t21 ^ t22;
+    t26 = t21 & t23;
+    t27 = t24 ^ t26;
+    t28 = t25 & t27;
+    t29 = t28 ^ t22;
+    t30 = t23 ^ t24;
+    t31 = t22 ^ t26;
+    t32 = t31 & t30;
+    t33 = t32 ^ t24;
+    t34 = t23 ^ t33;
+    t35 = t27 ^ t33;
+    t36 = t24 & t35;
+    t37 = t36 ^ t34;
+    t38 = t27 ^ t36;
+    t39 = t29 & t38;
+    t40 = t25 ^ t39;
+
+    t41 = t40 ^ t37;
+    t42 = t29 ^ t33;
+    t43 = t29 ^ t40;
+    t44 = t33 ^ t37;
+    t45 = t42 ^ t41;
+    z0 = t44 & y15;
+    z1 = t37 & y6;
+    z2 = t33 & x7;
+    z3 = t43 & y16;
+    z4 = t40 & y1;
+    z5 = t29 & y7;
+    z6 = t42 & y11;
+    z7 = t45 & y17;
+    z8 = t41 & y10;
+    z9 = t44 & y12;
+    z10 = t37 & y3;
+    z11 = t33 & y4;
+    z12 = t43 & y13;
+    z13 = t40 & y5;
+    z14 = t29 & y2;
+    z15 = t42 & y9;
+    z16 = t45 & y14;
+    z17 = t41 & y8;
+
+    // Bottom linear transformation
+    t46 = z15 ^ z16;
+    t47 = z10 ^ z11;
+    t48 = z5 ^ z13;
+    t49 = z9 ^ z10;
+    t50 = z2 ^ z12;
+    t51 = z2 ^ z5;
+    t52 = z7 ^ z8;
+    t53 = z0 ^ z3;
+    t54 = z6 ^ z7;
+    t55 = z16 ^ z17;
+    t56 = z12 ^ t48;
+    t57 = t50 ^ t53;
+    t58 = z4 ^ t46;
+    t59 = z3 ^ t54;
+    t60 = t46 ^ t57;
+    t61 = z14 ^ t57;
+    t62 = t52 ^ t58;
+    t63 = t49 ^ t58;
+    t64 = z4 ^ t59;
+    t65 = t61 ^ t62;
+    t66 = z1 ^ t63;
+    s0 = t59 ^ t63;
+    s6 = t56 ^ ~t62;
+    s7 = t48 ^ ~t60;
+    t67 = t64 ^ t65;
+    s3 = t53 ^ t66;
+    s4 = t51 ^ t66;
+    s5 = t47 ^ t65;
+    s1 = t64 ^ ~s3;
+    s2 = t55 ^ ~t67;
+
+    q[7] = s0;
+    q[6] = s1;
+    q[5] = s2;
+    q[4] = s3;
+    q[3] = s4;
+    q[2] = s5;
+    q[1] = s6;
+    q[0] = s7;
+}
+
+/*
+The inverse S-box through the forward circuit: with S(x) = M * x^-1 ^ 0x63,
+undoing the affine map gives x^-1 = M^-1 * (S(x) ^ 0x63), and
+InvS(y) = (M^-1 * (y ^ 0x63))^-1 applies that on both sides of bs_sbox.
+*/
+static inline void bs_inv_affine(__m128i q[8]) {
+    __m128i q0 = ~q[0], q1 = ~q[1], q2 = q[2], q3 = q[3], q4 = q[4], q5 = ~q[5], q6 = ~q[6], q7 = q[7];
+    q[0] = q2 ^ q5 ^ q7;
+    q[1] = q3 ^ q6 ^ q0;
+    q[2] = q4 ^ q7 ^ q1;
+    q[3] = q5 ^ q0 ^ q2;
+    q[4] = q6 ^ q1 ^ q3;
+    q[5] = q7 ^ q2 ^ q4;
+    q[6] = q0 ^ q3 ^ q5;
+    q[7] = q1 ^ q4 ^ q6;
+}
+
+static inline void bs_inv_sbox(__m128i q[8]) {
+    bs_inv_affine(q);
+    bs_sbox(q);
+    bs_inv_affine(q);
+}
+
+// out = 2 * in in GF(2^8), on bit planes
+static inline void bs_xtime(__m128i out[8], const __m128i in[8]) {
+    out[0] = in[7];
+    out[1] = in[0] ^ in[7];
+    out[2] = in[1];
+    out[3] = in[2] ^ in[7];
+    out[4] = in[3] ^ in[7];
+    out[5] = in[4];
+    out[6] = in[5];
+    out[7] = in[6];
+}
+
+/*
+Byte shuffles on the state, which is column-major as in memory (byte 4c + r
+is row r of column c). BS_ROT1 / BS_ROT2 bring row r + 1 / r + 2 of each
+column into row r.
+*/
+#define BS_SHIFT_ROWS     _mm_setr_epi8(0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12, 1, 6, 11)
+#define BS_INV_SHIFT_ROWS _mm_setr_epi8(0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3)
+#define BS_ROT1           _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12)
+#define BS_ROT2           _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13)
+
+__attribute__((target("ssse3")))
+static inline void bs_shuffle(__m128i q[8], __m128i mask) {
+    for (int j = 0; j < 8; j++) q[j] = _mm_shuffle_epi8(q[j], mask);
+}
+
+// out_r = 2 a_r ^ 3 a_r+1 ^ a_r+2 ^ a_r+3 = 2 (a_r ^ a_r+1) ^ a_r+1 ^ (a_r+2 ^ a_r+3)
+__attribute__((target("ssse3")))
+static inline void bs_mix_columns(__m128i q[8]) {
+    __m128i r[8], t[8], t2[8];
+    int j;
+
+    for (j = 0; j < 8; j++) {
+        r[j] = _mm_shuffle_epi8(q[j], BS_ROT1);
+        t[j] = q[j] ^ r[j];
+    }
+    bs_xtime(t2, t);
+    for (j = 0; j < 8; j++) q[j] = t2[j] ^ r[j] ^ _mm_shuffle_epi8(t[j], BS_ROT2);
+}
+
+// InvMixColumns = MixColumns * (5 + 4 x^2): a ^= 4 (a ^ a_r+2), then MixColumns
+__attribute__((target("ssse3")))
+static inline void bs_inv_mix_columns(__m128i q[8]) {
+    __m128i u[8], u2[8], u4[8];
+    int j;
+
+    for (j = 0; j < 8; j++) u[j] = q[j] ^ _mm_shuffle_epi8(q[j], BS_ROT2);
+    bs_xtime(u2, u);
+    bs_xtime(u4, u2);
+    for (j = 0; j < 8; j++) q[j] ^= u4[j];
+    bs_mix_columns(q);
+}
+
+// SubWord through the circuit, so the key schedule does not index SBOX with key bytes either
+static uint32_t sub_word_bitslice(uint32_t w) {
+    __m128i q[8] = { _mm_cvtsi32_si128((int)w) };
+    bs_ortho(q);
+    bs_sbox(q);
+    bs_ortho(q);
+    return (uint32_t)_mm_cvtsi128_si32(q[0]);
+}
+
+/*
+Round keys as bit planes: each round key is copied into all 8 block slots
+and transposed, so plane j has 0xff in every byte whose key bit j is set.
+*/
+static void aes_expand_bitslice(aes_ctx *ctx, const uint8_t *key, int nk) {
+    uint32_t w[60];
+    int nr = ctx->rounds;
+
+    aes_key_words(w, key, nk, nr, sub_word_bitslice);
+    for (int r = 0; r <= nr; r++) {
+        uint8_t bytes[16];
+        __m128i *planes = ctx->ek.planes + 8 * r;
+        for (int i = 0; i < 4; i++) store32_be(bytes + 4 * i, w[4 * r + i]);
+        for (int j = 0; j < 8; j++) planes[j] = _mm_loadu_si128((const __m128i *)bytes);
+        bs_ortho(planes);
+        memset(bytes, 0, sizeof bytes);
+    }
+    memset(w, 0, sizeof w);
+}
+
+// Expands a 16-, 24- or 32-byte key. Returns 0, or -1 for any other key length.
+int aes_init(aes_ctx *ctx, const uint8_t *key, size_t key_len) {
+    if (key_len != 16 && key_len != 24 && key_len != 32) return -1;
+    if (aes_backend < 0) aes_backend = aes_best_backend();
+    int nk = (int)(key_len / 4);
+    ctx->rounds = nk + 6;
+    ctx->backend = aes_backend;
+    if (ctx->backend == AES_NI) aes_expand_ni(ctx, key, nk);
+    else if (ctx->backend == AES_BITSLICE) aes_expand_bitslice(ctx, key, nk);
+    else aes_expand_ttable(ctx, key, nk);
+    return 0;
+}
+
+void aes_wipe(aes_ctx *ctx) {
+    volatile uint8_t *p = (volatile uint8_t *)ctx;
+    for (size_t i = 0; i < sizeof *ctx; i++) p[i] = 0;
+}
+
+/*
+Heap-allocated contexts for callers that cannot lay out an aes_ctx
+themselves, such as the ctypes binding in aes.py. aes_new returns NULL for
+a bad key length or when out of memory; aes_free wipes the round keys.
+*/
+aes_ctx *aes_new(const uint8_t *key, size_t key_len) {
+    aes_ctx *ctx = malloc(sizeof *ctx);    // malloc's alignment covers the __m128i members
+    if (ctx != NULL && aes_init(ctx, key, key_len) != 0) {
+        free(ctx);
+        ctx = NULL;
+    }
+    return ctx;
+}
+
+void aes_free(aes_ctx *ctx) {
+    if (ctx == NULL) return;
+    aes_wipe(ctx);
+    free(ctx);
+}
+
+const char *aes_backend_name(const aes_ctx *ctx) {
+    return aes_backend_names[ctx->backend];
+}
+
+/*
+T-table block functions. The state is four big-endian column words; each
+output column takes one byte from each input column (ShiftRows) through one
+table each, which also applies SubBytes and MixColumns.
+*/
+static void aes_encrypt_block_ttable(const aes_ctx *ctx, const uint8_t in[16], uint8_t out[16]) {
+    const uint32_t *rk = ctx->ek.w;
+    uint32_t s0 = load32_be(in) ^ rk[0];
+    uint32_t s1 = load32_be(in + 4) ^ rk[1];
+    uint32_t s2 = load32_be(in + 8) ^ rk[2];
+    uint32_t s3 = load32_be(in + 12) ^ rk[3];
+    uint32_t t0, t1, t2, t3;
+
+    for (int r = 1; r < ctx->rounds; r++) {
+        rk += 4;
+        t0 = Te0[s0 >> 24] ^ Te1[(s1 >> 16) & 0xff] ^ Te2[(s2 >> 8) & 0xff] ^ Te3[s3 & 0xff] ^ rk[0];
+        t1 = Te0[s1 >> 24] ^ Te1[(s2 >> 16) & 0xff] ^ Te2[(s3 >> 8) & 0xff] ^ Te3[s0 & 0xff] ^ rk[1];
+        t2 = Te0[s2 >> 24] ^ Te1[(s3 >> 16) & 0xff] ^ Te2[(s0 >> 8) & 0xff] ^ Te3[s1 & 0xff] ^ rk[2];
+        t3 = Te0[s3 >> 24] ^ Te1[(s0 >> 16) & 0xff] ^ Te2[(s1 >> 8) & 0xff] ^ Te3[s2 & 0xff] ^ rk[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+
+    // Final round: no MixColumns
+    rk += 4;
+    t0 = ((uint32_t)SBOX[s0 >> 24] << 24) ^ ((uint32_t)SBOX[(s1 >> 16) & 0xff] << 16) ^
+         ((uint32_t)SBOX[(s2 >> 8) & 0xff] << 8) ^ (uint32_t)SBOX[s3 & 0xff];
+    t1 = ((uint32_t)SBOX[s1 >> 24] << 24) ^ ((uint32_t)SBOX[(s2 >> 16) & 0xff] << 16) ^
+         ((uint32_t)SBOX[(s3 >> 8) & 0xff] << 8) ^ (uint32_t)SBOX[s0 & 0xff];
+    t2 = ((uint32_t)SBOX[s2 >> 24] << 24) ^ ((uint32_t)SBOX[(s3 >> 16) & 0xff] << 16) ^
+         ((uint32_t)SBOX[(s0 >> 8) & 0xff] << 8) ^ (uint32_t)SBOX[s1 & 0xff];
+    t3 = ((uint32_t)SBOX[s3 >> 24] << 24) ^ ((uint32_t)SBOX[(s0 >> 16) & 0xff] << 16) ^
+         ((uint32_t)SBOX[(s1 >> 8) & 0xff] << 8) ^ (uint32_t)SBOX[s2 & 0xff];
+    store32_be(out, t0 ^ rk[0]);
+    store32_be(out + 4, t1 ^ rk[1]);
+    store32_be(out + 8, t2 ^ rk[2]);
+    store32_be(out + 12, t3 ^ rk[3]);
+}
+
+// Equivalent inverse cipher: same shape as encryption, ShiftRows goes the other way
+static void aes_decrypt_block_ttable(const aes_ctx *ctx, const uint8_t in[16], uint8_t out[16]) {
+    const uint32_t *rk = ctx->dk.w;
+    uint32_t s0 = load32_be(in) ^ rk[0];
+    uint32_t s1 = load32_be(in + 4) ^ rk[1];
+    uint32_t s2 = load32_be(in + 8) ^ rk[2];
+    uint32_t s3 = load32_be(in + 12) ^ rk[3];
+    uint32_t t0, t1, t2, t3;
+
+    for (int r = 1; r < ctx->rounds; r++) {
+        rk += 4;
+        t0 = Td0[s0 >> 24] ^ Td1[(s3 >> 16) & 0xff] ^ Td2[(s2 >> 8) & 0xff] ^ Td3[s1 & 0xff] ^ rk[0];
+        t1 = Td0[s1 >> 24] ^ Td1[(s0 >> 16) & 0xff] ^ Td2[(s3 >> 8) & 0xff] ^ Td3[s2 & 0xff] ^ rk[1];
+        t2 = Td0[s2 >> 24] ^ Td1[(s1 >> 16) & 0xff] ^ Td2[(s0 >> 8) & 0xff] ^ Td3[s3 & 0xff] ^ rk[2];
+        t3 = Td0[s3 >> 24] ^ Td1[(s2 >> 16) & 0xff] ^ Td2[(s1 >> 8) & 0xff] ^ Td3[s0 & 0xff] ^ rk[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+
+    rk += 4;
+    t0 = ((uint32_t)INV_SBOX[s0 >> 24] << 24) ^ ((uint32_t)INV_SBOX[(s3 >> 16) & 0xff] << 16) ^
+         ((uint32_t)INV_SBOX[(s2 >> 8) & 0xff] << 8) ^ (uint32_t)INV_SBOX[s1 & 0xff];
+    t1 = ((uint32_t)INV_SBOX[s1 >> 24] << 24) ^ ((uint32_t)INV_SBOX[(s0 >> 16) & 0xff] << 16) ^
+         ((uint32_t)INV_SBOX[(s3 >> 8) & 0xff] << 8) ^ (uint32_t)INV_SBOX[s2 & 0xff];
+    t2 = ((uint32_t)INV_SBOX[s2 >> 24] << 24) ^ ((uint32_t)INV_SBOX[(s1 >> 16) & 0xff] << 16) ^
+         ((uint32_t)INV_SBOX[(s0 >> 8) & 0xff] << 8) ^ (uint32_t)INV_SBOX[s3 & 0xff];
+    t3 = ((uint32_t)INV_SBOX[s3 >> 24] << 24) ^ ((uint32_t)INV_SBOX[(s2 >> 16) & 0xff] << 16) ^
+         ((uint32_t)INV_SBOX[(s1 >> 8) & 0xff] << 8) ^ (uint32_t)INV_SBOX[s0 & 0xff];
+    store32_be(out, t0 ^ rk[0]);
+    store32_be(out + 4, t1 ^ rk[1]);
+    store32_be(out + 8, t2 ^ rk[2]);
+    store32_be(out + 12, t3 ^ rk[3]);
+}
+
+/*
+AES-NI block functions. aesenc has a latency of several cycles but can start
+a new block every cycle, so 8 independent blocks are pushed through each
+round together; the remaining 1..7 blocks go one at a time.
+*/
+#define AES_NI_ROUND8(op, b, k) do { \
+    b[0] = op(b[0], k); b[1] = op(b[1], k); b[2] = op(b[2], k); b[3] = op(b[3], k); \
+    b[4] = op(b[4], k); b[5] = op(b[5], k); b[6] = op(b[6], k); b[7] = op(b[7], k); \
+} while (0)
+
+__attribute__((target("aes")))
+static void aes_crypt_blocks_ni(const __m128i *rk, int rounds, int decrypt,
+                                const uint8_t *in, uint8_t *out, size_t nblocks) {
+    const __m128i *src = (const __m128i *)in;
+    __m128i *dst = (__m128i *)out;
+    int i, r;
+
+    for (; nblocks >= 8; nblocks -= 8, src += 8, dst += 8) {
+        __m128i b[8];
+        for (i = 0; i < 8; i++) b[i] = _mm_xor_si128(_mm_loadu_si128(src + i), rk[0]);
+        if (decrypt) {
+            for (r = 1; r < rounds; r++) AES_NI_ROUND8(_mm_aesdec_si128, b, rk[r]);
+            AES_NI_ROUND8(_mm_aesdeclast_si128, b, rk[rounds]);
+        } else {
+            for (r = 1; r < rounds; r++) AES_NI_ROUND8(_mm_aesenc_si128, b, rk[r]);
+            AES_NI_ROUND8(_mm_aesenclast_si128, b, rk[rounds]);
+        }
+        for (i = 0; i < 8; i++) _mm_storeu_si128(dst + i, b[i]);
+    }
+    for (; nblocks > 0; nblocks--, src++, dst++) {
+        __m128i b = _mm_xor_si128(_mm_loadu_si128(src), rk[0]);
+        if (decrypt) {
+            for (r = 1; r < rounds; r++) b = _mm_aesdec_si128(b, rk[r]);
+            b = _mm_aesdeclast_si128(b, rk[rounds]);
+        } else {
+            for (r = 1; r < rounds; r++) b = _mm_aesenc_si128(b, rk[r]);
+            b = _mm_aesenclast_si128(b, rk[rounds]);
+        }
+        _mm_storeu_si128(dst, b);
+    }
+}
+
+/*
+Bitsliced block functions: 8 blocks per call. Encryption runs the rounds
+forward on the bit planes; decryption runs them backwards with the inverse
+steps and the same round keys, so the bitsliced backend needs no dk.
+*/
+__attribute__((target("ssse3")))
+static void aes_encrypt8_bitslice(const aes_ctx *ctx, const uint8_t *in, uint8_t *out) {
+    const __m128i *rk = ctx->ek.planes;
+    __m128i q[8];
+    int j, r;
+
+    for (j = 0; j < 8; j++) q[j] = _mm_loadu_si128((const __m128i *)(in + 16 * j));
+    bs_ortho(q);
+    for (j = 0; j < 8; j++) q[j] ^= rk[j];
+    for (r = 1; r < ctx->rounds; r++) {
+        bs_sbox(q);
+        bs_shuffle(q, BS_SHIFT_ROWS);
+        bs_mix_columns(q);
+        for (j = 0; j < 8; j++) q[j] ^= rk[8 * r + j];
+    }
+    bs_sbox(q);
+    bs_shuffle(q, BS_SHIFT_ROWS);
+    for (j = 0; j < 8; j++) q[j] ^= rk[8 * r + j];
+    bs_ortho(q);
+    for (j = 0; j < 8; j++) _mm_storeu_si128((__m128i *)(out + 16 * j), q[j]);
+}
+
+__attribute__((target("ssse3")))
+static void aes_decrypt8_bitslice(const aes_ctx *ctx, const uint8_t *in, uint8_t *out) {
+    const __m128i *rk = ctx->ek.planes;
+    __m128i q[8];
+    int j, r;
+
+    for (j = 0; j < 8; j++) q[j] = _mm_loadu_si128((const __m128i *)(in + 16 * j));
+    bs_ortho(q);
+    for (j = 0; j < 8; j++) q[j] ^= rk[8 * ctx->rounds + j];
+    for (r = ctx->rounds - 1; r > 0; r--) {
+        bs_shuffle(q, BS_INV_SHIFT_ROWS);
+        bs_inv_sbox(q);
+        for (j = 0; j < 8; j++) q[j] ^= rk[8 * r + j];
+        bs_inv_mix_columns(q);
+    }
+    bs_shuffle(q, BS_INV_SHIFT_ROWS);
+    bs_inv_sbox(q);
+    for (j = 0; j < 8; j++) q[j] ^= rk[j];
+    bs_ortho(q);
+    for (j = 0; j < 8; j++) _mm_storeu_si128((__m128i *)(out + 16 * j), q[j]);
+}
+
+// Any number of blocks; a last group of fewer than 8 is padded out with zero blocks
+static void aes_crypt_blocks_bitslice(const aes_ctx *ctx, int decrypt, const uint8_t *in, uint8_t *out,
+                                      size_t nblocks) {
+    for (; nblocks >= 8; nblocks -= 8, in += 128, out += 128) {
+        if (decrypt) aes_decrypt8_bitslice(ctx, in, out);
+        else aes_encrypt8_bitslice(ctx, in, out);
+    }
+    if (nblocks > 0) {
+        uint8_t buf[128] = {0};
+        memcpy(buf, in, 16 * nblocks);
+        if (decrypt) aes_decrypt8_bitslice(ctx, buf, buf);
+        else aes_encrypt8_bitslice(ctx, buf, buf);
+        memcpy(out, buf, 16 * nblocks);
+        memset(buf, 0, sizeof buf);
+    }
+}
+
+// Encrypts or decrypts nblocks independent 16-byte blocks; 'in' and 'out' may be the same buffer
+void aes_encrypt_blocks(const aes_ctx *ctx, const uint8_t *in, uint8_t *out, size_t nblocks) {
+    if (ctx->backend == AES_NI) {
+        aes_crypt_blocks_ni(ctx->ek.v, ctx->rounds, 0, in, out, nblocks);
+        return;
+    }
+    if (ctx->backend == AES_BITSLICE) {
+        aes_crypt_blocks_bitslice(ctx, 0, in, out, nblocks);
+        return;
+    }
+    for (size_t i = 0; i < nblocks; i++) aes_encrypt_block_ttable(ctx, in + 16 * i, out + 16 * i);
+}
+
+void aes_decrypt_blocks(const aes_ctx *ctx, const uint8_t *in, uint8_t *out, size_t nblocks) {
+    if (ctx->backend == AES_NI) {
+        aes_crypt_blocks_ni(ctx->dk.v, ctx->rounds, 1, in, out, nblocks);
+        return;
+    }
+    if (ctx->backend == AES_BITSLICE) {
+        aes_crypt_blocks_bitslice(ctx, 1, in, out, nblocks);
+        return;
+    }
+    for (size_t i = 0; i < nblocks; i++) aes_decrypt_block_ttable(ctx, in + 16 * i, out + 16 * i);
+}
+
+/*
+ECB with PKCS#7 padding, as ecb_encrypt / ecb_decrypt in aes.py.
+aes_ecb_encrypt writes len rounded up to the next multiple of 16 (a full
+block of padding when len already is one) and returns that length.
+aes_ecb_decrypt returns the unpadded length, or -1 if the length or the
+padding is invalid.
+*/
+size_t aes_ecb_encrypt(const aes_ctx *ctx, const uint8_t *plaintext, size_t len, uint8_t *ciphertext) {
+    size_t full = len / 16;
+    uint8_t last[16];
+    uint8_t pad = (uint8_t)(16 - len % 16);
+
+    aes_encrypt_blocks(ctx, plaintext, ciphertext, full);
+    memcpy(last, plaintext + 16 * full, len % 16);
+    memset(last + len % 16, pad, pad);
+    aes_encrypt_blocks(ctx, last, ciphertext + 16 * full, 1);
+    return 16 * (full + 1);
+}
+
+long aes_ecb_decrypt(const aes_ctx *ctx, const uint8_t *ciphertext, size_t len, uint8_t *plaintext) {
+    if (len == 0 || len % 16 != 0) return -1;
+    aes_decrypt_blocks(ctx, ciphertext, plaintext, len / 16);
+
+    uint8_t pad = plaintext[len - 1];
+    if (pad == 0 || pad > 16) return -1;
+    for (size_t i = len - pad; i < len; i++) {
+        if (plaintext[i] != pad) return -1;
+    }
+    return (long)(len - pad);
+}
+
+/*
+CBC mode (SP 800-38A section 6.2): each plaintext block is XORed with the
+previous ciphertext block (the IV for the first) before encryption.
+Encryption is inherently serial. Decryption is not: every block is
+D(C[i]) ^ C[i-1] with all ciphertext known up front, so it runs 8 blocks
+wide like ECB.
+
+The block functions take whole blocks and leave the last ciphertext block
+in iv, so a long message can be fed in pieces. 'in' and 'out' may be the
+same buffer.
+*/
+__attribute__((target("aes")))
+static void aes_cbc_encrypt_ni(const aes_ctx *ctx, uint8_t iv[16], const uint8_t *in, uint8_t *out, size_t nblocks) {
+    const __m128i *rk = ctx->ek.v;
+    __m128i b = _mm_loadu_si128((const __m128i *)iv);
+
+    for (; nblocks > 0; nblocks--, in += 16, out += 16) {
+        b = _mm_xor_si128(b, _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), rk[0]));
+        for (int r = 1; r < ctx->rounds; r++) b = _mm_aesenc_si128(b, rk[r]);
+        b = _mm_aesenclast_si128(b, rk[ctx->rounds]);
+        _mm_storeu_si128((__m128i *)out, b);
+    }
+    _mm_storeu_si128((__m128i *)iv, b);
+}
+
+// All 8 ciphertext blocks are loaded before any output is stored, which keeps in == out safe
+__attribute__((target("aes")))
+static void aes_cbc_decrypt_ni(const aes_ctx *ctx, uint8_t iv[16], const uint8_t *in, uint8_t *out, size_t nblocks) {
+    const __m128i *rk = ctx->dk.v;
+    const __m128i *src = (const __m128i *)in;
+    __m128i *dst = (__m128i *)out;
+    __m128i prev = _mm_loadu_si128((const __m128i *)iv);
+    int i, r;
+
+    for (; nblocks >= 8; nblocks -= 8, src += 8, dst += 8) {
+        __m128i c[8], b[8];
+        for (i = 0; i < 8; i++) {
+            c[i] = _mm_loadu_si128(src + i);
+            b[i] = _mm_xor_si128(c[i], rk[0]);
+        }
+        for (r = 1; r < ctx->rounds; r++) AES_NI_ROUND8(_mm_aesdec_si128, b, rk[r]);
+        AES_NI_ROUND8(_mm_aesdeclast_si128, b, rk[ctx->rounds]);
+        _mm_storeu_si128(dst, _mm_xor_si128(b[0], prev));
+        for (i = 1; i < 8; i++) _mm_storeu_si128(dst + i, _mm_xor_si128(b[i], c[i - 1]));
+        prev = c[7];
+    }
+    for (; nblocks > 0; nblocks--, src++, dst++) {
+        __m128i c = _mm_loadu_si128(src);
+        __m128i b = _mm_xor_si128(c, rk[0]);
+        for (r = 1; r < ctx->rounds; r++) b = _mm_aesdec_si128(b, rk[r]);
+        b = _mm_aesdeclast_si128(b, rk[ctx->rounds]);
+        _mm_storeu_si128(dst, _mm_xor_si128(b, prev));
+        prev = c;
+    }
+    _mm_storeu_si128((__m128i *)iv, prev);
+}
+
+void aes_cbc_encrypt_blocks(const aes_ctx *ctx, uint8_t iv[16], const uint8_t *in, uint8_t *out, size_t nblocks) {
+    if (ctx->backend == AES_NI) {
+        aes_cbc_encrypt_ni(ctx, iv, in, out, nblocks);
+        return;
+    }
+    // The bitsliced backend runs a whole 8-block batch per block here; only decryption gets its width
+    for (; nblocks > 0; nblocks--, in += 16, out += 16) {
+        for (int i = 0; i < 16; i++) iv[i] ^= in[i];
+        aes_encrypt_blocks(ctx, iv, iv, 1);
+        memcpy(out, iv, 16);
+    }
+}
+
+void aes_cbc_decrypt_blocks(const aes_ctx *ctx, uint8_t iv[16], const uint8_t *in, uint8_t *out, size_t nblocks) {
+    if (ctx->backend == AES_NI) {
+        aes_cbc_decrypt_ni(ctx, iv, in, out, nblocks);
+        return;
+    }
+    // 8 blocks at a time through a copy of the ciphertext, which keeps in == out safe
+    uint8_t saved[128];
+    while (nblocks > 0) {
+        size_t n = nblocks < 8 ? nblocks : 8;
+        memcpy(saved, in, 16 * n);
+        aes_decrypt_blocks(ctx, saved, out, n);
+        for (int i = 0; i < 16; i++) out[i] ^= iv[i];
+        for (size_t i = 16; i < 16 * n; i++) out[i] ^= saved[i - 16];
+        memcpy(iv, saved + 16 * (n - 1), 16);
+        in += 16 * n;
+        out += 16 * n;
+        nblocks -= n;
+    }
+}
+
+// CBC with PKCS#7 padding, with the same lengths and return values as the ECB functions above
+size_t aes_cbc_encrypt(const aes_ctx *ctx, const uint8_t iv[16], const uint8_t *plaintext, size_t len,
+                       uint8_t *ciphertext) {
+    size_t full = len / 16;
+    uint8_t chain[16], last[16];
+    uint8_t pad = (uint8_t)(16 - len % 16);
+
+    memcpy(chain, iv, 16);
+    aes_cbc_encrypt_blocks(ctx, chain, plaintext, ciphertext, full);
+    memcpy(last, plaintext + 16 * full, len % 16);
+    memset(last + len % 16, pad, pad);
+    aes_cbc_encrypt_blocks(ctx, chain, last, ciphertext + 16 * full, 1);
+    return 16 * (full + 1);
+}
+
+long aes_cbc_decrypt(const aes_ctx *ctx, const uint8_t iv[16], const uint8_t *ciphertext, size_t len,
+                     uint8_t *plaintext) {
+    uint8_t chain[16];
+
+    if (len == 0 || len % 16 != 0) return -1;
+    memcpy(chain, iv, 16);
+    aes_cbc_decrypt_blocks(ctx, chain, ciphertext, plaintext, len / 16);
+
+    uint8_t pad = plaintext[len - 1];
+    if (pad == 0 || pad > 16) return -1;
+    for (size_t i = len - pad; i < len; i++) {
+        if (plaintext[i] != pad) return -1;
+    }
+    return (long)(len - pad);
+}
+
+/*
+CTR mode (SP 800-38A section 6.5): keystream block i is the encryption of
+counter block iv + i, with the whole 16-byte block incremented as one
+big-endian integer. Encryption and decryption are the same operation.
+*/
+
+// counter += n, as a 128-bit big-endian integer
+static void aes_ctr_add(uint8_t counter[16], uint64_t n) {
+    for (int i = 15; i >= 0 && n != 0; i--) {
+        n += counter[i];
+        counter[i] = (uint8_t)n;
+        n >>= 8;
+    }
+}
+
+/*
+AES-NI CTR kernel: 8 counter blocks are encrypted together so 8 aesenc are
+in flight each round, as in aes_crypt_blocks_ni. The counter is kept as a
+little-endian 128-bit value so the 8 successors are one vector add each,
+and byte-reversed into big-endian blocks; a group whose low 64 bits would
+wrap takes the byte-wise increment instead.
+*/
+__attribute__((target("aes,ssse3")))
+static void aes_ctr_blocks_ni(const __m128i *rk, int rounds, uint8_t counter[16],
+                              const uint8_t *in, uint8_t *out, size_t nblocks) {
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i *src = (const __m128i *)in;
+    __m128i *dst = (__m128i *)out;
+    __m128i ctr = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)counter), bswap);
+    int i, r;
+
+    for (; nblocks >= 8; nblocks -= 8, src += 8, dst += 8) {
+        __m128i b[8];
+        if ((uint64_t)_mm_cvtsi128_si64(ctr) <= UINT64_MAX - 8) {
+            for (i = 0; i < 8; i++) {
+                b[i] = _mm_shuffle_epi8(_mm_add_epi64(ctr, _mm_set_epi64x(0, i)), bswap);
+            }
+            ctr = _mm_add_epi64(ctr, _mm_set_epi64x(0, 8));
+        } else {
+            uint8_t c[16];
+            _mm_storeu_si128((__m128i *)c, _mm_shuffle_epi8(ctr, bswap));
+            for (i = 0; i < 8; i++) {
+                b[i] = _mm_loadu_si128((const __m128i *)c);
+                aes_ctr_add(c, 1);
+            }
+            ctr = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)c), bswap);
+        }
+
+        for (i = 0; i < 8; i++) b[i] = _mm_xor_si128(b[i], rk[0]);
+        for (r = 1; r < rounds; r++) AES_NI_ROUND8(_mm_aesenc_si128, b, rk[r]);
+        AES_NI_ROUND8(_mm_aesenclast_si128, b, rk[rounds]);
+        for (i = 0; i < 8; i++) _mm_storeu_si128(dst + i, _mm_xor_si128(b[i], _mm_loadu_si128(src + i)));
+    }
+    _mm_storeu_si128((__m128i *)counter, _mm_shuffle_epi8(ctr, bswap));
+
+    for (; nblocks > 0; nblocks--, src++, dst++) {
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)counter), rk[0]);
+        for (r = 1; r < rounds; r++) b = _mm_aesenc_si128(b, rk[r]);
+        b = _mm_aesenclast_si128(b, rk[rounds]);
+        _mm_storeu_si128(dst, _mm_xor_si128(b, _mm_loadu_si128(src)));
+        aes_ctr_add(counter, 1);
+    }
+}
+
+/*
+XORs nblocks * 16 bytes of 'in' with the keystream starting at 'counter' and
+leaves 'counter' at the next unused block. 'in' and 'out' may be the same
+buffer.
+*/
+static void aes_ctr_blocks(const aes_ctx *key, uint8_t counter[16], const uint8_t *in, uint8_t *out,
+                           size_t nblocks) {
+    if (key->backend == AES_NI) {
+        aes_ctr_blocks_ni(key->ek.v, key->rounds, counter, in, out, nblocks);
+        return;
+    }
+    if (key->backend == AES_BITSLICE) {
+        // 8 counter blocks per bitsliced call
+        uint8_t keystream[128];
+        while (nblocks > 0) {
+            size_t n = nblocks < 8 ? nblocks : 8;
+            for (size_t i = 0; i < n; i++) {
+                memcpy(keystream + 16 * i, counter, 16);
+                aes_ctr_add(counter, 1);
+            }
+            aes_crypt_blocks_bitslice(key, 0, keystream, keystream, n);
+            for (size_t i = 0; i < 16 * n; i++) out[i] = in[i] ^ keystream[i];
+            in += 16 * n;
+            out += 16 * n;
+            nblocks -= n;
+        }
+        memset(keystream, 0, sizeof keystream);
+        return;
+    }
+    for (size_t n = 0; n < nblocks; n++, in += 16, out += 16) {
+        uint8_t keystream[16];
+        aes_encrypt_block_ttable(key, counter, keystream);
+        for (int i = 0; i < 16; i++) out[i] = in[i] ^ keystream[i];
+        aes_ctr_add(counter, 1);
+    }
+}
+
+/*
+Streaming CTR context. Calls to aes_ctr_update may use any lengths; the
+unused tail of a keystream block is kept for the next call. The context
+points at an expanded key, which must outlive it.
+*/
+typedef struct {
+    const aes_ctx *key;
+    uint8_t iv[16];             // counter block of keystream block 0
+    uint8_t counter[16];        // next block to generate
+    uint8_t keystream[16];
+    size_t keystream_pos;       // 16 when no keystream is buffered
+} aes_ctr_ctx;
+
+void aes_ctr_init(aes_ctr_ctx *ctx, const aes_ctx *key, const uint8_t iv[16]) {
+    ctx->key = key;
+    memcpy(ctx->iv, iv, 16);
+    memcpy(ctx->counter, iv, 16);
+    ctx->keystream_pos = 16;
+}
+
+// Positions the stream at byte 'offset', so the next update uses keystream from there on
+void aes_ctr_seek(aes_ctr_ctx *ctx, uint64_t offset) {
+    memcpy(ctx->counter, ctx->iv, 16);
+    aes_ctr_add(ctx->counter, offset / 16);
+    ctx->keystream_pos = 16;
+    if (offset % 16) {
+        memset(ctx->keystream, 0, 16);
+        aes_ctr_blocks(ctx->key, ctx->counter, ctx->keystream, ctx->keystream, 1);
+        ctx->keystream_pos = offset % 16;
+    }
+}
+
+void aes_ctr_update(aes_ctr_ctx *ctx, const uint8_t *in, uint8_t *out, size_t len) {
+    // Use up keystream left over from the previous call
+    while (len > 0 && ctx->keystream_pos < 16) {
+        *out++ = *in++ ^ ctx->keystream[ctx->keystream_pos++];
+        len--;
+    }
+
+    size_t nblocks = len / 16;
+    aes_ctr_blocks(ctx->key, ctx->counter, in, out, nblocks);
+    in += 16 * nblocks;
+    out += 16 * nblocks;
+    len -= 16 * nblocks;
+
+    if (len > 0) {
+        memset(ctx->keystream, 0, 16);
+        aes_ctr_blocks(ctx->key, ctx->counter, ctx->keystream, ctx->keystream, 1);
+        for (size_t i = 0; i < len; i++) out[i] = in[i] ^ ctx->keystream[i];
+        ctx->keystream_pos = len;
+    }
+}
+
+void aes_ctr_encrypt(const aes_ctx *key, const uint8_t iv[16], const uint8_t *in, uint8_t *out, size_t len) {
+    aes_ctr_ctx ctx;
+    aes_ctr_init(&ctx, key, iv);
+    aes_ctr_update(&ctx, in, out, len);
+    memset(&ctx, 0, sizeof ctx);
+}
+
+/*
+XTS-AES (IEEE 1619, SP 800-38E) for sector-addressed storage. The key is
+two AES keys: the data key encrypts the blocks, and the tweak key encrypts
+the sector number (a 128-bit little-endian integer) into the tweak T. Block
+j of the sector is E(P ^ T * a^j) ^ T * a^j, where multiplying by a is a
+1-bit left shift of the little-endian 128-bit tweak with 0x87 folded back in
+on carry. Blocks are independent, so both directions run 8 blocks wide. A
+sector whose length is not a multiple of 16 ends with ciphertext stealing:
+the short last block borrows the tail of the previous block's ciphertext.
+*/
+typedef struct {
+    aes_ctx data;
+    aes_ctx tweak;
+} aes_xts_ctx;
+
+/*
+The key is the data key followed by the tweak key: 32 bytes for
+XTS-AES-128 or 64 for XTS-AES-256. Returns 0, or -1 for any other length or
+when the two halves are equal (SP 800-38E requires distinct keys).
+*/
+int aes_xts_init(aes_xts_ctx *ctx, const uint8_t *key, size_t key_len) {
+    if (key_len != 32 && key_len != 64) return -1;
+
+    uint8_t diff = 0;
+    for (size_t i = 0; i < key_len / 2; i++) diff |= key[i] ^ key[key_len / 2 + i];
+    if (diff == 0) return -1;
+
+    aes_init(&ctx->data, key, key_len / 2);
+    aes_init(&ctx->tweak, key + key_len / 2, key_len / 2);
+    return 0;
+}
+
+// t = t * a
+static inline void xts_mul_alpha(uint8_t t[16]) {
+    uint8_t carry = t[15] >> 7;
+    for (int i = 15; i > 0; i--) t[i] = (uint8_t)((t[i] << 1) | (t[i - 1] >> 7));
+    t[0] = (uint8_t)((t[0] << 1) ^ (0x87 & (0 - carry)));
+}
+
+/*
+t * a on a tweak register: both 64-bit halves shift left, and the bits
+shifted out of the top of each half come back as the carry into the high
+half (bit 63) and as 0x87 into the low byte (bit 127).
+*/
+__attribute__((target("aes")))
+static inline __m128i xts_mul_alpha_ni(__m128i t) {
+    __m128i carries = _mm_shuffle_epi32(_mm_srai_epi32(t, 31), 0x13);
+    return _mm_xor_si128(_mm_add_epi64(t, t), _mm_and_si128(carries, _mm_set_epi32(0, 1, 0, 0x87)));
+}
+
+__attribute__((target("aes")))
+static void xts_blocks_ni(const aes_ctx *key, int decrypt, uint8_t tweak[16], const uint8_t *in, uint8_t *out,
+                          size_t nblocks) {
+    const __m128i *rk = decrypt ? key->dk.v : key->ek.v;
+    const __m128i *src = (const __m128i *)in;
+    __m128i *dst = (__m128i *)out;
+    __m128i t = _mm_loadu_si128((const __m128i *)tweak);
+    int i, r;
+
+    for (; nblocks >= 8; nblocks -= 8, src += 8, dst += 8) {
+        __m128i tw[8], b[8];
+        for (i = 0; i < 8; i++) {
+            tw[i] = t;
+            b[i] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128(src + i), t), rk[0]);
+            t = xts_mul_alpha_ni(t);
+        }
+        if (decrypt) {
+            for (r = 1; r < key->rounds; r++) AES_NI_ROUND8(_mm_aesdec_si128, b, rk[r]);
+            AES_NI_ROUND8(_mm_aesdeclast_si128, b, rk[key->rounds]);
+        } else {
+            for (r = 1; r < key->rounds; r++) AES_NI_ROUND8(_mm_aesenc_si128, b, rk[r]);
+            AES_NI_ROUND8(_mm_aesenclast_si128, b, rk[key->rounds]);
+        }
+        for (i = 0; i < 8; i++) _mm_storeu_si128(dst + i, _mm_xor_si128(b[i], tw[i]));
+    }
+    for (; nblocks > 0; nblocks--, src++, dst++) {
+        __m128i b = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128(src), t), rk[0]);
+        if (decrypt) {
+            for (r = 1; r < key->rounds; r++) b = _mm_aesdec_si128(b, rk[r]);
+            b = _mm_aesdeclast_si128(b, rk[key->rounds]);
+        } else {
+            for (r = 1; r < key->rounds; r++) b = _mm_aesenc_si128(b, rk[r]);
+            b = _mm_aesenclast_si128(b, rk[key->rounds]);
+        }
+        _mm_storeu_si128(dst, _mm_xor_si128(b, t));
+        t = xts_mul_alpha_ni(t);
+    }
+    _mm_storeu_si128((__m128i *)tweak, t);
+}
+
+// nblocks full blocks starting at tweak, which is left at the tweak of the next block
+static void xts_blocks(const aes_ctx *key, int decrypt, uint8_t tweak[16], const uint8_t *in, uint8_t *out,
+                       size_t nblocks) {
+    if (key->backend == AES_NI) {
+        xts_blocks_ni(key, decrypt, tweak, in, out, nblocks);
+        return;
+    }
+    uint8_t tweaks[128], buf[128];
+    while (nblocks > 0) {
+        size_t n = nblocks < 8 ? nblocks : 8;
+        for (size_t j = 0; j < n; j++) {
+            memcpy(tweaks + 16 * j, tweak, 16);
+            xts_mul_alpha(tweak);
+        }
+        for (size_t i = 0; i < 16 * n; i++) buf[i] = in[i] ^ tweaks[i];
+        if (decrypt) aes_decrypt_blocks(key, buf, buf, n);
+        else aes_encrypt_blocks(key, buf, buf, n);
+        for (size_t i = 0; i < 16 * n; i++) out[i] = buf[i] ^ tweaks[i];
+        in += 16 * n;
+        out += 16 * n;
+        nblocks -= n;
+    }
+    memset(buf, 0, sizeof buf);
+}
+
+static int xts_sector(const aes_xts_ctx *ctx, int decrypt, uint64_t sector, const uint8_t *in, uint8_t *out,
+                      size_t len) {
+    uint8_t tweak[16] = {0}, last_tweak[16], block[16], stolen[16];
+    size_t nblocks = len / 16, tail = len % 16;
+
+    if (len < 16) return -1;
+    for (int i = 0; i < 8; i++) tweak[i] = (uint8_t)(sector >> (8 * i));
+    aes_encrypt_blocks(&ctx->tweak, tweak, tweak, 1);
+    if (tail == 0) {
+        xts_blocks(&ctx->data, decrypt, tweak, in, out, nblocks);
+        return 0;
+    }
+
+    xts_blocks(&ctx->data, decrypt, tweak, in, out, nblocks - 1);
+    in += 16 * (nblocks - 1);
+    out += 16 * (nblocks - 1);
+    if (!decrypt) {
+        // The last full block's ciphertext gives up its tail to pad the short block
+        xts_blocks(&ctx->data, 0, tweak, in, block, 1);
+        memcpy(stolen, in + 16, tail);
+        memcpy(stolen + tail, block + tail, 16 - tail);
+        memcpy(out + 16, block, tail);
+        xts_blocks(&ctx->data, 0, tweak, stolen, out, 1);
+    } else {
+        // Undo the swap: the second-to-last block was encrypted with the later tweak
+        memcpy(last_tweak, tweak, 16);
+        xts_mul_alpha(tweak);
+        xts_blocks(&ctx->data, 1, tweak, in, block, 1);
+        memcpy(stolen, in + 16, tail);
+        memcpy(stolen + tail, block + tail, 16 - tail);
+        memcpy(out + 16, block, tail);
+        xts_blocks(&ctx->data, 1, last_tweak, stolen, out, 1);
+    }
+    memset(block, 0, sizeof block);
+    memset(stolen, 0, sizeof stolen);
+    return 0;
+}
+
+// One sector of len >= 16 bytes. Returns 0, or -1 if len is too short.
+int aes_xts_encrypt_sector(const aes_xts_ctx *ctx, uint64_t sector, const uint8_t *in, uint8_t *out, size_t len) {
+    return xts_sector(ctx, 0, sector, in, out, len);
+}
+
+int aes_xts_decrypt_sector(const aes_xts_ctx *ctx, uint64_t sector, const uint8_t *in, uint8_t *out, size_t len) {
+    return xts_sector(ctx, 1, sector, in, out, len);
+}
+
+/*
+nsectors consecutive sectors of sector_size bytes starting at first_sector,
+e.g. a run of a volume image. Returns 0, or -1 if sector_size is below 16.
+*/
+int aes_xts_encrypt_sectors(const aes_xts_ctx *ctx, uint64_t first_sector, size_t sector_size, const uint8_t *in,
+                            uint8_t *out, size_t nsectors) {
+    if (sector_size < 16) return -1;
+    for (size_t i = 0; i < nsectors; i++) {
+        xts_sector(ctx, 0, first_sector + i, in + i * sector_size, out + i * sector_size, sector_size);
+    }
+    return 0;
+}
+
+int aes_xts_decrypt_sectors(const aes_xts_ctx *ctx, uint64_t first_sector, size_t sector_size, const uint8_t *in,
+                            uint8_t *out, size_t nsectors) {
+    if (sector_size < 16) return -1;
+    for (size_t i = 0; i < nsectors; i++) {
+        xts_sector(ctx, 1, first_sector + i, in + i * sector_size, out + i * sector_size, sector_size);
+    }
+    return 0;
+}
+
+/*
+AES-GCM (SP 800-38D). The payload is CTR-encrypted from counter block J0 + 1
+with only the low 32 bits incrementing, and the tag is E(K, J0) XOR GHASH
+over the AAD, the ciphertext and their bit lengths. GHASH multiplies by
+H = E(K, 0^128) in GF(2^128), where the bits of each byte run from x^0 at
+the most significant end.
+
+Two GHASH paths:
+  - PCLMULQDQ: blocks are byte-reversed into the order the carry-less
+    multiply expects, and 8 blocks are multiplied by H^8..H^1 and summed
+    before a single reduction (aggregated reduction). With AES-NI as well,
+    the multiplies are interleaved with the aesenc rounds of the next 8
+    counter blocks, so the payload makes one pass through the core.
+  - portable: one bit of the block at a time with masks instead of
+    branches, for hosts without PCLMULQDQ.
+*/
+#define GCM_CHUNK 4096
+
+static int gcm_clmul = -1;      // main() can clear this to test the portable path
+
+static int gcm_clmul_available(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") != 0;
+}
+
+typedef struct {
+    aes_ctx cipher;
+    __m128i h_powers[8];        // H^1..H^8, byte-reversed, for the PCLMULQDQ path
+    uint64_t h[2];              // H as a big-endian 128-bit integer, high half first
+    int clmul;
+} aes_gcm_ctx;
+
+static const uint8_t gcm_zeros[16];
+
+// Reduces the 256-bit product lo + mid * x^64 + hi * x^128 to one field element
+__attribute__((target("pclmul")))
+static inline __m128i ghash_reduce(__m128i lo, __m128i mid, __m128i hi) {
+    __m128i t2, t4, t5, t7, t8, t9;
+
+    lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+    // The operands are bit-reflected, so the product comes out one bit short: shift the 256 bits left
+    t7 = _mm_srli_epi32(lo, 31);
+    t8 = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    lo = _mm_or_si128(lo, t7);
+    hi = _mm_or_si128(_mm_or_si128(hi, t8), t9);
+
+    // Reduce modulo x^128 + x^7 + x^2 + x + 1
+    t7 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+    t8 = _mm_srli_si128(t7, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(t7, 12));
+    t2 = _mm_srli_epi32(lo, 1);
+    t4 = _mm_srli_epi32(lo, 2);
+    t5 = _mm_srli_epi32(lo, 7);
+    lo = _mm_xor_si128(lo, _mm_xor_si128(_mm_xor_si128(t2, t4), _mm_xor_si128(t5, t8)));
+    return _mm_xor_si128(hi, lo);
+}
+
+// Accumulates the unreduced product a * b into lo / mid / hi
+#define GHASH_MUL_ACC(a, b, lo, mid, hi) do { \
+    lo = _mm_xor_si128(lo, _mm_clmulepi64_si128(a, b, 0x00)); \
+    hi = _mm_xor_si128(hi, _mm_clmulepi64_si128(a, b, 0x11)); \
+    mid = _mm_xor_si128(mid, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x01), \
+                                           _mm_clmulepi64_si128(a, b, 0x10))); \
+} while (0)
+
+#define GCM_BSWAP _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i ghash_mul_clmul(__m128i a, __m128i b) {
+    __m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    GHASH_MUL_ACC(a, b, lo, mid, hi);
+    return ghash_reduce(lo, mid, hi);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static void ghash_blocks_clmul(const __m128i h[8], uint8_t y[16], const uint8_t *data, size_t nblocks) {
+    const __m128i bswap = GCM_BSWAP;
+    __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)y), bswap);
+
+    for (; nblocks >= 8; nblocks -= 8, data += 128) {
+        __m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        for (int i = 0; i < 8; i++) {
+            __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), bswap);
+            if (i == 0) b = _mm_xor_si128(b, x);
+            GHASH_MUL_ACC(b, h[7 - i], lo, mid, hi);
+        }
+        x = ghash_reduce(lo, mid, hi);
+    }
+    for (; nblocks > 0; nblocks--, data += 16) {
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap);
+        x = ghash_mul_clmul(_mm_xor_si128(x, b), h[0]);
+    }
+    _mm_storeu_si128((__m128i *)y, _mm_shuffle_epi8(x, bswap));
+}
+
+static inline uint64_t load64_be(const uint8_t *p) {
+    return ((uint64_t)load32_be(p) << 32) | load32_be(p + 4);
+}
+
+static inline void store64_be(uint8_t *p, uint64_t v) {
+    store32_be(p, (uint32_t)(v >> 32));
+    store32_be(p + 4, (uint32_t)v);
+}
+
+/*
+Portable GHASH without tables or secret-dependent branches, after Pornin's
+ctmul64 in BearSSL. A 64x64 carry-less multiply is done with ordinary
+integer multiplies on operands masked to every fourth bit, so the carries
+land in the 3-bit holes and are masked off again. The 128-bit product takes
+three such multiplies with Karatsuba, and the upper halves come from the
+same multiplies on bit-reversed operands. GHASH's bit-reflected convention
+then costs a 1-bit shift before the reduction.
+*/
+static inline uint64_t bmul64(uint64_t x, uint64_t y) {
+    const uint64_t m0 = 0x1111111111111111ULL, m1 = 0x2222222222222222ULL;
+    const uint64_t m2 = 0x4444444444444444ULL, m3 = 0x8888888888888888ULL;
+    uint64_t x0 = x & m0, x1 = x & m1, x2 = x & m2, x3 = x & m3;
+    uint64_t y0 = y & m0, y1 = y & m1, y2 = y & m2, y3 = y & m3;
+    uint64_t z0 = (x0 * y0) ^ (x1 * y3) ^ (x2 * y2) ^ (x3 * y1);
+    uint64_t z1 = (x0 * y1) ^ (x1 * y0) ^ (x2 * y3) ^ (x3 * y2);
+    uint64_t z2 = (x0 * y2) ^ (x1 * y1) ^ (x2 * y0) ^ (x3 * y3);
+    uint64_t z3 = (x0 * y3) ^ (x1 * y2) ^ (x2 * y1) ^ (x3 * y0);
+    return (z0 & m0) | (z1 & m1) | (z2 & m2) | (z3 & m3);
+}
+
+static inline uint64_t rev64(uint64_t x) {
+    x = ((x & 0x5555555555555555ULL) << 1) | ((x >> 1) & 0x5555555555555555ULL);
+    x = ((x & 0x3333333333333333ULL) << 2) | ((x >> 2) & 0x3333333333333333ULL);
+    x = ((x & 0x0f0f0f0f0f0f0f0fULL) << 4) | ((x >> 4) & 0x0f0f0f0f0f0f0f0fULL);
+    x = ((x & 0x00ff00ff00ff00ffULL) << 8) | ((x >> 8) & 0x00ff00ff00ff00ffULL);
+    x = ((x & 0x0000ffff0000ffffULL) << 16) | ((x >> 16) & 0x0000ffff0000ffffULL);
+    return (x << 32) | (x >> 32);
+}
+
+// h[0] / y bytes 0..7 are the high half of the GHASH block
+static void ghash_blocks_portable(const uint64_t h[2], uint8_t y[16], const uint8_t *data, size_t nblocks) {
+    uint64_t y1 = load64_be(y), y0 = load64_be(y + 8);
+    uint64_t h1 = h[0], h0 = h[1], h2 = h0 ^ h1;
+    uint64_t h0r = rev64(h0), h1r = rev64(h1), h2r = h0r ^ h1r;
+
+    for (; nblocks > 0; nblocks--, data += 16) {
+        y1 ^= load64_be(data);
+        y0 ^= load64_be(data + 8);
+
+        uint64_t y0r = rev64(y0), y1r = rev64(y1);
+        uint64_t z0 = bmul64(y0, h0), z1 = bmul64(y1, h1), z2 = bmul64(y0 ^ y1, h2);
+        uint64_t z0h = bmul64(y0r, h0r), z1h = bmul64(y1r, h1r), z2h = bmul64(y0r ^ y1r, h2r);
+        z2 ^= z0 ^ z1;
+        z2h ^= z0h ^ z1h;
+        z0h = rev64(z0h) >> 1;
+        z1h = rev64(z1h) >> 1;
+        z2h = rev64(z2h) >> 1;
+
+        // 256-bit product v3:v2:v1:v0, shifted left by one for the reflected bit order
+        uint64_t v0 = z0, v1 = z0h ^ z2, v2 = z1 ^ z2h, v3 = z1h;
+        v3 = (v3 << 1) | (v2 >> 63);
+        v2 = (v2 << 1) | (v1 >> 63);
+        v1 = (v1 << 1) | (v0 >> 63);
+        v0 = v0 << 1;
+
+        // Reduce modulo x^128 + x^7 + x^2 + x + 1, one 64-bit word at a time
+        v2 ^= v0 ^ (v0 >> 1) ^ (v0 >> 2) ^ (v0 >> 7);
+        v1 ^= (v0 << 63) ^ (v0 << 62) ^ (v0 << 57);
+        v3 ^= v1 ^ (v1 >> 1) ^ (v1 >> 2) ^ (v1 >> 7);
+        v2 ^= (v1 << 63) ^ (v1 << 62) ^ (v1 << 57);
+        y0 = v2;
+        y1 = v3;
+    }
+    store64_be(y, y1);
+    store64_be(y + 8, y0);
+}
+
+// y = GHASH update over len bytes, the last block zero-padded
+static void gcm_ghash(const aes_gcm_ctx *ctx, uint8_t y[16], const uint8_t *data, size_t len) {
+    size_t nblocks = len / 16;
+    uint8_t last[16] = {0};
+
+    if (ctx->clmul) ghash_blocks_clmul(ctx->h_powers, y, data, nblocks);
+    else ghash_blocks_portable(ctx->h, y, data, nblocks);
+    if (len % 16) {
+        memcpy(last, data + 16 * nblocks, len % 16);
+        if (ctx->clmul) ghash_blocks_clmul(ctx->h_powers, y, last, 1);
+        else ghash_blocks_portable(ctx->h, y, last, 1);
+    }
+}
+
+__attribute__((target("pclmul,ssse3")))
+static void gcm_powers_clmul(aes_gcm_ctx *ctx, const uint8_t h[16]) {
+    __m128i h1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)h), GCM_BSWAP);
+    ctx->h_powers[0] = h1;
+    for (int i = 1; i < 8; i++) ctx->h_powers[i] = ghash_mul_clmul(ctx->h_powers[i - 1], h1);
+}
+
+// Expands a 16-, 24- or 32-byte key and precomputes H. Returns 0, or -1 for any other key length.
+int aes_gcm_init(aes_gcm_ctx *ctx, const uint8_t *key, size_t key_len) {
+    uint8_t h[16];
+
+    if (aes_init(&ctx->cipher, key, key_len) != 0) return -1;
+    if (gcm_clmul < 0) gcm_clmul = gcm_clmul_available();
+    ctx->clmul = gcm_clmul;
+
+    aes_encrypt_blocks(&ctx->cipher, gcm_zeros, h, 1);
+    ctx->h[0] = load64_be(h);
+    ctx->h[1] = load64_be(h + 8);
+    if (ctx->clmul) gcm_powers_clmul(ctx, h);
+    memset(h, 0, sizeof h);
+    return 0;
+}
+
+// inc32: the low 32 bits of the counter block wrap around on their own
+static inline void gcm_inc32(uint8_t counter[16], uint32_t n) {
+    store32_be(counter + 12, load32_be(counter + 12) + n);
+}
+
+/*
+Fused AES-NI / PCLMULQDQ pass over nblocks full blocks. Each iteration
+encrypts 8 counter blocks and, between their aesenc rounds, multiplies 8
+ciphertext blocks into the GHASH accumulators: on decryption those are the
+input blocks of the same group, on encryption the output of the previous
+group (the last group is hashed after the loop).
+*/
+__attribute__((target("aes,pclmul,ssse3")))
+static void gcm_crypt_ni(const aes_gcm_ctx *ctx, int decrypt, uint8_t counter[16], uint8_t y[16],
+                         const uint8_t *in, uint8_t *out, size_t nblocks) {
+    const __m128i bswap = GCM_BSWAP;
+    // Byte-reverses only the 32-bit counter word, so it can be incremented with a vector add
+    const __m128i ctr_swap = _mm_set_epi8(12, 13, 14, 15, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m128i *rk = ctx->cipher.ek.v;
+    const __m128i *h = ctx->h_powers;
+    int rounds = ctx->cipher.rounds;
+    __m128i ctr = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)counter), ctr_swap);
+    __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)y), bswap);
+    __m128i pending[8];         // ciphertext blocks still to be hashed, byte-reversed
+    int have_pending = 0;
+    int i, r;
+
+    for (; nblocks >= 8; nblocks -= 8, in += 128, out += 128) {
+        __m128i b[8];
+        __m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+
+        for (i = 0; i < 8; i++) {
+            b[i] = _mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(i, 0, 0, 0)), ctr_swap);
+            b[i] = _mm_xor_si128(b[i], rk[0]);
+        }
+        ctr = _mm_add_epi32(ctr, _mm_set_epi32(8, 0, 0, 0));
+
+        if (decrypt) {
+            for (i = 0; i < 8; i++) {
+                pending[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + 16 * i)), bswap);
+            }
+            have_pending = 1;
+        }
+        if (have_pending) pending[0] = _mm_xor_si128(pending[0], x);
+
+        for (r = 1; r < rounds; r++) {
+            AES_NI_ROUND8(_mm_aesenc_si128, b, rk[r]);
+            if (have_pending && r <= 8) GHASH_MUL_ACC(pending[r - 1], h[8 - r], lo, mid, hi);
+        }
+        AES_NI_ROUND8(_mm_aesenclast_si128, b, rk[rounds]);
+        if (have_pending) x = ghash_reduce(lo, mid, hi);
+
+        for (i = 0; i < 8; i++) {
+            b[i] = _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i *)(in + 16 * i)));
+            _mm_storeu_si128((__m128i *)(out + 16 * i), b[i]);
+        }
+        if (!decrypt) {
+            for (i = 0; i < 8; i++) pending[i] = _mm_shuffle_epi8(b[i], bswap);
+            have_pending = 1;
+        }
+    }
+    if (!decrypt && have_pending) {
+        __m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        pending[0] = _mm_xor_si128(pending[0], x);
+        for (i = 0; i < 8; i++) GHASH_MUL_ACC(pending[i], h[7 - i], lo, mid, hi);
+        x = ghash_reduce(lo, mid, hi);
+    }
+
+    for (; nblocks > 0; nblocks--, in += 16, out += 16) {
+        __m128i b = _mm_xor_si128(_mm_shuffle_epi8(ctr, ctr_swap), rk[0]);
+        __m128i c = _mm_loadu_si128((const __m128i *)in);
+        ctr = _mm_add_epi32(ctr, _mm_set_epi32(1, 0, 0, 0));
+        for (r = 1; r < rounds; r++) b = _mm_aesenc_si128(b, rk[r]);
+        b = _mm_xor_si128(_mm_aesenclast_si128(b, rk[rounds]), c);
+        _mm_storeu_si128((__m128i *)out, b);
+        if (!decrypt) c = b;
+        x = ghash_mul_clmul(_mm_xor_si128(x, _mm_shuffle_epi8(c, bswap)), h[0]);
+    }
+
+    _mm_storeu_si128((__m128i *)counter, _mm_shuffle_epi8(ctr, ctr_swap));
+    _mm_storeu_si128((__m128i *)y, _mm_shuffle_epi8(x, bswap));
+}
+
+/*
+CTR-encrypts or decrypts len bytes from 'counter' and hashes the ciphertext
+into y. Full blocks take the fused kernel when the host has both AES-NI and
+PCLMULQDQ; everything else goes GCM_CHUNK bytes at a time, encrypting a
+chunk of counter blocks and then hashing the chunk while it is in L1.
+*/
+static void gcm_crypt(const aes_gcm_ctx *ctx, int decrypt, uint8_t counter[16], uint8_t y[16],
+                      const uint8_t *in, uint8_t *out, size_t len) {
+    uint8_t keystream[GCM_CHUNK];
+
+    if (ctx->cipher.backend == AES_NI && ctx->clmul && len >= 16) {
+        size_t nblocks = len / 16;
+        gcm_crypt_ni(ctx, decrypt, counter, y, in, out, nblocks);
+        in += 16 * nblocks;
+        out += 16 * nblocks;
+        len -= 16 * nblocks;
+    }
+    if (len == 0) return;
+
+    for (size_t offset = 0; offset < len; offset += GCM_CHUNK) {
+        size_t n = len - offset < GCM_CHUNK ? len - offset : GCM_CHUNK;
+        size_t nblocks = (n + 15) / 16;
+        for (size_t b = 0; b < nblocks; b++) {
+            memcpy(keystream + 16 * b, counter, 16);
+            gcm_inc32(counter, 1);
+        }
+        aes_encrypt_blocks(&ctx->cipher, keystream, keystream, nblocks);
+
+        if (decrypt) gcm_ghash(ctx, y, in + offset, n);
+        for (size_t i = 0; i < n; i++) out[offset + i] = in[offset + i] ^ keystream[i];
+        if (!decrypt) gcm_ghash(ctx, y, out + offset, n);
+    }
+    memset(keystream, 0, sizeof keystream);
+}
+
+// J0 is IV || 0^31 || 1 for a 96-bit IV, and GHASH(IV, padded, || its bit length) otherwise
+static void gcm_j0(const aes_gcm_ctx *ctx, const uint8_t *iv, size_t iv_len, uint8_t j0[16]) {
+    if (iv_len == 12) {
+        memcpy(j0, iv, 12);
+        store32_be(j0 + 12, 1);
+        return;
+    }
+    uint8_t lengths[16] = {0};
+    memset(j0, 0, 16);
+    gcm_ghash(ctx, j0, iv, iv_len);
+    store64_be(lengths + 8, (uint64_t)iv_len * 8);
+    gcm_ghash(ctx, j0, lengths, 16);
+}
+
+static void gcm_finish(const aes_gcm_ctx *ctx, uint8_t y[16], const uint8_t j0[16], size_t aad_len, size_t len,
+                       uint8_t tag[16]) {
+    uint8_t lengths[16], mask[16];
+
+    store64_be(lengths, (uint64_t)aad_len * 8);
+    store64_be(lengths + 8, (uint64_t)len * 8);
+    gcm_ghash(ctx, y, lengths, 16);
+    aes_encrypt_blocks(&ctx->cipher, j0, mask, 1);
+    for (int i = 0; i < 16; i++) tag[i] = y[i] ^ mask[i];
+    memset(mask, 0, sizeof mask);
+}
+
+void aes_gcm_seal(const aes_gcm_ctx *ctx, uint8_t *ciphertext, uint8_t tag[16], const uint8_t *plaintext, size_t len,
+                  const uint8_t *aad, size_t aad_len, const uint8_t *iv, size_t iv_len) {
+    uint8_t j0[16], counter[16], y[16] = {0};
+
+    gcm_j0(ctx, iv, iv_len, j0);
+    gcm_ghash(ctx, y, aad, aad_len);
+    memcpy(counter, j0, 16);
+    gcm_inc32(counter, 1);
+    gcm_crypt(ctx, 0, counter, y, plaintext, ciphertext, len);
+    gcm_finish(ctx, y, j0, aad_len, len, tag);
+}
+
+/*
+Returns 0 and the plaintext if the tag verifies. Otherwise returns -1 and the
+output buffer is wiped, so unauthenticated plaintext is never handed out.
+*/
+int aes_gcm_open(const aes_gcm_ctx *ctx, uint8_t *plaintext, const uint8_t *ciphertext, size_t len,
+                 const uint8_t tag[16], const uint8_t *aad, size_t aad_len, const uint8_t *iv, size_t iv_len) {
+    uint8_t j0[16], counter[16], y[16] = {0}, computed[16];
+
+    gcm_j0(ctx, iv, iv_len, j0);
+    gcm_ghash(ctx, y, aad, aad_len);
+    memcpy(counter, j0, 16);
+    gcm_inc32(counter, 1);
+    gcm_crypt(ctx, 1, counter, y, ciphertext, plaintext, len);
+    gcm_finish(ctx, y, j0, aad_len, len, computed);
+
+    // Constant-time comparison
+    uint8_t diff = 0;
+    for (int i = 0; i < 16; i++) diff |= computed[i] ^ tag[i];
+    if (diff != 0) {
+        memset(plaintext, 0, len);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+Expanded-key cache for callers that switch among many keys, such as a
+service with one key per tenant. An entry holds a whole aes_gcm_ctx: the
+encryption round keys, the decryption round keys (equivalent inverse
+cipher) and GCM's H powers, so a hit skips all key setup. ECB and CTR use
+&entry->cipher. Keys are looked up by a caller-chosen nonzero handle.
+
+The cache is set-associative. A handle hashes to a set of
+AES_KEY_CACHE_WAYS entries, and a miss re-expands into the least recently
+used entry of that set. Lookups are O(1), memory is fixed when the cache is
+created, and evicted entries are wiped. A handle must always name the same
+key; call aes_key_cache_evict when a key is rotated or retired. The cache is
+not locked: use one per thread or put a lock around it.
+*/
+#define AES_KEY_CACHE_WAYS 8
+
+/*
+Tags live apart from the contexts: a set's tags fit in two cache lines, so
+a lookup does not touch 8 contexts of a few KiB each just to compare handles.
+*/
+typedef struct {
+    uint64_t handle;            // 0 = empty
+    uint64_t last_used;         // cache->clock at the last hit, 0 = empty
+} aes_key_cache_tag;
+
+typedef struct {
+    aes_key_cache_tag *tags;
+    aes_gcm_ctx *ctxs;          // ctxs[i] belongs to tags[i]
+    size_t nsets;
+    uint64_t clock;
+    uint64_t hits, misses;
+} aes_key_cache;
+
+// memset with a compiler barrier, so the wipe is not dropped as a dead store; much faster than byte stores
+static void aes_key_cache_wipe(aes_key_cache *cache, size_t i) {
+    memset(&cache->ctxs[i], 0, sizeof cache->ctxs[i]);
+    __asm__ __volatile__("" : : "r"(&cache->ctxs[i]) : "memory");
+    cache->tags[i].handle = 0;
+    cache->tags[i].last_used = 0;
+}
+
+/*
+Room for 'capacity' keys. The sets get twice that many entries between
+them: the hash never fills sets perfectly evenly, and a set that holds one
+key too few for a round-robin working set misses on every lookup. Returns 0,
+or -1 if out of memory.
+*/
+int aes_key_cache_init(aes_key_cache *cache, size_t capacity) {
+    cache->nsets = (2 * capacity + AES_KEY_CACHE_WAYS - 1) / AES_KEY_CACHE_WAYS;
+    if (cache->nsets == 0) cache->nsets = 1;
+    cache->tags = calloc(cache->nsets * AES_KEY_CACHE_WAYS, sizeof *cache->tags);
+    cache->ctxs = calloc(cache->nsets * AES_KEY_CACHE_WAYS, sizeof *cache->ctxs);
+    if (!cache->tags || !cache->ctxs) {
+        free(cache->tags);
+        free(cache->ctxs);
+        return -1;
+    }
+    cache->clock = 0;
+    cache->hits = cache->misses = 0;
+    return 0;
+}
+
+void aes_key_cache_free(aes_key_cache *cache) {
+    for (size_t i = 0; i < cache->nsets * AES_KEY_CACHE_WAYS; i++) aes_key_cache_wipe(cache, i);
+    free(cache->tags);
+    free(cache->ctxs);
+    cache->tags = NULL;
+    cache->ctxs = NULL;
+}
+
+// First entry of the handle's set: Fibonacci hashing, whose top bits spread sequential handles evenly
+static size_t aes_key_cache_set(const aes_key_cache *cache, uint64_t handle) {
+    uint64_t h = (handle * 0x9e3779b97f4a7c15ULL) >> 32;
+    return (size_t)((h * cache->nsets) >> 32) * AES_KEY_CACHE_WAYS;
+}
+
+/*
+Returns the expanded key for 'handle', expanding 'key' on a miss. Returns
+NULL for handle 0 or a key length aes_init rejects. The pointer stays valid
+until its entry is evicted by a later miss in the same set, so use it
+before the next lookup.
+*/
+const aes_gcm_ctx *aes_key_cache_get(aes_key_cache *cache, uint64_t handle, const uint8_t *key, size_t key_len) {
+    size_t set = aes_key_cache_set(cache, handle), victim = set;
+
+    if (handle == 0) return NULL;
+    for (size_t i = set; i < set + AES_KEY_CACHE_WAYS; i++) {
+        if (cache->tags[i].handle == handle) {
+            cache->tags[i].last_used = ++cache->clock;
+            cache->hits++;
+            return &cache->ctxs[i];
+        }
+        if (cache->tags[i].last_used < cache->tags[victim].last_used) victim = i;
+    }
+
+    cache->misses++;
+    aes_key_cache_wipe(cache, victim);
+    if (aes_gcm_init(&cache->ctxs[victim], key, key_len) != 0) {
+        aes_key_cache_wipe(cache, victim);
+        return NULL;
+    }
+    cache->tags[victim].handle = handle;
+    cache->tags[victim].last_used = ++cache->clock;
+    return &cache->ctxs[victim];
+}
+
+void aes_key_cache_evict(aes_key_cache *cache, uint64_t handle) {
+    size_t set = aes_key_cache_set(cache, handle);
+    for (size_t i = set; i < set + AES_KEY_CACHE_WAYS; i++) {
+        if (handle != 0 && cache->tags[i].handle == handle) aes_key_cache_wipe(cache, i);
+    }
+}
+
+/*
+Everything below is the self-test and benchmark program. Building with
+-DAES_NO_MAIN leaves only the library, as libaes.so for aes.py.
+*/
+#ifndef AES_NO_MAIN
+
+static void print_hex(const char *label, const uint8_t *p, size_t len) {
+    printf("%s", label);
+    for (size_t i = 0; i < len; i++) printf("%02x", p[i]);
+    printf("\n");
+}
+
+/*
+Known-answer tests, the same vectors aes.py's __main__ uses: FIPS-197
+appendix B and C.1 single blocks, and the four blocks of SP 800-38A F.1.1
+(ECB-AES128), plus the AES-192 and AES-256 examples of FIPS-197 C.2 and
+C.3, each encrypted and decrypted on every backend the CPU has.
+Returns the number of failures.
+*/
+static int aes_kats(void) {
+    static const struct {
+        uint8_t key[32];
+        size_t key_len;
+        uint8_t plaintext[64];
+        uint8_t ciphertext[64];
+        size_t len;
+        const char *name;
+    } kats[] = {
+        {
+            { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c }, 16,
+            { 0x32, 0x43, 0xf6, 0xa8, 0x88, 0x5a, 0x30, 0x8d, 0x31, 0x31, 0x98, 0xa2, 0xe0, 0x37, 0x07, 0x34 },
+            { 0x39, 0x25, 0x84, 0x1d, 0x02, 0xdc, 0x09, 0xfb, 0xdc, 0x11, 0x85, 0x97, 0x19, 0x6a, 0x0b, 0x32 },
+            16, "FIPS-197 B"
+        },
+        {
+            { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f }, 16,
+            { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff },
+            { 0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a },
+            16, "FIPS-197 C.1"
+        },
+        {
+            {
+                0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+                0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17
+            }, 24,
+            { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff },
+            { 0xdd, 0xa9, 0x7c, 0xa4, 0x86, 0x4c, 0xdf, 0xe0, 0x6e, 0xaf, 0x70, 0xa0, 0xec, 0x0d, 0x71, 0x91 },
+            16, "FIPS-197 C.2"
+        },
+        {
+            {
+                0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+                0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f
+            }, 32,
+            { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff },
+            { 0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf, 0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89 },
+            16, "FIPS-197 C.3"
+        },
+        {
+            { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c }, 16,
+            {
+                0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+                0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+                0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+                0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+            },
+            {
+                0x3a, 0xd7, 0x7b, 0xb4, 0x0d, 0x7a, 0x36, 0x60, 0xa8, 0x9e, 0xca, 0xf3, 0x24, 0x66, 0xef, 0x97,
+                0xf5, 0xd3, 0xd5, 0x85, 0x03, 0xb9, 0x69, 0x9d, 0xe7, 0x85, 0x89, 0x5a, 0x96, 0xfd, 0xba, 0xaf,
+                0x43, 0xb1, 0xcd, 0x7f, 0x59, 0x8e, 0xce, 0x23, 0x88, 0x1b, 0x00, 0xe3, 0xed, 0x03, 0x06, 0x88,
+                0x7b, 0x0c, 0x78, 0x5e, 0x27, 0xe8, 0xad, 0x3f, 0x82, 0x23, 0x20, 0x71, 0x04, 0x72, 0x5d, 0xd4
+            },
+            64, "SP 800-38A F.1.1"
+        },
+    };
+    int failures = 0;
+    int best = aes_best_backend();
+
+    for (int backend = AES_TTABLE; backend <= best; backend++) {
+        aes_backend = backend;
+        for (size_t k = 0; k < sizeof kats / sizeof kats[0]; k++) {
+            aes_ctx ctx;
+            uint8_t buf[64];
+            int ok;
+
+            aes_init(&ctx, kats[k].key, kats[k].key_len);
+            aes_encrypt_blocks(&ctx, kats[k].plaintext, buf, kats[k].len / 16);
+            ok = memcmp(buf, kats[k].ciphertext, kats[k].len) == 0;
+            aes_decrypt_blocks(&ctx, buf, buf, kats[k].len / 16);
+            ok = ok && memcmp(buf, kats[k].plaintext, kats[k].len) == 0;
+
+            printf("%-8s %-18s %s\n", aes_backend_names[backend], kats[k].name, ok ? "OK" : "FAILED");
+            if (!ok) failures++;
+            aes_wipe(&ctx);
+        }
+    }
+    aes_backend = best;
+    return failures;
+}
+
+/*
+CTR tests on every backend: SP 800-38A F.5.1 (CTR-AES128), then a longer
+message checked against the T-table path when it is produced in one call,
+in odd-sized pieces, and after seeking into the middle of a block. The
+counter starts just below a 2^64 boundary so the carry out of the low half
+is exercised too. Returns the number of failures.
+*/
+#define CTR_TEST_BYTES 1000
+
+static int aes_ctr_tests(void) {
+    static const uint8_t key[16] = {
+        0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+    };
+    static const uint8_t iv[16] = {
+        0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+    };
+    static const uint8_t plaintext[64] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+        0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+        0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+        0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+    };
+    static const uint8_t expected[64] = {
+        0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26, 0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+        0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff, 0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff,
+        0x5a, 0xe4, 0xdf, 0x3e, 0xdb, 0xd5, 0xd3, 0x5e, 0x5b, 0x4f, 0x09, 0x02, 0x0d, 0xb0, 0x3e, 0xab,
+        0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03, 0xd1, 0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c, 0xee
+    };
+    static const size_t pieces[] = { 1, 15, 16, 17, 100, 3, 128, 7, 200 };
+    uint8_t wrap_iv[16] = { 0 };
+    uint8_t message[CTR_TEST_BYTES], reference[CTR_TEST_BYTES], buf[CTR_TEST_BYTES];
+    int failures = 0;
+    int best = aes_best_backend();
+    aes_ctx ctx;
+
+    memset(wrap_iv + 8, 0xff, 8);
+    wrap_iv[15] = 0xf5;             // the low half wraps after 10 blocks
+    for (size_t i = 0; i < CTR_TEST_BYTES; i++) message[i] = (uint8_t)(i * 29 + 3);
+    aes_backend = AES_TTABLE;
+    aes_init(&ctx, key, 16);
+    aes_ctr_encrypt(&ctx, wrap_iv, message, reference, CTR_TEST_BYTES);
+
+    for (int backend = AES_TTABLE; backend <= best; backend++) {
+        aes_ctr_ctx stream;
+        size_t offset, k;
+        int ok;
+
+        aes_backend = backend;
+        aes_init(&ctx, key, 16);
+
+        aes_ctr_encrypt(&ctx, iv, plaintext, buf, 64);
+        ok = memcmp(buf, expected, 64) == 0;
+        aes_ctr_encrypt(&ctx, iv, buf, buf, 64);
+        ok = ok && memcmp(buf, plaintext, 64) == 0;
+        printf("%-8s %-18s %s\n", aes_backend_names[backend], "SP 800-38A F.5.1", ok ? "OK" : "FAILED");
+        if (!ok) failures++;
+
+        aes_ctr_encrypt(&ctx, wrap_iv, message, buf, CTR_TEST_BYTES);
+        ok = memcmp(buf, reference, CTR_TEST_BYTES) == 0;
+
+        aes_ctr_init(&stream, &ctx, wrap_iv);
+        for (offset = 0, k = 0; offset < CTR_TEST_BYTES; k++) {
+            size_t n = pieces[k % (sizeof pieces / sizeof pieces[0])];
+            if (n > CTR_TEST_BYTES - offset) n = CTR_TEST_BYTES - offset;
+            aes_ctr_update(&stream, message + offset, buf + offset, n);
+            offset += n;
+        }
+        ok = ok && memcmp(buf, reference, CTR_TEST_BYTES) == 0;
+
+        for (offset = 0; offset < CTR_TEST_BYTES; offset += 77) {
+            aes_ctr_seek(&stream, offset);
+            aes_ctr_update(&stream, message + offset, buf, CTR_TEST_BYTES - offset);
+            ok = ok && memcmp(buf, reference + offset, CTR_TEST_BYTES - offset) == 0;
+        }
+        printf("%-8s %-18s %s\n", aes_backend_names[backend], "CTR stream/seek", ok ? "OK" : "FAILED");
+        if (!ok) failures++;
+    }
+    aes_wipe(&ctx);
+    aes_backend = best;
+    return failures;
+}
+
+static size_t hex_len(const char *hex) {
+    return strlen(hex) / 2;
+}
+
+static void parse_hex(uint8_t *out, const char *hex) {
+    for (size_t i = 0; i < hex_len(hex); i++) {
+        unsigned int byte;
+        sscanf(hex + 2 * i, "%2x", &byte);
+        out[i] = (uint8_t)byte;
+    }
+}
+
+/*
+GCM tests on every AES backend, with and without PCLMULQDQ: test cases 1-18
+(AES-128, AES-192 and AES-256) from the original GCM specification, which
+cover empty messages, AAD, and 64-bit and 480-bit IVs. Then messages of
+every length up to GCM_TEST_BYTES are sealed on each path and must match
+the portable T-table result, open again, and be rejected once a bit is
+flipped (a tag bit for the empty message). Returns the number of failures.
+*/
+#define GCM_TEST_BYTES 300
+
+static int aes_gcm_tests(void) {
+    static const char *K1 = "feffe9928665731c6d6a8f9467308308";
+    static const char *K1_192 = "feffe9928665731c6d6a8f9467308308feffe9928665731c";
+    static const char *K1_256 = "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308";
+    static const char *P = "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+                           "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255";
+    static const char *P60 = "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+                             "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39";
+    static const char *A = "feedfacedeadbeeffeedfacedeadbeefabaddad2";
+    static const char *IV = "cafebabefacedbaddecaf888";
+    static const char *IV8 = "cafebabefacedbad";
+    static const char *IV60 = "9313225df88406e555909c5aff5269aa6a7a9538534f7da1e4c303d2a318a728"
+                              "c3c0c95156809539fcf0e2429a6b525416aedbf5a0de6a57a637b39b";
+    static const char *Z128 = "00000000000000000000000000000000";
+    static const char *Z192 = "000000000000000000000000000000000000000000000000";
+    static const char *Z256 = "0000000000000000000000000000000000000000000000000000000000000000";
+    static const char *Z96 = "000000000000000000000000";
+    const struct {
+        const char *name, *key, *iv, *aad, *plaintext, *ciphertext, *tag;
+    } kats[] = {
+        { "GCM test case 1", Z128, Z96, "", "", "", "58e2fccefa7e3061367f1d57a4e7455a" },
+        { "GCM test case 2", Z128, Z96, "", Z128, "0388dace60b6a392f328c2b971b2fe78",
+          "ab6e47d42cec13bdf53a67b21257bddf" },
+        { "GCM test case 3", K1, IV, "", P,
+          "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+          "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985",
+          "4d5c2af327cd64a62cf35abd2ba6fab4" },
+        { "GCM test case 4", K1, IV, A, P60,
+          "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+          "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+          "5bc94fbc3221a5db94fae95ae7121a47" },
+        { "GCM test case 5", K1, IV8, A, P60,
+          "61353b4c2806934a777ff51fa22a4755699b2a714fcdc6f83766e5f97b6c7423"
+          "73806900e49f24b22b097544d4896b424989b5e1ebac0f07c23f4598",
+          "3612d2e79e3b0785561be14aaca2fccb" },
+        { "GCM test case 6", K1, IV60, A, P60,
+          "8ce24998625615b603a033aca13fb894be9112a5c3a211a8ba262a3cca7e2ca7"
+          "01e4a9a4fba43c90ccdcb281d48c7c6fd62875d2aca417034c34aee5",
+          "619cc5aefffe0bfa462af43c1699d050" },
+        { "GCM test case 7", Z192, Z96, "", "", "", "cd33b28ac773f74ba00ed1f312572435" },
+        { "GCM test case 8", Z192, Z96, "", Z128, "98e7247c07f0fe411c267e4384b0f600",
+          "2ff58d80033927ab8ef4d4587514f0fb" },
+        { "GCM test case 9", K1_192, IV, "", P,
+          "3980ca0b3c00e841eb06fac4872a2757859e1ceaa6efd984628593b40ca1e19c"
+          "7d773d00c144c525ac619d18c84a3f4718e2448b2fe324d9ccda2710acade256",
+          "9924a7c8587336bfb118024db8674a14" },
+        { "GCM test case 10", K1_192, IV, A, P60,
+          "3980ca0b3c00e841eb06fac4872a2757859e1ceaa6efd984628593b40ca1e19c"
+          "7d773d00c144c525ac619d18c84a3f4718e2448b2fe324d9ccda2710",
+          "2519498e80f1478f37ba55bd6d27618c" },
+        { "GCM test case 11", K1_192, IV8, A, P60,
+          "0f10f599ae14a154ed24b36e25324db8c566632ef2bbb34f8347280fc4507057"
+          "fddc29df9a471f75c66541d4d4dad1c9e93a19a58e8b473fa0f062f7",
+          "65dcc57fcf623a24094fcca40d3533f8" },
+        { "GCM test case 12", K1_192, IV60, A, P60,
+          "d27e88681ce3243c4830165a8fdcf9ff1de9a1d8e6b447ef6ef7b79828666e45"
+          "81e79012af34ddd9e2f037589b292db3e67c036745fa22e7e9b7373b",
+          "dcf566ff291c25bbb8568fc3d376a6d9" },
+        { "GCM test case 13", Z256, Z96, "", "", "", "530f8afbc74536b9a963b4f1c4cb738b" },
+        { "GCM test case 14", Z256, Z96, "", Z128, "cea7403d4d606b6e074ec5d3baf39d18",
+          "d0d1c8a799996bf0265b98b5d48ab919" },
+        { "GCM test case 15", K1_256, IV, "", P,
+          "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+          "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662898015ad",
+          "b094dac5d93471bdec1a502270e3cc6c" },
+        { "GCM test case 16", K1_256, IV, A, P60,
+          "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+          "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+          "76fc6ece0f4e1768cddf8853bb2d551b" },
+        { "GCM test case 17", K1_256, IV8, A, P60,
+          "c3762df1ca787d32ae47c13bf19844cbaf1ae14d0b976afac52ff7d79bba9de0"
+          "feb582d33934a4f0954cc2363bc73f7862ac430e64abe499f47c9b1f",
+          "3a337dbf46a792c45e454913fe2ea8f2" },
+        { "GCM test case 18", K1_256, IV60, A, P60,
+          "5a8def2f0c9e53f1f75d7853659e2a20eeb2b22aafde6419a058ab4f6f746bf4"
+          "0fc0c3b780f244452da3ebf1c5d82cdea2418997200ef82e44ae7e3f",
+          "a44a8266ee1c8eb0c8b5d4cf5ae9f19a" },
+    };
+    static uint8_t message[GCM_TEST_BYTES], reference[GCM_TEST_BYTES][GCM_TEST_BYTES + 16];
+    uint8_t key[32], iv[60], aad[20], plaintext[64], ciphertext[64], tag[16], buf[GCM_TEST_BYTES];
+    int best = aes_best_backend();
+    int clmul = gcm_clmul_available();
+    int failures = 0;
+    aes_gcm_ctx ctx;
+
+    for (size_t i = 0; i < GCM_TEST_BYTES; i++) message[i] = (uint8_t)(i * 7 + 1);
+    memset(key, 0x42, sizeof key);
+    memset(iv, 0x24, 12);
+
+    for (int backend = AES_TTABLE; backend <= best; backend++) {
+        for (int use_clmul = 0; use_clmul <= clmul; use_clmul++) {
+            int kats_ok = 1, paths_ok = 1;
+            size_t k, len;
+
+            aes_backend = backend;
+            gcm_clmul = use_clmul;
+            for (k = 0; k < sizeof kats / sizeof kats[0]; k++) {
+                size_t n = hex_len(kats[k].plaintext);
+                uint8_t expected[64], expected_tag[16];
+
+                parse_hex(key, kats[k].key);
+                parse_hex(iv, kats[k].iv);
+                parse_hex(aad, kats[k].aad);
+                parse_hex(plaintext, kats[k].plaintext);
+                parse_hex(expected, kats[k].ciphertext);
+                parse_hex(expected_tag, kats[k].tag);
+
+                aes_gcm_init(&ctx, key, hex_len(kats[k].key));
+                aes_gcm_seal(&ctx, ciphertext, tag, plaintext, n, aad, hex_len(kats[k].aad),
+                             iv, hex_len(kats[k].iv));
+                int ok = memcmp(ciphertext, expected, n) == 0 && memcmp(tag, expected_tag, 16) == 0;
+                ok = ok && aes_gcm_open(&ctx, ciphertext, ciphertext, n, tag, aad, hex_len(kats[k].aad),
+                                        iv, hex_len(kats[k].iv)) == 0 &&
+                     memcmp(ciphertext, plaintext, n) == 0;
+                if (!ok) {
+                    printf("%-8s %s %s FAILED\n", aes_backend_names[backend],
+                           use_clmul ? "PCLMULQDQ" : "portable ", kats[k].name);
+                    kats_ok = 0;
+                }
+            }
+
+            memset(key, 0x42, sizeof key);
+            memset(iv, 0x24, 12);
+            aes_gcm_init(&ctx, key, 32);
+            for (len = 0; len < GCM_TEST_BYTES; len++) {
+                uint8_t *sealed = reference[len];
+                uint8_t out[GCM_TEST_BYTES + 16];
+
+                aes_gcm_seal(&ctx, out, out + len, message, len, message, len % 37, iv, 12);
+                if (backend == AES_TTABLE && !use_clmul) memcpy(sealed, out, len + 16);
+                else paths_ok &= memcmp(sealed, out, len + 16) == 0;
+
+                paths_ok &= aes_gcm_open(&ctx, buf, out, len, out + len, message, len % 37, iv, 12) == 0 &&
+                            memcmp(buf, message, len) == 0;
+                out[len / 2] ^= 1;
+                paths_ok &= aes_gcm_open(&ctx, buf, out, len, out + len, message, len % 37, iv, 12) == -1;
+            }
+
+            printf("%-8s %-9s GCM test cases %s, lengths 0..%d %s\n", aes_backend_names[backend],
+                   use_clmul ? "PCLMULQDQ" : "portable", kats_ok ? "OK" : "FAILED",
+                   GCM_TEST_BYTES - 1, paths_ok ? "OK" : "FAILED");
+            failures += !kats_ok + !paths_ok;
+        }
+    }
+    aes_wipe(&ctx.cipher);
+    aes_backend = best;
+    gcm_clmul = clmul;
+    return failures;
+}
+
+/*
+CBC and XTS tests on every backend. The vectors are SP 800-38A F.2.1 and
+F.2.5 (CBC-AES128 / CBC-AES256) and IEEE 1619 XTS-AES vectors 2 and 10 (the
+first two blocks of vector 10). CBC is then decrypted in place in two
+uneven pieces, and XTS sectors of every length from 16 to XTS_TEST_BYTES
+(ciphertext stealing included) must match the T-table result and decrypt
+in place again. A run of sectors must match sector-by-sector calls.
+Returns the number of failures.
+*/
+#define XTS_TEST_BYTES 300
+
+static int aes_cbc_xts_tests(void) {
+    static const char *P = "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+                           "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+    static const char *IV = "000102030405060708090a0b0c0d0e0f";
+    const struct {
+        const char *name, *key, *plaintext, *ciphertext;
+        uint64_t sector;            // XTS only; CBC uses IV
+        int xts;
+    } kats[] = {
+        { "SP 800-38A F.2.1", "2b7e151628aed2a6abf7158809cf4f3c", P,
+          "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2"
+          "73bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7", 0, 0 },
+        { "SP 800-38A F.2.5", "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4", P,
+          "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d"
+          "39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b", 0, 0 },
+        { "IEEE 1619 vector 2", "1111111111111111111111111111111122222222222222222222222222222222",
+          "4444444444444444444444444444444444444444444444444444444444444444",
+          "c454185e6a16936e39334038acef838bfb186fff7480adc4289382ecd6d394f0", 0x3333333333, 1 },
+        { "IEEE 1619 vector 10",
+          "2718281828459045235360287471352662497757247093699959574966967627"
+          "3141592653589793238462643383279502884197169399375105820974944592",
+          "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f",
+          "1c3b3a102f770386e4836c99e370cf9bea00803f5e482357a4ae12d414a3e63b", 0xff, 1 },
+    };
+    static uint8_t message[XTS_TEST_BYTES], reference[XTS_TEST_BYTES + 1][XTS_TEST_BYTES];
+    uint8_t key[64], iv[16], plaintext[64], expected[64], buf[XTS_TEST_BYTES], run[4 * XTS_TEST_BYTES];
+    size_t cbc_blocks = XTS_TEST_BYTES / 16;
+    int best = aes_best_backend();
+    int failures = 0;
+    aes_xts_ctx xts;
+    aes_ctx cbc;
+
+    for (size_t i = 0; i < XTS_TEST_BYTES; i++) message[i] = (uint8_t)(i * 5 + 3);
+
+    for (int backend = AES_TTABLE; backend <= best; backend++) {
+        int kats_ok = 1, paths_ok = 1;
+        size_t k, len;
+
+        aes_backend = backend;
+        for (k = 0; k < sizeof kats / sizeof kats[0]; k++) {
+            size_t n = hex_len(kats[k].plaintext);
+            int ok;
+
+            parse_hex(key, kats[k].key);
+            parse_hex(plaintext, kats[k].plaintext);
+            parse_hex(expected, kats[k].ciphertext);
+            if (kats[k].xts) {
+                aes_xts_init(&xts, key, hex_len(kats[k].key));
+                aes_xts_encrypt_sector(&xts, kats[k].sector, plaintext, buf, n);
+                ok = memcmp(buf, expected, n) == 0;
+                aes_xts_decrypt_sector(&xts, kats[k].sector, buf, buf, n);
+            } else {
+                aes_init(&cbc, key, hex_len(kats[k].key));
+                parse_hex(iv, IV);
+                aes_cbc_encrypt_blocks(&cbc, iv, plaintext, buf, n / 16);
+                ok = memcmp(buf, expected, n) == 0;
+                parse_hex(iv, IV);
+                aes_cbc_decrypt_blocks(&cbc, iv, buf, buf, n / 16);
+            }
+            ok = ok && memcmp(buf, plaintext, n) == 0;
+            if (!ok) {
+                printf("%-8s %s FAILED\n", aes_backend_names[backend], kats[k].name);
+                kats_ok = 0;
+            }
+        }
+
+        // CBC in place, decrypted as 5 blocks and then the rest
+        memset(key, 0x42, sizeof key);
+        memset(iv, 0x24, sizeof iv);
+        aes_init(&cbc, key, 16);
+        aes_cbc_encrypt_blocks(&cbc, iv, message, buf, cbc_blocks);
+        if (backend == AES_TTABLE) memcpy(reference[XTS_TEST_BYTES], buf, 16 * cbc_blocks);
+        else paths_ok &= memcmp(reference[XTS_TEST_BYTES], buf, 16 * cbc_blocks) == 0;
+        memset(iv, 0x24, sizeof iv);
+        aes_cbc_decrypt_blocks(&cbc, iv, buf, buf, 5);
+        aes_cbc_decrypt_blocks(&cbc, iv, buf + 80, buf + 80, cbc_blocks - 5);
+        paths_ok &= memcmp(buf, message, 16 * cbc_blocks) == 0;
+
+        key[0] ^= 1;
+        aes_xts_init(&xts, key, 64);
+        for (len = 16; len < XTS_TEST_BYTES; len++) {
+            aes_xts_encrypt_sector(&xts, len, message, buf, len);
+            if (backend == AES_TTABLE) memcpy(reference[len], buf, len);
+            else paths_ok &= memcmp(reference[len], buf, len) == 0;
+            aes_xts_decrypt_sector(&xts, len, buf, buf, len);
+            paths_ok &= memcmp(buf, message, len) == 0;
+        }
+
+        // Sectors 100..103 of 100 bytes each: the same as one call per sector
+        memcpy(run, message, XTS_TEST_BYTES);
+        memcpy(run + XTS_TEST_BYTES, message, 100);
+        aes_xts_encrypt_sectors(&xts, 100, 100, run, run, 4);
+        for (k = 0; k < 4; k++) {
+            aes_xts_encrypt_sector(&xts, 100 + k, message + 100 * (k % 3), buf, 100);
+            paths_ok &= memcmp(run + 100 * k, buf, 100) == 0;
+        }
+        aes_xts_decrypt_sectors(&xts, 100, 100, run, run, 4);
+        paths_ok &= memcmp(run, message, XTS_TEST_BYTES) == 0 && memcmp(run + XTS_TEST_BYTES, message, 100) == 0;
+        paths_ok &= aes_xts_encrypt_sector(&xts, 0, message, buf, 15) == -1;
+
+        printf("%-8s CBC/XTS vectors %s, in-place CBC and XTS lengths 16..%d %s\n", aes_backend_names[backend],
+               kats_ok ? "OK" : "FAILED", XTS_TEST_BYTES - 1, paths_ok ? "OK" : "FAILED");
+        failures += !kats_ok + !paths_ok;
+    }
+    memset(key, 0x42, 32);
+    if (aes_xts_init(&xts, key, 32) != -1) {
+        printf("XTS with equal key halves accepted\n");
+        failures++;
+    }
+    aes_wipe(&cbc);
+    aes_wipe(&xts.data);
+    aes_wipe(&xts.tweak);
+    aes_backend = best;
+    return failures;
+}
+
+/*
+Key cache test on a cache of a single set, fed more keys of all three sizes
+than it has ways. Every context it returns must seal like a freshly expanded
+one. Handle 1 is looked up between insertions, so LRU must keep it while the
+other early handles are evicted. Evicting a handle must make it miss.
+Returns the number of failures.
+*/
+#define KEY_CACHE_TEST_KEYS 20
+
+static int aes_key_cache_tests(void) {
+    static const uint8_t iv[12] = { 0 };
+    uint8_t keys[KEY_CACHE_TEST_KEYS][32], message[40], out[40], tag[16], expected[40], expected_tag[16];
+    aes_key_cache cache;
+    aes_gcm_ctx fresh;
+    int ok = 1;
+
+    if (aes_key_cache_init(&cache, AES_KEY_CACHE_WAYS / 2) != 0) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < sizeof message; i++) message[i] = (uint8_t)(i * 3 + 1);
+    for (int i = 0; i < KEY_CACHE_TEST_KEYS; i++) {
+        for (int j = 0; j < 32; j++) keys[i][j] = (uint8_t)(i * 37 + j * 11 + 3);
+    }
+
+    for (int i = 0; i < KEY_CACHE_TEST_KEYS; i++) {
+        size_t key_len = 16 + 8 * (i % 3);
+        const aes_gcm_ctx *ctx = aes_key_cache_get(&cache, (uint64_t)i + 1, keys[i], key_len);
+
+        aes_gcm_init(&fresh, keys[i], key_len);
+        aes_gcm_seal(&fresh, expected, expected_tag, message, sizeof message, NULL, 0, iv, 12);
+        aes_gcm_seal(ctx, out, tag, message, sizeof message, NULL, 0, iv, 12);
+        ok = ok && memcmp(out, expected, sizeof out) == 0 && memcmp(tag, expected_tag, 16) == 0;
+
+        uint64_t misses = cache.misses;
+        aes_key_cache_get(&cache, 1, keys[0], 16);
+        ok = ok && cache.misses == misses;
+    }
+
+    uint64_t misses = cache.misses;
+    aes_key_cache_get(&cache, 2, keys[1], 24);
+    ok = ok && cache.misses == misses + 1;
+    aes_key_cache_evict(&cache, 1);
+    aes_key_cache_get(&cache, 1, keys[0], 16);
+    ok = ok && cache.misses == misses + 2;
+    ok = ok && aes_key_cache_get(&cache, 0, keys[0], 16) == NULL;
+    ok = ok && aes_key_cache_get(&cache, 99, keys[0], 20) == NULL;
+
+    printf("Key cache (LRU, %d ways)  %s\n", AES_KEY_CACHE_WAYS, ok ? "OK" : "FAILED");
+    aes_wipe(&fresh.cipher);
+    aes_key_cache_free(&cache);
+    return !ok;
+}
+
+/*
+Bulk benchmark: every backend runs ECB encryption, ECB decryption, CTR and
+GCM seal / open over the same BULK_BYTES buffer; the output is compared with
+the T-table path and the cycles per byte are reported as min / avg / max.
+GCM uses PCLMULQDQ where the CPU has it; the "/sw" rows run GHASH without
+it, as on hosts that hide PCLMULQDQ along with AES-NI.
+*/
+#define BULK_BYTES (64 << 10)
+#define BULK_TRIALS 200
+
+enum {
+    BULK_ECB_ENCRYPT, BULK_ECB_DECRYPT, BULK_CTR, BULK_GCM_SEAL, BULK_GCM_OPEN, BULK_GCM_SEAL_SW, BULK_GCM_OPEN_SW,
+    BULK_MODES
+};
+static const char *bulk_mode_names[] = {
+    "ECB encrypt", "ECB decrypt", "CTR", "GCM seal", "GCM open", "GCM seal/sw", "GCM open/sw"
+};
+
+static void bulk_run(int mode, const aes_gcm_ctx *gcm, const aes_gcm_ctx *gcm_sw, const uint8_t *in, uint8_t *out) {
+    static const uint8_t iv[16] = { 0 };
+    switch (mode) {
+    case BULK_ECB_ENCRYPT: aes_encrypt_blocks(&gcm->cipher, in, out, BULK_BYTES / 16); break;
+    case BULK_ECB_DECRYPT: aes_decrypt_blocks(&gcm->cipher, in, out, BULK_BYTES / 16); break;
+    case BULK_CTR: aes_ctr_encrypt(&gcm->cipher, iv, in, out, BULK_BYTES); break;
+    case BULK_GCM_SEAL: aes_gcm_seal(gcm, out, out + BULK_BYTES, in, BULK_BYTES, NULL, 0, iv, 12); break;
+    case BULK_GCM_OPEN: aes_gcm_open(gcm, out, in, BULK_BYTES, in + BULK_BYTES, NULL, 0, iv, 12); break;
+    case BULK_GCM_SEAL_SW: aes_gcm_seal(gcm_sw, out, out + BULK_BYTES, in, BULK_BYTES, NULL, 0, iv, 12); break;
+    case BULK_GCM_OPEN_SW: aes_gcm_open(gcm_sw, out, in, BULK_BYTES, in + BULK_BYTES, NULL, 0, iv, 12); break;
+    }
+}
+
+static void benchmark_bulk(const uint8_t key[16]) {
+    uint8_t *plaintext = malloc(BULK_BYTES + 16);
+    uint8_t *buf = malloc(BULK_BYTES + 16);
+    uint8_t *reference[BULK_MODES];     // each mode's expected output
+    const uint8_t *input[BULK_MODES];
+    int mode;
+
+    for (mode = 0; mode < BULK_MODES; mode++) {
+        reference[mode] = malloc(BULK_BYTES + 16);
+        if (!reference[mode]) plaintext = NULL;
+    }
+    if (!plaintext || !buf) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < BULK_BYTES + 16; i++) plaintext[i] = (uint8_t)(i * 131 + 7);
+
+    int best = aes_best_backend();
+    int clmul = gcm_clmul_available();
+    aes_gcm_ctx ctx, ctx_sw;
+    aes_backend = AES_TTABLE;
+    aes_gcm_init(&ctx, key, 16);
+    bulk_run(BULK_ECB_ENCRYPT, &ctx, &ctx, plaintext, reference[BULK_ECB_ENCRYPT]);
+    bulk_run(BULK_CTR, &ctx, &ctx, plaintext, reference[BULK_CTR]);
+    bulk_run(BULK_GCM_SEAL, &ctx, &ctx, plaintext, reference[BULK_GCM_SEAL]);
+    memcpy(reference[BULK_GCM_SEAL_SW], reference[BULK_GCM_SEAL], BULK_BYTES + 16);
+    memcpy(reference[BULK_ECB_DECRYPT], plaintext, BULK_BYTES);
+    memcpy(reference[BULK_GCM_OPEN], plaintext, BULK_BYTES);
+    memcpy(reference[BULK_GCM_OPEN_SW], plaintext, BULK_BYTES);
+    input[BULK_ECB_ENCRYPT] = input[BULK_CTR] = input[BULK_GCM_SEAL] = input[BULK_GCM_SEAL_SW] = plaintext;
+    input[BULK_ECB_DECRYPT] = reference[BULK_ECB_ENCRYPT];
+    input[BULK_GCM_OPEN] = input[BULK_GCM_OPEN_SW] = reference[BULK_GCM_SEAL];
+
+    printf("\nAES-128 on %d KiB buffers, %d trials:\n", BULK_BYTES >> 10, BULK_TRIALS);
+    for (int backend = AES_TTABLE; backend <= best; backend++) {
+        aes_backend = backend;
+        gcm_clmul = clmul;
+        aes_gcm_init(&ctx, key, 16);
+        gcm_clmul = 0;
+        aes_gcm_init(&ctx_sw, key, 16);
+
+        for (mode = 0; mode < BULK_MODES; mode++) {
+            unsigned long long min_cycles = ULLONG_MAX, max_cycles = 0, total_cycles = 0;
+            for (int i = 0; i < BULK_TRIALS; i++) {
+                unsigned long long start = __rdtsc();
+                bulk_run(mode, &ctx, &ctx_sw, input[mode], buf);
+                unsigned long long cycles = __rdtsc() - start;
+                if (cycles < min_cycles) min_cycles = cycles;
+                if (cycles > max_cycles) max_cycles = cycles;
+                total_cycles += cycles;
+            }
+            size_t check = mode == BULK_GCM_SEAL || mode == BULK_GCM_SEAL_SW ? BULK_BYTES + 16 : BULK_BYTES;
+            int ok = memcmp(buf, reference[mode], check) == 0;
+            printf("%-8s %-12s %s  cycles/byte: min %.2f  avg %.2f  max %.2f\n",
+                   aes_backend_names[backend], bulk_mode_names[mode],
+                   ok ? "output OK      " : "output MISMATCH",
+                   (double)min_cycles / BULK_BYTES, (double)total_cycles / BULK_TRIALS / BULK_BYTES,
+                   (double)max_cycles / BULK_BYTES);
+        }
+    }
+    aes_wipe(&ctx.cipher);
+    aes_wipe(&ctx_sw.cipher);
+    aes_backend = best;
+    gcm_clmul = clmul;
+    free(plaintext);
+    free(buf);
+    for (mode = 0; mode < BULK_MODES; mode++) free(reference[mode]);
+}
+
+/*
+Sector benchmark: CBC and XTS-AES-128 over a SECTOR_BENCH_BYTES volume cut
+into 512-byte and 4 KiB sectors, as block-device encryption would see it.
+CBC restarts from a per-sector IV (the sector number), and XTS from the
+sector's tweak. Cycles per byte, min / avg over SECTOR_BENCH_TRIALS passes.
+*/
+#define SECTOR_BENCH_BYTES (1 << 20)
+#define SECTOR_BENCH_TRIALS 20
+
+enum { SECTOR_CBC_ENCRYPT, SECTOR_CBC_DECRYPT, SECTOR_XTS_ENCRYPT, SECTOR_XTS_DECRYPT, SECTOR_MODES };
+static const char *sector_mode_names[] = { "CBC encrypt", "CBC decrypt", "XTS encrypt", "XTS decrypt" };
+
+static void sector_run(int mode, const aes_ctx *cbc, const aes_xts_ctx *xts, size_t sector_size, uint8_t *volume) {
+    size_t nsectors = SECTOR_BENCH_BYTES / sector_size;
+
+    if (mode == SECTOR_XTS_ENCRYPT) {
+        aes_xts_encrypt_sectors(xts, 0, sector_size, volume, volume, nsectors);
+        return;
+    }
+    if (mode == SECTOR_XTS_DECRYPT) {
+        aes_xts_decrypt_sectors(xts, 0, sector_size, volume, volume, nsectors);
+        return;
+    }
+    for (size_t s = 0; s < nsectors; s++) {
+        uint8_t iv[16] = {0}, *sector = volume + s * sector_size;
+        memcpy(iv, &s, sizeof s);
+        if (mode == SECTOR_CBC_ENCRYPT) aes_cbc_encrypt_blocks(cbc, iv, sector, sector, sector_size / 16);
+        else aes_cbc_decrypt_blocks(cbc, iv, sector, sector, sector_size / 16);
+    }
+}
+
+static void benchmark_sectors(void) {
+    static const size_t sector_sizes[] = { 512, 4096 };
+    uint8_t *volume = malloc(SECTOR_BENCH_BYTES);
+    uint8_t key[32];
+    int best = aes_best_backend();
+    aes_xts_ctx xts;
+    aes_ctx cbc;
+
+    if (!volume) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < SECTOR_BENCH_BYTES; i++) volume[i] = (uint8_t)(i * 131 + 7);
+    for (int i = 0; i < 32; i++) key[i] = (uint8_t)(i * 7 + 1);
+
+    printf("\nCBC and XTS-AES-128 on a %d MiB volume, %d trials:\n", SECTOR_BENCH_BYTES >> 20, SECTOR_BENCH_TRIALS);
+    for (int backend = AES_TTABLE; backend <= best; backend++) {
+        aes_backend = backend;
+        aes_init(&cbc, key, 16);
+        aes_xts_init(&xts, key, 32);
+
+        for (size_t z = 0; z < sizeof sector_sizes / sizeof sector_sizes[0]; z++) {
+            for (int mode = 0; mode < SECTOR_MODES; mode++) {
+                unsigned long long min_cycles = ULLONG_MAX, total_cycles = 0;
+                for (int i = 0; i < SECTOR_BENCH_TRIALS; i++) {
+                    unsigned long long start = __rdtsc();
+                    sector_run(mode, &cbc, &xts, sector_sizes[z], volume);
+                    unsigned long long cycles = __rdtsc() - start;
+                    if (cycles < min_cycles) min_cycles = cycles;
+                    total_cycles += cycles;
+                }
+                printf("%-8s %-12s %4zu-byte sectors  cycles/byte: min %.2f  avg %.2f\n",
+                       aes_backend_names[backend], sector_mode_names[mode], sector_sizes[z],
+                       (double)min_cycles / SECTOR_BENCH_BYTES,
+                       (double)total_cycles / SECTOR_BENCH_TRIALS / SECTOR_BENCH_BYTES);
+            }
+        }
+    }
+    aes_wipe(&cbc);
+    aes_wipe(&xts.data);
+    aes_wipe(&xts.tweak);
+    aes_backend = best;
+    free(volume);
+}
+
+/*
+Key agility: the cost of the first message after switching to another key.
+KEY_AGILITY_KEYS keys take turns sealing a KEY_AGILITY_MESSAGE-byte GCM
+message, for each key size on every backend. The columns are:
+  expand     aes_gcm_init alone: round keys both ways plus H
+  re-expand  aes_gcm_init then the seal, as without a cache
+  cached     aes_key_cache_get then the seal, with every key resident
+  same key   the seal alone on one key, which is the floor
+Each column is cycles per message, the minimum over KEY_AGILITY_TRIALS
+passes.
+*/
+#define KEY_AGILITY_KEYS 256
+#define KEY_AGILITY_MESSAGE 64
+#define KEY_AGILITY_TRIALS 50
+
+enum { AGILITY_EXPAND, AGILITY_REEXPAND, AGILITY_CACHED, AGILITY_SAME_KEY, AGILITY_CASES };
+
+static void benchmark_key_agility(void) {
+    static uint8_t keys[KEY_AGILITY_KEYS][32];
+    static const uint8_t iv[12] = { 0 };
+    uint8_t message[KEY_AGILITY_MESSAGE], out[KEY_AGILITY_MESSAGE], tag[16];
+    int best = aes_best_backend();
+    aes_gcm_ctx ctx;
+
+    for (int i = 0; i < KEY_AGILITY_KEYS; i++) {
+        for (int j = 0; j < 32; j++) keys[i][j] = (uint8_t)(i * 131 + j * 17 + 5);
+    }
+    memset(message, 0x5a, sizeof message);
+
+    printf("\nKey agility, %d keys in turn, %d-byte GCM messages, cycles/message (min of %d):\n",
+           KEY_AGILITY_KEYS, KEY_AGILITY_MESSAGE, KEY_AGILITY_TRIALS);
+    for (int backend = AES_TTABLE; backend <= best; backend++) {
+        aes_backend = backend;
+        for (size_t key_len = 16; key_len <= 32; key_len += 8) {
+            double cycles[AGILITY_CASES];
+            aes_key_cache cache;
+
+            if (aes_key_cache_init(&cache, KEY_AGILITY_KEYS) != 0) {
+                perror("malloc");
+                exit(1);
+            }
+            for (int i = 0; i < KEY_AGILITY_KEYS; i++) aes_key_cache_get(&cache, (uint64_t)i + 1, keys[i], key_len);
+            cache.hits = cache.misses = 0;
+            aes_gcm_init(&ctx, keys[0], key_len);
+
+            for (int c = 0; c < AGILITY_CASES; c++) {
+                unsigned long long min_cycles = ULLONG_MAX;
+                for (int t = 0; t < KEY_AGILITY_TRIALS; t++) {
+                    unsigned long long start = __rdtsc();
+                    for (int i = 0; i < KEY_AGILITY_KEYS; i++) {
+                        const aes_gcm_ctx *key = &ctx;
+                        switch (c) {
+                        case AGILITY_EXPAND:
+                            aes_gcm_init(&ctx, keys[i], key_len);
+                            continue;
+                        case AGILITY_REEXPAND:
+                            aes_gcm_init(&ctx, keys[i], key_len);
+                            break;
+                        case AGILITY_CACHED:
+                            key = aes_key_cache_get(&cache, (uint64_t)i + 1, keys[i], key_len);
+                            break;
+                        }
+                        aes_gcm_seal(key, out, tag, message, sizeof message, NULL, 0, iv, 12);
+                    }
+                    unsigned long long elapsed = __rdtsc() - start;
+                    if (elapsed < min_cycles) min_cycles = elapsed;
+                }
+                cycles[c] = (double)min_cycles / KEY_AGILITY_KEYS;
+            }
+            printf("%-8s AES-%zu  expand %6.0f  re-expand %6.0f  cached %6.0f  same key %6.0f  (cache hits %.1f%%)\n",
+                   aes_backend_names[backend], key_len * 8, cycles[AGILITY_EXPAND], cycles[AGILITY_REEXPAND],
+                   cycles[AGILITY_CACHED], cycles[AGILITY_SAME_KEY],
+                   100.0 * (double)cache.hits / (double)(cache.hits + cache.misses));
+            aes_key_cache_free(&cache);
+        }
+    }
+    aes_wipe(&ctx.cipher);
+    aes_backend = best;
+}
+
+int main(void) {
+    // The single-block and ECB round trips from aes.py's __main__
+    uint8_t key[16] = {
+    0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+    };
+    uint8_t msg[] = "Hello World!";
+    uint8_t ciphertext[32], decrypted[32];
+    aes_ctx ctx;
+
+    aes_init(&ctx, key, 16);
+    printf("Backend: %s\n", aes_backend_names[ctx.backend]);
+
+    size_t ct_len = aes_ecb_encrypt(&ctx, msg, sizeof msg - 1, ciphertext);
+    long pt_len = aes_ecb_decrypt(&ctx, ciphertext, ct_len, decrypted);
+    print_hex("ECB ciphertext: ", ciphertext, ct_len);
+    printf("ECB round-trip OK: %s (%.*s)\n\n",
+           pt_len == (long)(sizeof msg - 1) && memcmp(decrypted, msg, sizeof msg - 1) == 0 ? "True" : "False",
+           pt_len > 0 ? (int)pt_len : 0, decrypted);
+    aes_wipe(&ctx);
+
+    int failures = aes_kats();
+    failures += aes_ctr_tests();
+    failures += aes_gcm_tests();
+    failures += aes_cbc_xts_tests();
+    failures += aes_key_cache_tests();
+    benchmark_bulk(key);
+    benchmark_sectors();
+    benchmark_key_agility();
+    return failures != 0;
+}
+
+#endif /* AES_NO_MAIN */
@@ -1,9 +1,26 @@
-# AES-128 from-scratch (ECB mode, hex I/O)
+# AES from-scratch (ECB mode, hex I/O), 128-, 192- and 256-bit keys
 # - Encrypt/decrypt a single 128-bit block
 # - ECB mode over many blocks with PKCS#7 padding
 # - Inputs/outputs are hex strings (case-insensitive, with or without "0x")
-
-from typing import List
+# - AESKey: the key expanded once, T-table rounds, bytes in / bytes out
+#   ECB, CBC and CTR for bulk data (python3 aes.py --bench compares speeds)
+# - libaes.so (aes.c built with -DAES_NO_MAIN) is used automatically when it
+#   is next to this file; the pure-Python code is the fallback
+# - The functions that take a raw key (encrypt_block, ecb_*, cbc_*, ctr_*)
+#   keep the last 64 keys and their schedules in memory until
+#   clear_key_caches(); Python cannot wipe bytes, so for bulk data or keys
+#   that must not linger hold a new_key(key) object instead. libaes.so
+#   schedules are wiped by aes_free once released, and at exit
+
+import atexit
+import ctypes
+import functools
+import os
+import struct
+import sys
+import threading
+import time
+from typing import List, Tuple
 
 # Rijndael S-box
 SBOX = [
@@ -30,7 +47,7 @@ INV_SBOX = [0]*256
 for i, v in enumerate(SBOX):
     INV_SBOX[v] = i
 
-# Round constants (Rcon) for AES-128 (10 rounds -> need 10 constants)
+# Round constants (Rcon); AES-128 uses all 10, AES-192 8 and AES-256 7
 RCON = [0x00,0x01,0x02,0x04,0x08,0x10,0x20,0x40,0x80,0x1B,0x36]
 
 # --------- finite field helpers ---------
@@ -53,6 +70,15 @@ def gf_mul(a: int, b: int) -> int:
         b >>= 1
     return res
 
+# --------- precomputed tables ---------
+# Products by the MixColumns / InvMixColumns coefficients, one lookup each
+MUL2 = [gf_mul(0x02, x) for x in range(256)]
+MUL3 = [gf_mul(0x03, x) for x in range(256)]
+MUL9 = [gf_mul(0x09, x) for x in range(256)]
+MUL11 = [gf_mul(0x0b, x) for x in range(256)]
+MUL13 = [gf_mul(0x0d, x) for x in range(256)]
+MUL14 = [gf_mul(0x0e, x) for x in range(256)]
+
 # --------- core transformations ---------
 def sub_bytes(state: List[int]) -> None:
     for i in range(16):
@@ -85,25 +111,25 @@ def mix_columns(state: List[int]) -> None:
     for c in range(4):
         i = 4*c
         a0, a1, a2, a3 = state[i:i+4]
-        state[i+0] = gf_mul(0x02,a0) ^ gf_mul(0x03,a1) ^ a2 ^ a3
-        state[i+1] = a0 ^ gf_mul(0x02,a1) ^ gf_mul(0x03,a2) ^ a3
-        state[i+2] = a0 ^ a1 ^ gf_mul(0x02,a2) ^ gf_mul(0x03,a3)
-        state[i+3] = gf_mul(0x03,a0) ^ a1 ^ a2 ^ gf_mul(0x02,a3)
+        state[i+0] = MUL2[a0] ^ MUL3[a1] ^ a2 ^ a3
+        state[i+1] = a0 ^ MUL2[a1] ^ MUL3[a2] ^ a3
+        state[i+2] = a0 ^ a1 ^ MUL2[a2] ^ MUL3[a3]
+        state[i+3] = MUL3[a0] ^ a1 ^ a2 ^ MUL2[a3]
 
 def inv_mix_columns(state: List[int]) -> None:
     for c in range(4):
         i = 4*c
         a0, a1, a2, a3 = state[i:i+4]
-        state[i+0] = gf_mul(0x0e,a0) ^ gf_mul(0x0b,a1) ^ gf_mul(0x0d,a2) ^ gf_mul(0x09,a3)
-        state[i+1] = gf_mul(0x09,a0) ^ gf_mul(0x0e,a1) ^ gf_mul(0x0b,a2) ^ gf_mul(0x0d,a3)
-        state[i+2] = gf_mul(0x0d,a0) ^ gf_mul(0x09,a1) ^ gf_mul(0x0e,a2) ^ gf_mul(0x0b,a3)
-        state[i+3] = gf_mul(0x0b,a0) ^ gf_mul(0x0d,a1) ^ gf_mul(0x09,a2) ^ gf_mul(0x0e,a3)
+        state[i+0] = MUL14[a0] ^ MUL11[a1] ^ MUL13[a2] ^ MUL9[a3]
+        state[i+1] = MUL9[a0] ^ MUL14[a1] ^ MUL11[a2] ^ MUL13[a3]
+        state[i+2] = MUL13[a0] ^ MUL9[a1] ^ MUL14[a2] ^ MUL11[a3]
+        state[i+3] = MUL11[a0] ^ MUL13[a1] ^ MUL9[a2] ^ MUL14[a3]
 
 def add_round_key(state: List[int], round_key: List[int]) -> None:
     for i in range(16):
         state[i] ^= round_key[i]
 
-# --------- key expansion (AES-128: 16-byte key -> 11 round keys) ---------
+# --------- key expansion (16/24/32-byte key -> 11/13/15 round keys) ---------
 def rot_word(word: List[int]) -> List[int]:
     return word[1:] + word[:1]
 
@@ -111,10 +137,10 @@ def sub_word(word: List[int]) -> List[int]:
     return [SBOX[b] for b in word]
 
 def key_expansion(key: bytes) -> List[List[int]]:
-    assert len(key) == 16
-    Nk = 4            # 32-bit words in key
-    Nb = 4            # columns in state
-    Nr = 10           # rounds
+    assert len(key) in (16, 24, 32)
+    Nk = len(key) // 4  # 32-bit words in key: 4, 6 or 8
+    Nb = 4              # columns in state
+    Nr = Nk + 6         # rounds: 10, 12 or 14
 
     w: List[List[int]] = []
     # first Nk words are the key itself
@@ -126,6 +152,9 @@ def key_expansion(key: bytes) -> List[List[int]]:
         if i % Nk == 0:
             temp = sub_word(rot_word(temp))
             temp[0] ^= RCON[i//Nk]
+        elif Nk > 6 and i % Nk == 4:
+            # AES-256 only: an extra SubWord halfway between
+            temp = sub_word(temp)
         # w[i] = w[i-Nk] XOR temp
         w.append([ (w[i-Nk][j] ^ temp[j]) & 0xFF for j in range(4) ])
 
@@ -136,16 +165,25 @@ def key_expansion(key: bytes) -> List[List[int]]:
         for c in range(4):
             rk.extend(w[4*r + c])
         round_keys.append(rk)
-    return round_keys  # 11 round keys
+    return round_keys  # Nr + 1 round keys
+
+@functools.lru_cache(maxsize=64)
+def _cached_round_keys(key: bytes) -> Tuple[Tuple[int, ...], ...]:
+    # encrypt_block / decrypt_block are called once per block with the same key.
+    # The key bytes and the schedule stay here until clear_key_caches()
+    return tuple(tuple(rk) for rk in key_expansion(key))
 
 # --------- block encryption / decryption ---------
 def encrypt_block(plain16: bytes, key: bytes) -> bytes:
-    assert len(plain16) == 16 and len(key) == 16
-    round_keys = key_expansion(key)
+    assert len(plain16) == 16
+    if _native is not None:
+        return _aes_key(bytes(key)).encrypt_block(plain16)
+    round_keys = _cached_round_keys(bytes(key))
+    Nr = len(round_keys) - 1
     state = list(plain16)
 
     add_round_key(state, round_keys[0])
-    for rnd in range(1, 10):
+    for rnd in range(1, Nr):
         sub_bytes(state)
         shift_rows(state)
         mix_columns(state)
@@ -153,19 +191,22 @@ def encrypt_block(plain16: bytes, key: bytes) -> bytes:
     # final round
     sub_bytes(state)
     shift_rows(state)
-    add_round_key(state, round_keys[10])
+    add_round_key(state, round_keys[Nr])
 
     return bytes(state)
 
 def decrypt_block(cipher16: bytes, key: bytes) -> bytes:
-    assert len(cipher16) == 16 and len(key) == 16
-    round_keys = key_expansion(key)
+    assert len(cipher16) == 16
+    if _native is not None:
+        return _aes_key(bytes(key)).decrypt_block(cipher16)
+    round_keys = _cached_round_keys(bytes(key))
+    Nr = len(round_keys) - 1
     state = list(cipher16)
 
-    add_round_key(state, round_keys[10])
+    add_round_key(state, round_keys[Nr])
     inv_shift_rows(state)
     inv_sub_bytes(state)
-    for rnd in range(9, 0, -1):
+    for rnd in range(Nr - 1, 0, -1):
         add_round_key(state, round_keys[rnd])
         inv_mix_columns(state)
         inv_shift_rows(state)
@@ -192,19 +233,372 @@ def pkcs7_unpad(data: bytes, block_size: int = 16) -> bytes:
     return data[:-padlen]
 
 def ecb_encrypt(plain: bytes, key: bytes) -> bytes:
-    plain_padded = pkcs7_pad(plain, 16)
-    out = bytearray()
-    for i in range(0, len(plain_padded), 16):
-        out.extend(encrypt_block(plain_padded[i:i+16], key))
-    return bytes(out)
+    # the block functions above are the reference; bulk data goes through AESKey
+    return _aes_key(bytes(key)).ecb_encrypt(plain)
 
 def ecb_decrypt(cipher: bytes, key: bytes) -> bytes:
-    if len(cipher) % 16 != 0:
-        raise ValueError("Ciphertext length must be multiple of 16 bytes")
-    out = bytearray()
-    for i in range(0, len(cipher), 16):
-        out.extend(decrypt_block(cipher[i:i+16], key))
-    return pkcs7_unpad(bytes(out), 16)
+    return _aes_key(bytes(key)).ecb_decrypt(cipher)
+
+# --------- T-table fast path ---------
+# The state as four big-endian column words. TE0[x] is MixColumns applied to
+# the column (SBOX[x], 0, 0, 0), i.e. the bytes (2s, s, s, 3s); TE1..TE3 are
+# the same word rotated for the other rows, so a round is 16 lookups and XORs
+# per block. TD0..TD3 do the same for the inverse cipher with (14, 9, 13, 11).
+def _ror8(w: int) -> int:
+    return ((w >> 8) | (w << 24)) & 0xFFFFFFFF
+
+TE0 = [(MUL2[s] << 24) | (s << 16) | (s << 8) | MUL3[s] for s in SBOX]
+TE1 = [_ror8(w) for w in TE0]
+TE2 = [_ror8(w) for w in TE1]
+TE3 = [_ror8(w) for w in TE2]
+TD0 = [(MUL14[s] << 24) | (MUL9[s] << 16) | (MUL13[s] << 8) | MUL11[s] for s in INV_SBOX]
+TD1 = [_ror8(w) for w in TD0]
+TD2 = [_ror8(w) for w in TD1]
+TD3 = [_ror8(w) for w in TD2]
+
+_WORDS = struct.Struct(">4I")
+
+# Tables are bound as default arguments so the loops read locals, not globals
+def _encrypt_words(rk, nr, s0, s1, s2, s3, Te0=TE0, Te1=TE1, Te2=TE2, Te3=TE3, S=SBOX):
+    s0 ^= rk[0]; s1 ^= rk[1]; s2 ^= rk[2]; s3 ^= rk[3]
+    k = 4
+    for _ in range(nr - 1):
+        t0 = Te0[s0 >> 24] ^ Te1[(s1 >> 16) & 0xFF] ^ Te2[(s2 >> 8) & 0xFF] ^ Te3[s3 & 0xFF] ^ rk[k]
+        t1 = Te0[s1 >> 24] ^ Te1[(s2 >> 16) & 0xFF] ^ Te2[(s3 >> 8) & 0xFF] ^ Te3[s0 & 0xFF] ^ rk[k+1]
+        t2 = Te0[s2 >> 24] ^ Te1[(s3 >> 16) & 0xFF] ^ Te2[(s0 >> 8) & 0xFF] ^ Te3[s1 & 0xFF] ^ rk[k+2]
+        s3 = Te0[s3 >> 24] ^ Te1[(s0 >> 16) & 0xFF] ^ Te2[(s1 >> 8) & 0xFF] ^ Te3[s2 & 0xFF] ^ rk[k+3]
+        s0, s1, s2 = t0, t1, t2
+        k += 4
+    # final round: SubBytes and ShiftRows only
+    return ((S[s0 >> 24] << 24 | S[(s1 >> 16) & 0xFF] << 16 | S[(s2 >> 8) & 0xFF] << 8 | S[s3 & 0xFF]) ^ rk[k],
+            (S[s1 >> 24] << 24 | S[(s2 >> 16) & 0xFF] << 16 | S[(s3 >> 8) & 0xFF] << 8 | S[s0 & 0xFF]) ^ rk[k+1],
+            (S[s2 >> 24] << 24 | S[(s3 >> 16) & 0xFF] << 16 | S[(s0 >> 8) & 0xFF] << 8 | S[s1 & 0xFF]) ^ rk[k+2],
+            (S[s3 >> 24] << 24 | S[(s0 >> 16) & 0xFF] << 16 | S[(s1 >> 8) & 0xFF] << 8 | S[s2 & 0xFF]) ^ rk[k+3])
+
+# The equivalent inverse cipher (FIPS-197 5.3.5): same shape, rows shifted the other way
+def _decrypt_words(dk, nr, s0, s1, s2, s3, Td0=TD0, Td1=TD1, Td2=TD2, Td3=TD3, S=INV_SBOX):
+    s0 ^= dk[0]; s1 ^= dk[1]; s2 ^= dk[2]; s3 ^= dk[3]
+    k = 4
+    for _ in range(nr - 1):
+        t0 = Td0[s0 >> 24] ^ Td1[(s3 >> 16) & 0xFF] ^ Td2[(s2 >> 8) & 0xFF] ^ Td3[s1 & 0xFF] ^ dk[k]
+        t1 = Td0[s1 >> 24] ^ Td1[(s0 >> 16) & 0xFF] ^ Td2[(s3 >> 8) & 0xFF] ^ Td3[s2 & 0xFF] ^ dk[k+1]
+        t2 = Td0[s2 >> 24] ^ Td1[(s1 >> 16) & 0xFF] ^ Td2[(s0 >> 8) & 0xFF] ^ Td3[s3 & 0xFF] ^ dk[k+2]
+        s3 = Td0[s3 >> 24] ^ Td1[(s2 >> 16) & 0xFF] ^ Td2[(s1 >> 8) & 0xFF] ^ Td3[s0 & 0xFF] ^ dk[k+3]
+        s0, s1, s2 = t0, t1, t2
+        k += 4
+    return ((S[s0 >> 24] << 24 | S[(s3 >> 16) & 0xFF] << 16 | S[(s2 >> 8) & 0xFF] << 8 | S[s1 & 0xFF]) ^ dk[k],
+            (S[s1 >> 24] << 24 | S[(s0 >> 16) & 0xFF] << 16 | S[(s3 >> 8) & 0xFF] << 8 | S[s2 & 0xFF]) ^ dk[k+1],
+            (S[s2 >> 24] << 24 | S[(s1 >> 16) & 0xFF] << 16 | S[(s0 >> 8) & 0xFF] << 8 | S[s3 & 0xFF]) ^ dk[k+2],
+            (S[s3 >> 24] << 24 | S[(s2 >> 16) & 0xFF] << 16 | S[(s1 >> 8) & 0xFF] << 8 | S[s0 & 0xFF]) ^ dk[k+3])
+
+def _xor_bytes(a: bytes, b: bytes) -> bytes:
+    # one big-integer XOR instead of a Python loop over the bytes
+    return (int.from_bytes(a, "big") ^ int.from_bytes(b, "big")).to_bytes(len(a), "big")
+
+class AESKey:
+    """An AES key expanded once, for any number of blocks and messages.
+
+    Same results as the functions above. All inputs and outputs are bytes;
+    ecb_* and cbc_* apply PKCS#7 padding like ecb_encrypt / ecb_decrypt.
+    """
+
+    def __init__(self, key: bytes):
+        if len(key) not in (16, 24, 32):
+            raise ValueError("AES key must be 16, 24 or 32 bytes")
+        round_keys = key_expansion(bytes(key))
+        self.rounds = len(round_keys) - 1
+        self._ek = [w for rk in round_keys for w in _WORDS.unpack(bytes(rk))]
+        # decryption keys: reverse order, InvMixColumns on all but the first and last
+        nr = self.rounds
+        self._dk = []
+        for r in range(nr + 1):
+            for w in self._ek[4 * (nr - r):4 * (nr - r) + 4]:
+                if 0 < r < nr:
+                    w = (TD0[SBOX[w >> 24]] ^ TD1[SBOX[(w >> 16) & 0xFF]] ^
+                         TD2[SBOX[(w >> 8) & 0xFF]] ^ TD3[SBOX[w & 0xFF]])
+                self._dk.append(w)
+
+    def encrypt_block(self, block: bytes) -> bytes:
+        return _WORDS.pack(*_encrypt_words(self._ek, self.rounds, *_WORDS.unpack(block)))
+
+    def decrypt_block(self, block: bytes) -> bytes:
+        return _WORDS.pack(*_decrypt_words(self._dk, self.rounds, *_WORDS.unpack(block)))
+
+    def _ecb(self, data: bytes, crypt, rk) -> bytes:
+        out = bytearray(len(data))
+        nr, unpack_from, pack_into = self.rounds, _WORDS.unpack_from, _WORDS.pack_into
+        for off in range(0, len(data), 16):
+            pack_into(out, off, *crypt(rk, nr, *unpack_from(data, off)))
+        return bytes(out)
+
+    def ecb_encrypt(self, plain: bytes) -> bytes:
+        return self._ecb(pkcs7_pad(plain, 16), _encrypt_words, self._ek)
+
+    def ecb_decrypt(self, cipher: bytes) -> bytes:
+        if len(cipher) % 16 != 0:
+            raise ValueError("Ciphertext length must be multiple of 16 bytes")
+        return pkcs7_unpad(self._ecb(cipher, _decrypt_words, self._dk), 16)
+
+    def ctr(self, data: bytes, iv: bytes) -> bytes:
+        """CTR mode (SP 800-38A 6.5): encrypts and decrypts. The whole 16-byte
+        iv is the initial counter, incremented as a big-endian integer."""
+        if len(iv) != 16:
+            raise ValueError("CTR initial counter must be 16 bytes")
+        nblocks = (len(data) + 15) // 16
+        keystream = bytearray(16 * nblocks)
+        ek, nr, pack_into = self._ek, self.rounds, _WORDS.pack_into
+        counter = int.from_bytes(iv, "big")
+        for i in range(nblocks):
+            c = (counter + i) & ((1 << 128) - 1)
+            pack_into(keystream, 16 * i,
+                      *_encrypt_words(ek, nr, c >> 96, (c >> 64) & 0xFFFFFFFF, (c >> 32) & 0xFFFFFFFF, c & 0xFFFFFFFF))
+        return _xor_bytes(data, keystream[:len(data)])
+
+    def cbc_encrypt(self, plain: bytes, iv: bytes) -> bytes:
+        if len(iv) != 16:
+            raise ValueError("CBC IV must be 16 bytes")
+        data = pkcs7_pad(plain, 16)
+        out = bytearray(len(data))
+        ek, nr, unpack_from, pack_into = self._ek, self.rounds, _WORDS.unpack_from, _WORDS.pack_into
+        c0, c1, c2, c3 = _WORDS.unpack(iv)
+        for off in range(0, len(data), 16):
+            p0, p1, p2, p3 = unpack_from(data, off)
+            c0, c1, c2, c3 = _encrypt_words(ek, nr, p0 ^ c0, p1 ^ c1, p2 ^ c2, p3 ^ c3)
+            pack_into(out, off, c0, c1, c2, c3)
+        return bytes(out)
+
+    def cbc_decrypt(self, cipher: bytes, iv: bytes) -> bytes:
+        if len(iv) != 16:
+            raise ValueError("CBC IV must be 16 bytes")
+        if len(cipher) % 16 != 0:
+            raise ValueError("Ciphertext length must be multiple of 16 bytes")
+        # D(C[i]) for every block, then one XOR with the ciphertext shifted by a block
+        decrypted = self._ecb(cipher, _decrypt_words, self._dk)
+        return pkcs7_unpad(_xor_bytes(decrypted, iv + cipher[:-16]), 16)
+
+# --------- Optional native backend (libaes.so) ---------
+# aes.c built as a shared library:
+#   gcc -O3 -shared -fPIC -DAES_NO_MAIN aes.c -o libaes.so
+# It is looked for next to this file, or at $AES_LIBRARY, and when it loads
+# every function in this module uses it; AES_PURE_PYTHON=1 keeps everything
+# in Python. Results are the same either way. ctypes releases the GIL for the
+# duration of each call, so threads encrypting at the same time run in parallel.
+def _load_native():
+    if os.environ.get("AES_PURE_PYTHON"):
+        return None
+    path = os.environ.get("AES_LIBRARY") or os.path.join(os.path.dirname(os.path.abspath(__file__)), "libaes.so")
+    try:
+        lib = ctypes.CDLL(path)
+    except OSError:
+        return None
+    ctx, buf, size = ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t
+    for name, restype, argtypes in (
+        ("aes_new", ctx, (buf, size)),
+        ("aes_free", None, (ctx,)),
+        ("aes_backend_name", ctypes.c_char_p, (ctx,)),
+        ("aes_encrypt_blocks", None, (ctx, buf, buf, size)),
+        ("aes_decrypt_blocks", None, (ctx, buf, buf, size)),
+        ("aes_ecb_encrypt", size, (ctx, buf, size, buf)),
+        ("aes_ecb_decrypt", ctypes.c_long, (ctx, buf, size, buf)),
+        ("aes_cbc_encrypt", size, (ctx, buf, buf, size, buf)),
+        ("aes_cbc_decrypt", ctypes.c_long, (ctx, buf, buf, size, buf)),
+        ("aes_ctr_encrypt", None, (ctx, buf, buf, buf, size)),
+    ):
+        fn = getattr(lib, name)
+        fn.restype = restype
+        fn.argtypes = argtypes
+    return lib
+
+_native_lib = _load_native()
+_native = _native_lib
+
+def use_native(enabled: bool = True) -> bool:
+    """Switches between libaes.so (if it loaded) and pure Python.
+    Returns whether libaes.so is now in use."""
+    global _native
+    _native = _native_lib if enabled else None
+    return _native is not None
+
+class NativeAESKey:
+    """AESKey over libaes.so: the same methods and results."""
+
+    def __init__(self, key: bytes):
+        if len(key) not in (16, 24, 32):
+            raise ValueError("AES key must be 16, 24 or 32 bytes")
+        self._lib = _native_lib
+        self._ctx = self._lib.aes_new(bytes(key), len(key))
+        if not self._ctx:
+            raise MemoryError("aes_new failed")
+        self.rounds = len(key) // 4 + 6
+        self.backend = self._lib.aes_backend_name(self._ctx).decode()
+
+    def __del__(self):
+        if getattr(self, "_ctx", None):
+            self._lib.aes_free(self._ctx)
+            self._ctx = None
+
+    def _blocks(self, fn, data: bytes) -> bytes:
+        out = ctypes.create_string_buffer(len(data))
+        fn(self._ctx, bytes(data), out, len(data) // 16)
+        return out.raw
+
+    def encrypt_block(self, block: bytes) -> bytes:
+        assert len(block) == 16
+        return self._blocks(self._lib.aes_encrypt_blocks, block)
+
+    def decrypt_block(self, block: bytes) -> bytes:
+        assert len(block) == 16
+        return self._blocks(self._lib.aes_decrypt_blocks, block)
+
+    def ecb_encrypt(self, plain: bytes) -> bytes:
+        out = ctypes.create_string_buffer(len(plain) // 16 * 16 + 16)
+        n = self._lib.aes_ecb_encrypt(self._ctx, bytes(plain), len(plain), out)
+        return out.raw[:n]
+
+    def ecb_decrypt(self, cipher: bytes) -> bytes:
+        if len(cipher) % 16 != 0:
+            raise ValueError("Ciphertext length must be multiple of 16 bytes")
+        out = ctypes.create_string_buffer(len(cipher))
+        n = self._lib.aes_ecb_decrypt(self._ctx, bytes(cipher), len(cipher), out)
+        return self._unpadded(out, n)
+
+    def ctr(self, data: bytes, iv: bytes) -> bytes:
+        if len(iv) != 16:
+            raise ValueError("CTR initial counter must be 16 bytes")
+        out = ctypes.create_string_buffer(len(data))
+        self._lib.aes_ctr_encrypt(self._ctx, bytes(iv), bytes(data), out, len(data))
+        return out.raw
+
+    def cbc_encrypt(self, plain: bytes, iv: bytes) -> bytes:
+        if len(iv) != 16:
+            raise ValueError("CBC IV must be 16 bytes")
+        out = ctypes.create_string_buffer(len(plain) // 16 * 16 + 16)
+        n = self._lib.aes_cbc_encrypt(self._ctx, bytes(iv), bytes(plain), len(plain), out)
+        return out.raw[:n]
+
+    def cbc_decrypt(self, cipher: bytes, iv: bytes) -> bytes:
+        if len(iv) != 16:
+            raise ValueError("CBC IV must be 16 bytes")
+        if len(cipher) % 16 != 0:
+            raise ValueError("Ciphertext length must be multiple of 16 bytes")
+        out = ctypes.create_string_buffer(len(cipher))
+        n = self._lib.aes_cbc_decrypt(self._ctx, bytes(iv), bytes(cipher), len(cipher), out)
+        return self._unpadded(out, n)
+
+    @staticmethod
+    def _unpadded(out, n: int) -> bytes:
+        # the C side returns -1 for both bad lengths and bad padding
+        if n < 0:
+            raise ValueError("Invalid PKCS#7 padding" if len(out) else "Invalid padded data length")
+        return ctypes.string_at(out, n)
+
+# Expanded keys for the raw-key functions, by key bytes (see clear_key_caches)
+@functools.lru_cache(maxsize=64)
+def _python_key(key: bytes) -> AESKey:
+    return AESKey(key)
+
+# Native contexts stay in the C heap until evicted or cleared; only then
+# does __del__ run aes_free, which wipes them
+@functools.lru_cache(maxsize=64)
+def _native_key(key: bytes) -> NativeAESKey:
+    return NativeAESKey(key)
+
+def _aes_key(key: bytes):
+    return _native_key(key) if _native is not None else _python_key(key)
+
+def new_key(key: bytes):
+    """An uncached expanded key (NativeAESKey if libaes.so is in use, else
+    AESKey) with the ecb_*, cbc_* and ctr methods. Nothing else keeps a
+    reference to it, so its schedule goes when the caller drops it."""
+    return NativeAESKey(key) if _native is not None else AESKey(key)
+
+def clear_key_caches() -> None:
+    """Drops every key the raw-key functions have cached, with its schedule.
+    libaes.so contexts are wiped and freed by aes_free as soon as no call is
+    still using them. The pure-Python copies are immutable bytes and ints:
+    they are released to the allocator, not overwritten, and may stay in
+    memory until reused. Also runs at exit."""
+    _cached_round_keys.cache_clear()
+    _python_key.cache_clear()
+    _native_key.cache_clear()
+
+atexit.register(clear_key_caches)
+
+# --------- Bytes-in / bytes-out modes over the fast path ---------
+def ctr_encrypt(data: bytes, key: bytes, iv: bytes) -> bytes:
+    return _aes_key(bytes(key)).ctr(data, iv)
+
+ctr_decrypt = ctr_encrypt
+
+def cbc_encrypt(plain: bytes, key: bytes, iv: bytes) -> bytes:
+    return _aes_key(bytes(key)).cbc_encrypt(plain, iv)
+
+def cbc_decrypt(cipher: bytes, key: bytes, iv: bytes) -> bytes:
+    return _aes_key(bytes(key)).cbc_decrypt(cipher, iv)
+
+# --------- Benchmark ---------
+def _mb_per_s(fn, nbytes: int) -> float:
+    start = time.perf_counter()
+    fn()
+    return nbytes / (time.perf_counter() - start) / 1e6
+
+def benchmark(megabytes: int = 4, threads: int = min(4, os.cpu_count() or 1)) -> None:
+    """MB/s of the reference per-block path (on a smaller sample, it is slow)
+    against the T-table paths on multi-MB inputs, then of libaes.so if it
+    loaded, alone and from several threads at once."""
+    key = bytes(range(16))
+    iv = bytes(range(16, 32))
+    sample = bytes(16 * 1024)
+    data = bytes(megabytes * 1024 * 1024 - 1)    # PKCS#7 pads it to a whole MB count
+    native = _native is not None
+
+    def reference_encrypt():
+        for i in range(0, len(sample), 16):
+            encrypt_block(sample[i:i+16], key)
+
+    def reference_decrypt():
+        for i in range(0, len(sample), 16):
+            decrypt_block(sample[i:i+16], key)
+
+    def key_rows(label, aes_key):
+        ecb_ct = aes_key.ecb_encrypt(data)
+        cbc_ct = aes_key.cbc_encrypt(data, iv)
+        return (
+            (label + " ECB encrypt", lambda: aes_key.ecb_encrypt(data), len(data)),
+            (label + " ECB decrypt", lambda: aes_key.ecb_decrypt(ecb_ct), len(data)),
+            (label + " CTR", lambda: aes_key.ctr(data, iv), len(data)),
+            (label + " CBC encrypt", lambda: aes_key.cbc_encrypt(data, iv), len(data)),
+            (label + " CBC decrypt", lambda: aes_key.cbc_decrypt(cbc_ct, iv), len(data)),
+        )
+
+    print("AES-128, %d MiB inputs (reference rows on %d KiB)" % (megabytes, len(sample) // 1024))
+    use_native(False)
+    try:
+        rows = (
+            ("encrypt_block (reference)", reference_encrypt, len(sample)),
+            ("decrypt_block (reference)", reference_decrypt, len(sample)),
+        ) + key_rows("AESKey", AESKey(key))
+        for name, fn, nbytes in rows:
+            print("  %-32s %10.3f MB/s" % (name, _mb_per_s(fn, nbytes)))
+    finally:
+        use_native(native)
+    if not native:
+        print("  libaes.so not loaded (gcc -O3 -shared -fPIC -DAES_NO_MAIN aes.c -o libaes.so)")
+        return
+
+    native_key = NativeAESKey(key)
+    for name, fn, nbytes in key_rows("libaes.so (%s)" % native_key.backend, native_key):
+        print("  %-32s %10.3f MB/s" % (name, _mb_per_s(fn, nbytes)))
+
+    # The same CTR call from several threads: only scales if the GIL is released
+    def ctr_threads():
+        workers = [threading.Thread(target=native_key.ctr, args=(data, iv)) for _ in range(threads)]
+        for w in workers:
+            w.start()
+        for w in workers:
+            w.join()
+    print("  %-32s %10.3f MB/s" % ("libaes.so CTR, %d threads" % threads,
+                                   _mb_per_s(ctr_threads, threads * len(data))))
 
 # --------- Hex I/O helpers ---------
 def hex_to_bytes(h: str) -> bytes:
@@ -222,32 +616,32 @@ def bytes_to_hex(b: bytes) -> str:
 def aes128_encrypt_block_hex(plaintext_hex: str, key_hex: str) -> str:
     p = hex_to_bytes(plaintext_hex)
     k = hex_to_bytes(key_hex)
-    if len(p) != 16 or len(k) != 16:
-        raise ValueError("AES-128 block and key must be 16 bytes (32 hex chars)")
+    if len(p) != 16 or len(k) not in (16, 24, 32):
+        raise ValueError("AES block must be 16 bytes and key 16, 24 or 32 bytes (32, 48 or 64 hex chars)")
     c = encrypt_block(p, k)
     return bytes_to_hex(c)
 
 def aes128_decrypt_block_hex(ciphertext_hex: str, key_hex: str) -> str:
     c = hex_to_bytes(ciphertext_hex)
     k = hex_to_bytes(key_hex)
-    if len(c) != 16 or len(k) != 16:
-        raise ValueError("AES-128 block and key must be 16 bytes (32 hex chars)")
+    if len(c) != 16 or len(k) not in (16, 24, 32):
+        raise ValueError("AES block must be 16 bytes and key 16, 24 or 32 bytes (32, 48 or 64 hex chars)")
     p = decrypt_block(c, k)
     return bytes_to_hex(p)
 
 def aes128_ecb_encrypt_hex(plaintext_hex: str, key_hex: str) -> str:
     p = hex_to_bytes(plaintext_hex)
     k = hex_to_bytes(key_hex)
-    if len(k) != 16:
-        raise ValueError("AES-128 key must be 16 bytes (32 hex chars)")
+    if len(k) not in (16, 24, 32):
+        raise ValueError("AES key must be 16, 24 or 32 bytes (32, 48 or 64 hex chars)")
     c = ecb_encrypt(p, k)
     return bytes_to_hex(c)
 
 def aes128_ecb_decrypt_hex(ciphertext_hex: str, key_hex: str) -> str:
     c = hex_to_bytes(ciphertext_hex)
     k = hex_to_bytes(key_hex)
-    if len(k) != 16:
-        raise ValueError("AES-128 key must be 16 bytes (32 hex chars)")
+    if len(k) not in (16, 24, 32):
+        raise ValueError("AES key must be 16, 24 or 32 bytes (32, 48 or 64 hex chars)")
     p = ecb_decrypt(c, k)
     return bytes_to_hex(p)
 
@@ -272,3 +666,58 @@ if __name__ == "__main__":
     ecb_ct = aes128_ecb_encrypt_hex(msg_hex, key)
     ecb_pt = aes128_ecb_decrypt_hex(ecb_ct, key)
     print("ECB round-trip OK:", ecb_pt == msg_hex, ecb_pt)
+
+    # FIPS-197 C.2 (AES-192) and C.3 (AES-256)
+    pt = "00112233445566778899aabbccddeeff"
+    for key, ct_expected in (
+        ("000102030405060708090a0b0c0d0e0f1011121314151617", "dda97ca4864cdfe06eaf70a0ec0d7191"),
+        ("000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", "8ea2b7ca516745bfeafc49904b496089"),
+    ):
+        ct = aes128_encrypt_block_hex(pt, key)
+        pt2 = aes128_decrypt_block_hex(ct, key)
+        print("AES-%d OK:" % (len(key) * 4), ct == ct_expected and pt2 == pt, ct)
+
+    # SP 800-38A F.2.1 (CBC-AES128) and F.5.1 (CTR-AES128), first two blocks
+    key = hex_to_bytes("2b7e151628aed2a6abf7158809cf4f3c")
+    pt = hex_to_bytes("6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51")
+    iv = hex_to_bytes("000102030405060708090a0b0c0d0e0f")
+    cbc_ct = cbc_encrypt(pt, key, iv)
+    print("CBC OK:", bytes_to_hex(cbc_ct[:32]) ==
+          "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2"
+          and cbc_decrypt(cbc_ct, key, iv) == pt)
+    ctr = hex_to_bytes("f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff")
+    ctr_ct = ctr_encrypt(pt, key, ctr)
+    print("CTR OK:", bytes_to_hex(ctr_ct) ==
+          "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+          and ctr_decrypt(ctr_ct, key, ctr) == pt)
+
+    # The T-table path against the reference block functions
+    aes_key = AESKey(key)
+    blocks = bytes(range(256))
+    same = all(aes_key.encrypt_block(blocks[i:i+16]) == encrypt_block(blocks[i:i+16], key) and
+               aes_key.decrypt_block(blocks[i:i+16]) == decrypt_block(blocks[i:i+16], key)
+               for i in range(0, len(blocks), 16))
+    print("AESKey matches reference:", same)
+    clear_key_caches()
+    print("Key caches cleared:", _cached_round_keys.cache_info().currsize == 0 and
+          _python_key.cache_info().currsize == 0 and _native_key.cache_info().currsize == 0)
+
+    # libaes.so against the pure-Python path, every key size and mode
+    if _native is not None:
+        same = True
+        for key_len in (16, 24, 32):
+            key = bytes(range(key_len))
+            py_key, c_key = AESKey(key), NativeAESKey(key)
+            for n in (0, 1, 15, 16, 17, 100, 1000):
+                data = bytes((7 * i + key_len) & 0xFF for i in range(n))
+                same = same and (c_key.ecb_encrypt(data) == py_key.ecb_encrypt(data) and
+                                 c_key.cbc_encrypt(data, iv) == py_key.cbc_encrypt(data, iv) and
+                                 c_key.ctr(data, ctr) == py_key.ctr(data, ctr) and
+                                 c_key.ecb_decrypt(py_key.ecb_encrypt(data)) == data and
+                                 c_key.cbc_decrypt(py_key.cbc_encrypt(data, iv), iv) == data)
+        print("libaes.so (%s) matches pure Python:" % c_key.backend, same)
+    else:
+        print("libaes.so not loaded, pure Python only")
+
+    if "--bench" in sys.argv:
+        benchmark()
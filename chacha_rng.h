@@ -0,0 +1,208 @@
+/*
+ * ChaCha20 CSPRNG with fast key erasure, for drawing prime candidates and
+ * test bases in the GMP programs (Miller-Rabin, Solovay-Strassen, rsa*.c).
+ *
+ * Each refill runs ChaCha20 under the current key for CHACHA_RNG_BLOCKS
+ * blocks. The first 32 bytes become the next key at once, and every output
+ * byte is wiped from the buffer as it is handed out. So a copy of the
+ * generator's memory taken later cannot be used to recover earlier output.
+ *
+ * Streams: chacha_rng_init seeds one generator from getrandom.
+ * chacha_rng_init_seed gives a reproducible generator, and different 'stream'
+ * values under one seed are independent (the stream id is the ChaCha nonce).
+ * chacha_rng_thread hands each thread its own getrandom-seeded generator, so
+ * threads never share state or take a lock.
+ *
+ * With <gmp.h> included first, chacha_rng_urandomb / chacha_rng_urandomm
+ * fill an mpz_t's limbs directly, standing in for mpz_urandomb / mpz_urandomm.
+ * GMP has no public way to plug a custom generator into gmp_randstate_t, so
+ * this is a direct candidate-import path rather than a randstate bridge.
+ *
+ * Not fork-safe: a child that keeps using its parent's generator repeats
+ * the parent's output. Reseed after fork().
+ */
+
+#ifndef CHACHA_RNG_H
+#define CHACHA_RNG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/random.h>
+
+#define CHACHA_RNG_BLOCKS 16                    // keystream blocks per refill
+#define CHACHA_RNG_BUFSIZE (CHACHA_RNG_BLOCKS * 64)
+
+typedef struct {
+    uint32_t key[8];
+    uint64_t stream;                    // nonce, words 14..15 of the state
+    uint8_t buf[CHACHA_RNG_BUFSIZE];    // bytes before 'pos' are already wiped
+    size_t pos;
+} chacha_rng;
+
+#define CHACHA_RNG_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_RNG_QR(a, b, c, d) \
+    a += b; d ^= a; d = CHACHA_RNG_ROTL(d, 16); \
+    c += d; b ^= c; b = CHACHA_RNG_ROTL(b, 12); \
+    a += b; d ^= a; d = CHACHA_RNG_ROTL(d, 8); \
+    c += d; b ^= c; b = CHACHA_RNG_ROTL(b, 7)
+
+static inline uint32_t chacha_rng_load32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void chacha_rng_wipe(void *p, size_t len) {
+    volatile uint8_t *v = p;
+    while (len--) *v++ = 0;
+}
+
+/*
+Writes nblocks of ChaCha20 keystream (20 rounds, 64-bit block counter and
+64-bit nonce as in the original ChaCha layout) starting at block 'counter'.
+*/
+static inline void chacha_rng_blocks(const uint32_t key[8], uint64_t stream, uint64_t counter,
+                                     uint8_t *out, size_t nblocks) {
+    uint32_t input[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+    for (int i = 0; i < 8; i++) input[4 + i] = key[i];
+    input[14] = (uint32_t)stream;
+    input[15] = (uint32_t)(stream >> 32);
+
+    for (size_t b = 0; b < nblocks; b++, counter++, out += 64) {
+        uint32_t x[16];
+        input[12] = (uint32_t)counter;
+        input[13] = (uint32_t)(counter >> 32);
+        for (int i = 0; i < 16; i++) x[i] = input[i];
+        for (int i = 0; i < 10; i++) {
+            CHACHA_RNG_QR(x[0], x[4], x[8], x[12]);
+            CHACHA_RNG_QR(x[1], x[5], x[9], x[13]);
+            CHACHA_RNG_QR(x[2], x[6], x[10], x[14]);
+            CHACHA_RNG_QR(x[3], x[7], x[11], x[15]);
+            CHACHA_RNG_QR(x[0], x[5], x[10], x[15]);
+            CHACHA_RNG_QR(x[1], x[6], x[11], x[12]);
+            CHACHA_RNG_QR(x[2], x[7], x[8], x[13]);
+            CHACHA_RNG_QR(x[3], x[4], x[9], x[14]);
+        }
+        for (int i = 0; i < 16; i++) {
+            uint32_t w = x[i] + input[i];
+            out[4 * i] = (uint8_t)w;
+            out[4 * i + 1] = (uint8_t)(w >> 8);
+            out[4 * i + 2] = (uint8_t)(w >> 16);
+            out[4 * i + 3] = (uint8_t)(w >> 24);
+        }
+        chacha_rng_wipe(x, sizeof x);
+    }
+    chacha_rng_wipe(input, sizeof input);
+}
+
+// Fast key erasure: the first 32 bytes of a refill become the next key
+static inline void chacha_rng_refill(chacha_rng *rng) {
+    chacha_rng_blocks(rng->key, rng->stream, 0, rng->buf, CHACHA_RNG_BLOCKS);
+    for (int i = 0; i < 8; i++) rng->key[i] = chacha_rng_load32(rng->buf + 4 * i);
+    chacha_rng_wipe(rng->buf, 32);
+    rng->pos = 32;
+}
+
+static inline void chacha_rng_init_seed(chacha_rng *rng, const uint8_t seed[32], uint64_t stream) {
+    for (int i = 0; i < 8; i++) rng->key[i] = chacha_rng_load32(seed + 4 * i);
+    rng->stream = stream;
+    rng->pos = CHACHA_RNG_BUFSIZE;     // empty; the first draw refills
+}
+
+// Seeds from getrandom. Returns 0, or -1 with errno set.
+static inline int chacha_rng_init(chacha_rng *rng) {
+    uint8_t seed[32];
+    size_t got = 0;
+    while (got < sizeof seed) {
+        ssize_t n = getrandom(seed + got, sizeof seed - got, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        got += (size_t)n;
+    }
+    chacha_rng_init_seed(rng, seed, 0);
+    chacha_rng_wipe(seed, sizeof seed);
+    return 0;
+}
+
+/*
+Bulk fill. Small requests are served from the buffer. Once the buffer is
+empty, a request of at least a buffer's worth is written straight into 'out'
+from blocks 1.. of the current key, with block 0 giving the next key, so big
+draws skip the copy.
+*/
+static inline void chacha_rng_fill(chacha_rng *rng, void *out, size_t len) {
+    uint8_t *p = out;
+
+    while (len > 0) {
+        if (rng->pos == CHACHA_RNG_BUFSIZE) {
+            if (len >= CHACHA_RNG_BUFSIZE) {
+                uint8_t next[64];
+                size_t nblocks = len / 64;
+                chacha_rng_blocks(rng->key, rng->stream, 0, next, 1);
+                chacha_rng_blocks(rng->key, rng->stream, 1, p, nblocks);
+                for (int i = 0; i < 8; i++) rng->key[i] = chacha_rng_load32(next + 4 * i);
+                chacha_rng_wipe(next, sizeof next);
+                p += 64 * nblocks;
+                len -= 64 * nblocks;
+                continue;
+            }
+            chacha_rng_refill(rng);
+        }
+        size_t n = CHACHA_RNG_BUFSIZE - rng->pos;
+        if (n > len) n = len;
+        memcpy(p, rng->buf + rng->pos, n);
+        chacha_rng_wipe(rng->buf + rng->pos, n);
+        rng->pos += n;
+        p += n;
+        len -= n;
+    }
+}
+
+static inline uint64_t chacha_rng_u64(chacha_rng *rng) {
+    uint64_t v;
+    chacha_rng_fill(rng, &v, sizeof v);
+    return v;
+}
+
+// This thread's own generator, seeded from getrandom on first use; NULL if that fails
+static inline chacha_rng *chacha_rng_thread(void) {
+    static __thread chacha_rng rng;
+    static __thread int seeded;
+    if (!seeded) {
+        if (chacha_rng_init(&rng) != 0) return NULL;
+        seeded = 1;
+    }
+    return &rng;
+}
+
+#ifdef __GNU_MP__
+/*
+rop = uniform random integer in [0, 2^bits - 1], like mpz_urandomb.
+The generator writes straight into rop's limbs.
+*/
+static inline void chacha_rng_urandomb(mpz_t rop, chacha_rng *rng, mp_bitcnt_t bits) {
+    mp_size_t n = (mp_size_t)((bits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS);
+    if (n == 0) {
+        mpz_set_ui(rop, 0);
+        return;
+    }
+    mp_limb_t *limbs = mpz_limbs_write(rop, n);
+    chacha_rng_fill(rng, limbs, (size_t)n * sizeof(mp_limb_t));
+    if (bits % GMP_NUMB_BITS) limbs[n - 1] &= ((mp_limb_t)1 << (bits % GMP_NUMB_BITS)) - 1;
+    mpz_limbs_finish(rop, n);
+}
+
+/*
+rop = uniform random integer in [0, n - 1], like mpz_urandomm, by rejection
+on sizeinbase(n, 2) bits (fewer than two draws on average). rop must not be n.
+*/
+static inline void chacha_rng_urandomm(mpz_t rop, chacha_rng *rng, const mpz_t n) {
+    mp_bitcnt_t bits = mpz_sizeinbase(n, 2);
+    do {
+        chacha_rng_urandomb(rop, rng, bits);
+    } while (mpz_cmp(rop, n) >= 0);
+}
+#endif
+
+#endif
@@ -0,0 +1,277 @@
+/*
+ * Poly1305 one-time authenticator (RFC 8439 section 2.5), shared by the
+ * ChaCha20-Poly1305 AEAD in Chacha20.c and the XSalsa20-Poly1305 secretbox
+ * in Salsa20 (gmp).c. Header-only: include it once per program.
+ */
+
+#ifndef POLY1305_H
+#define POLY1305_H
+
+#include <stdint.h>
+#include <string.h>
+#include <x86intrin.h>
+
+/*
+The scalar path keeps the 130-bit accumulator in three 64-bit limbs of
+44, 44 and 42 bits (radix 2^44), so each block costs nine 64x64->128-bit
+multiplications. The AVX2 path splits the message into 4 interleaved streams
+in radix 2^26: lane j takes blocks j, j+4, j+8, ... and multiplies by r^4 per
+step, and the last step multiplies the lanes by r^4, r^3, r^2, r^1 so the four
+lanes add up to the sequential result.
+*/
+#define M44 0xfffffffffffULL
+#define M42 0x3ffffffffffULL
+#define M26 0x3ffffffULL
+
+typedef struct {
+    uint64_t r[3], s[3];        // clamped r in radix 2^44, s = 20 * r for the wrap-around
+    uint64_t h[3];              // accumulator
+    uint64_t pad[2];            // second half of the key, added at the end
+    uint32_t rpow[4][5];        // r^1..r^4 in radix 2^26 for the AVX2 path
+    uint8_t buffer[16];         // partial block waiting for more input
+    size_t buffered;
+} poly1305_ctx;
+
+static uint64_t load64_le(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);           // little-endian host (x86)
+    return v;
+}
+
+static void store64_le(uint8_t *p, uint64_t v) {
+    memcpy(p, &v, 8);
+}
+
+// h = h * r mod 2^130 - 5, all in radix 2^44; h may be up to a few bits over its limbs
+static void poly1305_mul(uint64_t h[3], const uint64_t r[3], const uint64_t s[3]) {
+    unsigned __int128 d0, d1, d2;
+    uint64_t c;
+
+    d0 = (unsigned __int128)h[0] * r[0] + (unsigned __int128)h[1] * s[2] + (unsigned __int128)h[2] * s[1];
+    d1 = (unsigned __int128)h[0] * r[1] + (unsigned __int128)h[1] * r[0] + (unsigned __int128)h[2] * s[2];
+    d2 = (unsigned __int128)h[0] * r[2] + (unsigned __int128)h[1] * r[1] + (unsigned __int128)h[2] * r[0];
+
+    c = (uint64_t)(d0 >> 44); h[0] = (uint64_t)d0 & M44;
+    d1 += c; c = (uint64_t)(d1 >> 44); h[1] = (uint64_t)d1 & M44;
+    d2 += c; c = (uint64_t)(d2 >> 42); h[2] = (uint64_t)d2 & M42;
+    h[0] += c * 5; c = h[0] >> 44; h[0] &= M44;
+    h[1] += c;
+}
+
+static void poly1305_blocks_scalar(poly1305_ctx *ctx, const uint8_t *m, size_t nblocks, uint64_t hibit) {
+    while (nblocks > 0) {
+        uint64_t t0 = load64_le(m), t1 = load64_le(m + 8);
+        ctx->h[0] += t0 & M44;
+        ctx->h[1] += ((t0 >> 44) | (t1 << 20)) & M44;
+        ctx->h[2] += ((t1 >> 24) & M42) | hibit;
+        poly1305_mul(ctx->h, ctx->r, ctx->s);
+        m += 16;
+        nblocks--;
+    }
+}
+
+// Splits a radix 2^44 value into five 26-bit limbs (the top one may be a bit over)
+static void poly1305_to_26(uint32_t out[5], const uint64_t h[3]) {
+    uint64_t h0 = h[0], h1 = h[1], h2 = h[2], c;
+    c = h0 >> 44; h0 &= M44; h1 += c;
+    c = h1 >> 44; h1 &= M44; h2 += c;
+    out[0] = (uint32_t)(h0 & M26);
+    out[1] = (uint32_t)(((h0 >> 26) | (h1 << 18)) & M26);
+    out[2] = (uint32_t)((h1 >> 8) & M26);
+    out[3] = (uint32_t)(((h1 >> 34) | (h2 << 10)) & M26);
+    out[4] = (uint32_t)(h2 >> 16);
+}
+
+#define MUL_AVX2(a, b) _mm256_mul_epu32(a, b)
+
+__attribute__((target("avx2")))
+static void poly1305_blocks_avx2(poly1305_ctx *ctx, const uint8_t *m, size_t nblocks) {
+    const __m256i mask26 = _mm256_set1_epi64x(M26);
+    const __m256i hibit = _mm256_set1_epi64x(1 << 24);
+    __m256i h[5], r[5], s[5], rl[5], sl[5], d[5], t;
+    uint32_t h26[5];
+    int i;
+
+    // Lane 0 carries the running accumulator, the other lanes start at zero
+    poly1305_to_26(h26, ctx->h);
+    for (i = 0; i < 5; i++) {
+        h[i] = _mm256_setr_epi64x(h26[i], 0, 0, 0);
+        r[i] = _mm256_set1_epi64x(ctx->rpow[3][i]);
+        s[i] = _mm256_set1_epi64x(ctx->rpow[3][i] * 5ULL);
+        rl[i] = _mm256_setr_epi64x(ctx->rpow[3][i], ctx->rpow[2][i], ctx->rpow[1][i], ctx->rpow[0][i]);
+        sl[i] = _mm256_mul_epu32(rl[i], _mm256_set1_epi64x(5));
+    }
+
+    while (nblocks >= 4) {
+        // Four blocks, one per lane: t0 words in one register, t1 words in another
+        __m256i a = _mm256_loadu_si256((const __m256i *)m);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(m + 32));
+        __m256i lo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b), 0xd8);
+        __m256i hi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b), 0xd8);
+
+        h[0] = _mm256_add_epi64(h[0], _mm256_and_si256(lo, mask26));
+        h[1] = _mm256_add_epi64(h[1], _mm256_and_si256(_mm256_srli_epi64(lo, 26), mask26));
+        h[2] = _mm256_add_epi64(h[2], _mm256_and_si256(
+                   _mm256_or_si256(_mm256_srli_epi64(lo, 52), _mm256_slli_epi64(hi, 12)), mask26));
+        h[3] = _mm256_add_epi64(h[3], _mm256_and_si256(_mm256_srli_epi64(hi, 14), mask26));
+        h[4] = _mm256_add_epi64(h[4], _mm256_or_si256(_mm256_srli_epi64(hi, 40), hibit));
+
+        // The last group multiplies lane j by r^(4-j) instead of r^4
+        const __m256i *pr = nblocks == 4 ? rl : r;
+        const __m256i *ps = nblocks == 4 ? sl : s;
+        d[0] = MUL_AVX2(h[0], pr[0]);
+        d[0] = _mm256_add_epi64(d[0], MUL_AVX2(h[1], ps[4]));
+        d[0] = _mm256_add_epi64(d[0], MUL_AVX2(h[2], ps[3]));
+        d[0] = _mm256_add_epi64(d[0], MUL_AVX2(h[3], ps[2]));
+        d[0] = _mm256_add_epi64(d[0], MUL_AVX2(h[4], ps[1]));
+        d[1] = MUL_AVX2(h[0], pr[1]);
+        d[1] = _mm256_add_epi64(d[1], MUL_AVX2(h[1], pr[0]));
+        d[1] = _mm256_add_epi64(d[1], MUL_AVX2(h[2], ps[4]));
+        d[1] = _mm256_add_epi64(d[1], MUL_AVX2(h[3], ps[3]));
+        d[1] = _mm256_add_epi64(d[1], MUL_AVX2(h[4], ps[2]));
+        d[2] = MUL_AVX2(h[0], pr[2]);
+        d[2] = _mm256_add_epi64(d[2], MUL_AVX2(h[1], pr[1]));
+        d[2] = _mm256_add_epi64(d[2], MUL_AVX2(h[2], pr[0]));
+        d[2] = _mm256_add_epi64(d[2], MUL_AVX2(h[3], ps[4]));
+        d[2] = _mm256_add_epi64(d[2], MUL_AVX2(h[4], ps[3]));
+        d[3] = MUL_AVX2(h[0], pr[3]);
+        d[3] = _mm256_add_epi64(d[3], MUL_AVX2(h[1], pr[2]));
+        d[3] = _mm256_add_epi64(d[3], MUL_AVX2(h[2], pr[1]));
+        d[3] = _mm256_add_epi64(d[3], MUL_AVX2(h[3], pr[0]));
+        d[3] = _mm256_add_epi64(d[3], MUL_AVX2(h[4], ps[4]));
+        d[4] = MUL_AVX2(h[0], pr[4]);
+        d[4] = _mm256_add_epi64(d[4], MUL_AVX2(h[1], pr[3]));
+        d[4] = _mm256_add_epi64(d[4], MUL_AVX2(h[2], pr[2]));
+        d[4] = _mm256_add_epi64(d[4], MUL_AVX2(h[3], pr[1]));
+        d[4] = _mm256_add_epi64(d[4], MUL_AVX2(h[4], pr[0]));
+
+        // Partial carry: limbs end up at most a little over 26 bits
+        t = _mm256_srli_epi64(d[0], 26); d[0] = _mm256_and_si256(d[0], mask26); d[1] = _mm256_add_epi64(d[1], t);
+        t = _mm256_srli_epi64(d[1], 26); d[1] = _mm256_and_si256(d[1], mask26); d[2] = _mm256_add_epi64(d[2], t);
+        t = _mm256_srli_epi64(d[2], 26); d[2] = _mm256_and_si256(d[2], mask26); d[3] = _mm256_add_epi64(d[3], t);
+        t = _mm256_srli_epi64(d[3], 26); d[3] = _mm256_and_si256(d[3], mask26); d[4] = _mm256_add_epi64(d[4], t);
+        t = _mm256_srli_epi64(d[4], 26); d[4] = _mm256_and_si256(d[4], mask26);
+        d[0] = _mm256_add_epi64(d[0], _mm256_add_epi64(t, _mm256_slli_epi64(t, 2)));
+        t = _mm256_srli_epi64(d[0], 26); d[0] = _mm256_and_si256(d[0], mask26); d[1] = _mm256_add_epi64(d[1], t);
+        for (i = 0; i < 5; i++) h[i] = d[i];
+
+        m += 64;
+        nblocks -= 4;
+    }
+
+    // Add the lanes together and go back to radix 2^44
+    uint64_t a[5], lane[4];
+    for (i = 0; i < 5; i++) {
+        _mm256_storeu_si256((__m256i *)lane, h[i]);
+        a[i] = lane[0] + lane[1] + lane[2] + lane[3];
+    }
+    uint64_t c;
+    ctx->h[0] = a[0] + ((a[1] & 0x3ffff) << 26);
+    ctx->h[1] = (a[1] >> 18) + (a[2] << 8) + ((a[3] & 0x3ff) << 34);
+    ctx->h[2] = (a[3] >> 10) + (a[4] << 16);
+    c = ctx->h[0] >> 44; ctx->h[0] &= M44; ctx->h[1] += c;
+    c = ctx->h[1] >> 44; ctx->h[1] &= M44; ctx->h[2] += c;
+    c = ctx->h[2] >> 42; ctx->h[2] &= M42; ctx->h[0] += c * 5;
+    c = ctx->h[0] >> 44; ctx->h[0] &= M44; ctx->h[1] += c;
+}
+
+static int poly1305_avx2 = -1;  // -1: decide on first use, main() may force 0 or 1
+
+// Full 16-byte blocks with the 2^128 bit set
+static void poly1305_blocks(poly1305_ctx *ctx, const uint8_t *m, size_t nblocks) {
+    if (poly1305_avx2 < 0) {
+        __builtin_cpu_init();
+        poly1305_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    if (poly1305_avx2 && nblocks >= 16) {
+        size_t bulk = nblocks & ~(size_t)3;
+        poly1305_blocks_avx2(ctx, m, bulk);
+        m += 16 * bulk;
+        nblocks -= bulk;
+    }
+    poly1305_blocks_scalar(ctx, m, nblocks, 1ULL << 40);
+}
+
+static void poly1305_init(poly1305_ctx *ctx, const uint8_t key[32]) {
+    uint64_t t0 = load64_le(key), t1 = load64_le(key + 8);
+
+    // Clamp r as the RFC requires
+    ctx->r[0] = t0 & 0xffc0fffffffULL;
+    ctx->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+    ctx->r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+    for (int i = 0; i < 3; i++) ctx->s[i] = ctx->r[i] * (5 << 2);
+
+    ctx->h[0] = ctx->h[1] = ctx->h[2] = 0;
+    ctx->pad[0] = load64_le(key + 16);
+    ctx->pad[1] = load64_le(key + 24);
+    ctx->buffered = 0;
+
+    // r^1..r^4 for the 4-lane path
+    uint64_t p[3] = { ctx->r[0], ctx->r[1], ctx->r[2] };
+    for (int k = 0; k < 4; k++) {
+        poly1305_to_26(ctx->rpow[k], p);
+        poly1305_mul(p, ctx->r, ctx->s);
+    }
+}
+
+static void poly1305_update(poly1305_ctx *ctx, const uint8_t *m, size_t len) {
+    if (ctx->buffered > 0) {
+        size_t want = 16 - ctx->buffered;
+        if (want > len) want = len;
+        memcpy(ctx->buffer + ctx->buffered, m, want);
+        ctx->buffered += want;
+        m += want;
+        len -= want;
+        if (ctx->buffered < 16) return;
+        poly1305_blocks(ctx, ctx->buffer, 1);
+        ctx->buffered = 0;
+    }
+
+    size_t nblocks = len / 16;
+    poly1305_blocks(ctx, m, nblocks);
+    m += 16 * nblocks;
+    len -= 16 * nblocks;
+
+    memcpy(ctx->buffer, m, len);
+    ctx->buffered = len;
+}
+
+static void poly1305_final(poly1305_ctx *ctx, uint8_t tag[16]) {
+    uint64_t h0, h1, h2, g0, g1, g2, c, mask;
+
+    // A trailing partial block gets its 0x01 byte here instead of the 2^128 bit
+    if (ctx->buffered > 0) {
+        ctx->buffer[ctx->buffered] = 1;
+        for (size_t i = ctx->buffered + 1; i < 16; i++) ctx->buffer[i] = 0;
+        poly1305_blocks_scalar(ctx, ctx->buffer, 1, 0);
+    }
+
+    // Fully carry h, then subtract p if h >= p
+    h0 = ctx->h[0]; h1 = ctx->h[1]; h2 = ctx->h[2];
+    c = h1 >> 44; h1 &= M44; h2 += c;
+    c = h2 >> 42; h2 &= M42; h0 += c * 5;
+    c = h0 >> 44; h0 &= M44; h1 += c;
+    c = h1 >> 44; h1 &= M44; h2 += c;
+    c = h2 >> 42; h2 &= M42; h0 += c * 5;
+    c = h0 >> 44; h0 &= M44; h1 += c;
+
+    g0 = h0 + 5; c = g0 >> 44; g0 &= M44;
+    g1 = h1 + c; c = g1 >> 44; g1 &= M44;
+    g2 = h2 + c - (1ULL << 42);
+    mask = (g2 >> 63) - 1;      // all ones when h + 5 - p did not go negative
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+
+    // tag = (h + pad) mod 2^128
+    uint64_t t0 = ctx->pad[0], t1 = ctx->pad[1];
+    h0 += t0 & M44; c = h0 >> 44; h0 &= M44;
+    h1 += (((t0 >> 44) | (t1 << 20)) & M44) + c; c = h1 >> 44; h1 &= M44;
+    h2 += ((t1 >> 24) & M42) + c; h2 &= M42;
+
+    store64_le(tag, h0 | (h1 << 44));
+    store64_le(tag + 8, (h1 >> 20) | (h2 << 24));
+    memset(ctx, 0, sizeof *ctx);
+}
+
+#endif
@@ -0,0 +1,325 @@
+/*
+ * Incremental sieve for random prime candidates, shared by rsa*.c and the
+ * Miller-Rabin and Solovay-Strassen programs. Include <gmp.h> first.
+ *
+ * Each prime starts from a fresh random odd base of exactly 'bits' bits. The
+ * window base, base + 2, base + 4, ... is sieved by up to 32768 small
+ * primes, and positions with p = 1 mod any prime factor of the public
+ * exponent e are struck out too, so RSA never has to throw away a prime for
+ * gcd(p - 1, e) != 1. The survivors, in order, go to the caller's test
+ * (Miller-Rabin, Solovay-Strassen or GMP's BPSW), and the first to pass is
+ * returned. A fresh base per prime keeps p and q unrelated.
+ *
+ * The residues of the base modulo the small primes are taken several primes
+ * at a time: the primes are packed into groups whose product M fits in 63
+ * bits, the base is reduced modulo each M limb by limb with Montgomery
+ * reduction (multiplies only, no division instruction), and that is split
+ * into the residue per prime by remainder-by-multiplication with a
+ * precomputed reciprocal. mpz_fdiv_ui per group and a hardware 64-bit
+ * division per prime spent most of the sieve's time.
+ *
+ * The sieve uses bits^2 / 32 of the small primes, capped at
+ * PRIME_SIEVE_PRIMES: 8192 at 512 bits, 18432 at 768, all of them from 1024
+ * bits up. A window's cost grows with the number of primes and a test's with
+ * the square of the bit length; measured generation time was best with this
+ * scaling (512-bit primes came slower with 32768 primes than with 8192,
+ * 1024-bit primes faster).
+ *
+ * The stats count candidates (sieve positions scanned), survivors handed to
+ * the test, and powm calls as reported by the test, so the cost per prime
+ * can be compared across tests and sieve sizes.
+ */
+
+#ifndef PRIME_SIEVE_H
+#define PRIME_SIEVE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chacha_rng.h"
+
+#define PRIME_SIEVE_PRIMES 32768            // odd primes 3 .. 386117, the most a sieve uses
+#define PRIME_SIEVE_WINDOW_PER_BIT 16       // odd positions per window, times the bit length
+#define PRIME_SIEVE_MAX_FACTORS 16          // distinct odd prime factors of e
+
+/*
+Returns 1 if n passes, 0 if it is composite, or a negative value to abandon
+the search (another thread already found what was wanted). The test adds
+the number of mpz_powm calls (or equivalent exponentiations) it made to
+*powm_calls.
+*/
+typedef int (*prime_sieve_test)(const mpz_t n, void *arg, uint64_t *powm_calls);
+
+typedef struct {
+    uint64_t windows;           // random bases drawn
+    uint64_t candidates;        // odd positions scanned
+    uint64_t tests;             // survivors handed to the test
+    uint64_t powm;              // exponentiations reported by the test
+    uint64_t primes;
+    double seconds;
+} prime_sieve_stats;
+
+typedef struct {
+    int bits;
+    uint32_t *primes;           // PRIME_SIEVE_PRIMES odd primes, ascending
+    size_t nprimes;             // how many of them this sieve uses
+    uint64_t *prime_recip;      // 2^64 / p rounded up, for prime_sieve_mod
+    uint32_t *prime_2_32;       // 2^32 mod p
+    uint32_t *group_end;        // group g is primes[group_end[g-1] .. group_end[g])
+    uint64_t *group_mod;        // product M of the primes in group g, below 2^63
+    uint64_t *group_minv;       // -1 / M mod 2^64
+    uint64_t *group_fix;        // 2^(64 (limbs + 1)) mod M, undoes the limb-wise 2^-64 factors
+    size_t ngroups;
+    unsigned long factors[PRIME_SIEVE_MAX_FACTORS];    // odd prime factors of e
+    int nfactors;
+    size_t window;
+    uint8_t *composite;         // composite[k] != 0: base + 2k is struck out
+    mpz_t base;
+    prime_sieve_stats stats;
+} prime_sieve;
+
+static inline double prime_sieve_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/*
+Sets up the sieve for primes of exactly 'bits' bits (at least 64) and the
+public exponent e; e = 0 or 1 excludes nothing. Returns 0, or -1 if bits is
+too small, e is even, or memory runs out.
+*/
+static inline int prime_sieve_init(prime_sieve *ps, int bits, unsigned long e) {
+    memset(ps, 0, sizeof *ps);
+    if (bits < 64 || (e > 1 && e % 2 == 0)) return -1;
+    ps->bits = bits;
+
+    // Distinct prime factors of e: p = 1 mod f for any of them shares f with p - 1
+    for (unsigned long f = 3, rest = e; rest > 1; f += 2) {
+        if ((unsigned long long)f * f > rest) f = rest;
+        if (rest % f != 0) continue;
+        if (ps->nfactors == PRIME_SIEVE_MAX_FACTORS) return -1;
+        ps->factors[ps->nfactors++] = f;
+        while (rest % f == 0) rest /= f;
+    }
+
+    // Odd primes by the sieve of Eratosthenes, up to the PRIME_SIEVE_PRIMES-th
+    uint32_t limit = 400000;
+    uint8_t *is_composite = calloc(limit, 1);
+    ps->primes = malloc(PRIME_SIEVE_PRIMES * sizeof *ps->primes);
+    ps->prime_recip = malloc(PRIME_SIEVE_PRIMES * sizeof *ps->prime_recip);
+    ps->prime_2_32 = malloc(PRIME_SIEVE_PRIMES * sizeof *ps->prime_2_32);
+    ps->group_end = malloc(PRIME_SIEVE_PRIMES * sizeof *ps->group_end);
+    ps->group_mod = malloc(PRIME_SIEVE_PRIMES * sizeof *ps->group_mod);
+    ps->group_minv = malloc(PRIME_SIEVE_PRIMES * sizeof *ps->group_minv);
+    ps->group_fix = malloc(PRIME_SIEVE_PRIMES * sizeof *ps->group_fix);
+    ps->window = (size_t)PRIME_SIEVE_WINDOW_PER_BIT * (size_t)bits;
+    ps->composite = malloc(ps->window);
+    if (!is_composite || !ps->primes || !ps->prime_recip || !ps->prime_2_32 || !ps->group_end || !ps->group_mod || !ps->group_minv || !ps->group_fix ||
+        !ps->composite) {
+        free(is_composite);
+        free(ps->primes);
+        free(ps->prime_recip);
+        free(ps->prime_2_32);
+        free(ps->group_end);
+        free(ps->group_mod);
+        free(ps->group_minv);
+        free(ps->group_fix);
+        free(ps->composite);
+        return -1;
+    }
+    size_t count = 0;
+    for (uint32_t n = 3; n < limit && count < PRIME_SIEVE_PRIMES; n += 2) {
+        if (is_composite[n]) continue;
+        ps->prime_recip[count] = UINT64_MAX / n + 1;
+        ps->prime_2_32[count] = (uint32_t)((UINT64_C(1) << 32) % n);
+        ps->primes[count++] = n;
+        for (uint64_t m = (uint64_t)n * n; m < limit; m += 2 * n) is_composite[m] = 1;
+    }
+    free(is_composite);
+
+    ps->nprimes = (size_t)bits * (size_t)bits / 32;
+    if (ps->nprimes > PRIME_SIEVE_PRIMES) ps->nprimes = PRIME_SIEVE_PRIMES;
+
+    // Pack the primes into groups whose product stays below 2^63
+    uint64_t product = 1;
+    for (size_t i = 0; i < ps->nprimes; i++) {
+        if ((unsigned __int128)product * ps->primes[i] >> 63) {
+            ps->group_end[ps->ngroups] = (uint32_t)i;
+            ps->group_mod[ps->ngroups++] = product;
+            product = 1;
+        }
+        product *= ps->primes[i];
+    }
+    ps->group_end[ps->ngroups] = (uint32_t)ps->nprimes;
+    ps->group_mod[ps->ngroups++] = product;
+
+    // Montgomery constants for each group, for bases of exactly 'bits' bits
+    mpz_t fix;
+    mpz_init(fix);
+    size_t limbs = ((size_t)bits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+    for (size_t g = 0; g < ps->ngroups; g++) {
+        uint64_t m = ps->group_mod[g], inv = m;     // m * m = 1 mod 8, so m is its own inverse to 3 bits
+        for (int i = 0; i < 5; i++) inv *= 2 - m * inv;     // Newton: each step doubles the correct bits
+        ps->group_minv[g] = 0 - inv;
+        mpz_set_ui(fix, 0);
+        mpz_setbit(fix, 64 * (limbs + 1));
+        ps->group_fix[g] = mpz_fdiv_ui(fix, m);
+    }
+    mpz_clear(fix);
+
+    mpz_init(ps->base);
+    return 0;
+}
+
+static inline void prime_sieve_free(prime_sieve *ps) {
+    free(ps->primes);
+    free(ps->prime_recip);
+    free(ps->prime_2_32);
+    free(ps->group_end);
+    free(ps->group_mod);
+    free(ps->group_minv);
+    free(ps->group_fix);
+    free(ps->composite);
+    mpz_clear(ps->base);
+    memset(ps, 0, sizeof *ps);
+}
+
+// The first k >= 0 with base + 2k = target mod m, for odd m, base mod m = r and target < m
+static inline uint64_t prime_sieve_first(uint64_t r, uint64_t target, uint64_t m) {
+    uint64_t diff = target >= r ? target - r : target + (m - r);
+    return diff % 2 == 0 ? diff / 2 : diff / 2 + m / 2 + 1;        // diff / 2 mod m
+}
+
+// t * 2^-64 mod m for t < m * 2^64, m odd and below 2^63
+static inline uint64_t prime_sieve_redc(unsigned __int128 t, uint64_t m, uint64_t minv) {
+    uint64_t q = (uint64_t)t * minv;
+    uint64_t r = (uint64_t)((t + (unsigned __int128)q * m) >> 64);
+    return r >= m ? r - m : r;
+}
+
+// base mod m, from the limbs: each step folds in one limb and multiplies by 2^-64
+static inline uint64_t prime_sieve_residue(const mp_limb_t *limbs, size_t n, uint64_t m, uint64_t minv,
+                                           uint64_t fix) {
+    uint64_t acc = 0;
+    for (size_t i = 0; i < n; i++) acc = prime_sieve_redc((unsigned __int128)acc + limbs[i], m, minv);
+    return prime_sieve_redc((unsigned __int128)acc * fix, m, minv);
+}
+
+/*
+a mod p without a division (Lemire, Kaser and Kurz): exact for a < 2^45
+and p < 2^19. A 63-bit group residue is split into 32-bit halves first.
+*/
+static inline uint32_t prime_sieve_mod45(uint64_t a, uint32_t p, uint64_t recip) {
+    return (uint32_t)(((unsigned __int128)(recip * a) * p) >> 64);
+}
+
+static inline uint32_t prime_sieve_mod(uint64_t r, uint32_t p, uint64_t recip, uint32_t two_32) {
+    uint64_t hi = prime_sieve_mod45(r >> 32, p, recip);
+    return prime_sieve_mod45(hi * two_32 + (uint32_t)r, p, recip);
+}
+
+// Draws a new random base and strikes out every position with a small factor
+static inline void prime_sieve_window(prime_sieve *ps, chacha_rng *rng) {
+    const uint32_t *primes = ps->primes;
+    uint8_t *composite = ps->composite;
+    size_t window = ps->window;
+
+    chacha_rng_urandomb(ps->base, rng, (mp_bitcnt_t)ps->bits);
+    mpz_setbit(ps->base, (mp_bitcnt_t)ps->bits - 1);
+    mpz_setbit(ps->base, 0);
+    memset(composite, 0, window);
+    ps->stats.windows++;
+
+    const mp_limb_t *limbs = mpz_limbs_read(ps->base);
+    size_t start = 0;
+    for (size_t g = 0; g < ps->ngroups; g++) {
+        uint64_t r = prime_sieve_residue(limbs, mpz_size(ps->base), ps->group_mod[g], ps->group_minv[g],
+                                         ps->group_fix[g]);
+        for (size_t i = start; i < ps->group_end[g]; i++) {
+            uint32_t p = primes[i];
+            uint32_t rp = prime_sieve_mod(r, p, ps->prime_recip[i], ps->prime_2_32[i]);
+            for (uint64_t k = prime_sieve_first(rp, 0, p); k < window; k += p) composite[k] = 1;
+        }
+        start = ps->group_end[g];
+    }
+    for (int f = 0; f < ps->nfactors; f++) {
+        unsigned long m = ps->factors[f];
+        uint64_t r = mpz_fdiv_ui(ps->base, m);
+        for (uint64_t k = prime_sieve_first(r, 1 % m, m); k < window; k += m) composite[k] = 1;
+    }
+}
+
+/*
+Sets prime to a random probable prime of exactly ps->bits bits that passes
+'test' and, if e was given, has gcd(prime - 1, e) = 1. Returns 0, or the
+test's negative value if it abandoned the search (prime is then garbage).
+*/
+static inline int prime_sieve_next(prime_sieve *ps, mpz_t prime, chacha_rng *rng, prime_sieve_test test, void *arg) {
+    double start = prime_sieve_now();
+
+    for (;;) {
+        prime_sieve_window(ps, rng);
+        for (size_t k = 0; k < ps->window; k++) {
+            if (ps->composite[k]) continue;
+            mpz_add_ui(prime, ps->base, 2 * (unsigned long)k);
+            if (mpz_sizeinbase(prime, 2) != (size_t)ps->bits) break;  // ran past 2^bits
+            ps->stats.tests++;
+            int r = test(prime, arg, &ps->stats.powm);
+            if (r != 0) {
+                ps->stats.candidates += k + 1;
+                ps->stats.seconds += prime_sieve_now() - start;
+                if (r < 0) return r;
+                ps->stats.primes++;
+                return 0;
+            }
+        }
+        ps->stats.candidates += ps->window;     // rare: no prime in the whole window
+    }
+}
+
+/*
+GMP's mpz_probab_prime_p as a survivor test; arg points to an int reps, or
+is NULL for reps = 1. Since GMP 6.2 the call runs BPSW (a strong base-2
+test, then a strong Lucas test) and, only when reps > 24, reps - 24
+Miller-Rabin rounds with random bases on top; reps 1 to 24 are all plain
+BPSW. Older releases run reps Miller-Rabin rounds instead.
+
+*powm_calls gets the exponentiations the call actually makes. A composite
+nearly always fails the base-2 test and counts one. A prime counts the
+base-2 test, the Lucas test as one exponentiation (its Lucas-sequence
+ladder costs about two to three powm of the same size), and the extra
+Miller-Rabin rounds.
+*/
+#define PRIME_SIEVE_GMP_REPS 25         // BPSW plus one Miller-Rabin round with a random base
+
+static inline int prime_sieve_gmp(const mpz_t n, void *arg, uint64_t *powm_calls) {
+    int reps = arg ? *(const int *)arg : 1;
+    int prime = mpz_probab_prime_p(n, reps) != 0;
+
+    if (!prime) {
+        *powm_calls += 1;
+    } else {
+#if __GNU_MP_RELEASE >= 60200
+        *powm_calls += 2 + (uint64_t)(reps > 24 ? reps - 24 : 0);
+#else
+        *powm_calls += (uint64_t)reps;
+#endif
+    }
+    return prime;
+}
+
+static inline void prime_sieve_report(const prime_sieve *ps, const char *label) {
+    const prime_sieve_stats *s = &ps->stats;
+    double primes = s->primes ? (double)s->primes : 1.0;
+
+    printf("%s: %llu primes of %d bits in %.3f s, %zu small primes + %d factor(s) of e\n", label,
+           (unsigned long long)s->primes, ps->bits, s->seconds, ps->nprimes, ps->nfactors);
+    printf("  candidates/s %.0f, candidates/prime %.1f, tested/prime %.2f, powm/prime %.2f\n",
+           s->seconds > 0 ? (double)s->candidates / s->seconds : 0.0, (double)s->candidates / primes,
+           (double)s->tests / primes, (double)s->powm / primes);
+}
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * RC4 (ARCFOUR) for compatibility with legacy protocols, with the
+ * RC4-drop[n] variant that throws away the first n keystream bytes, where
+ * the key schedule's biases are strongest (RFC 4345 uses n = 1536), and a
+ * multi-stream engine that steps 4 to 8 independent RC4 states in one loop.
+ * RC4 is broken (biased keystream, related-key attacks): use it only where a
+ * protocol requires it. Header-only: include it once per program.
+ */
+
+#ifndef RC4_H
+#define RC4_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+S holds the permutation in 32-bit words rather than bytes: on x86 the byte
+loads and stores of a uint8_t table cost about a cycle more per byte
+through partial-register merges, and 1 KiB per state still sits in L1.
+*/
+typedef struct {
+    uint32_t S[256];
+    uint32_t i, j;
+} rc4_ctx;
+
+// Key scheduling (KSA) for a 1- to 256-byte key
+static void rc4_init(rc4_ctx *ctx, const uint8_t *key, size_t key_len) {
+    uint32_t *S = ctx->S;
+    uint32_t j = 0;
+
+    for (int k = 0; k < 256; k++) S[k] = (uint32_t)k;
+    for (int k = 0; k < 256; k++) {
+        uint32_t t = S[k];
+        j = (j + t + key[k % key_len]) & 255;
+        S[k] = S[j];
+        S[j] = t;
+    }
+    ctx->i = 0;
+    ctx->j = 0;
+}
+
+// Encrypts or decrypts len bytes; calls of any length continue the same stream
+static void rc4_xor(rc4_ctx *ctx, const uint8_t *in, uint8_t *out, size_t len) {
+    uint32_t *S = ctx->S;
+    uint32_t i = ctx->i, j = ctx->j;
+
+    for (size_t k = 0; k < len; k++) {
+        i = (i + 1) & 255;
+        uint32_t a = S[i];
+        j = (j + a) & 255;
+        uint32_t b = S[j];
+        S[i] = b;
+        S[j] = a;
+        out[k] = in[k] ^ (uint8_t)S[(a + b) & 255];
+    }
+    ctx->i = i;
+    ctx->j = j;
+}
+
+// Advances the stream by n bytes without output
+static void rc4_skip(rc4_ctx *ctx, size_t n) {
+    uint8_t scratch[256];
+
+    while (n > 0) {
+        size_t chunk = n < sizeof scratch ? n : sizeof scratch;
+        memset(scratch, 0, chunk);
+        rc4_xor(ctx, scratch, scratch, chunk);
+        n -= chunk;
+    }
+    memset(scratch, 0, sizeof scratch);
+}
+
+// RC4-drop[drop]: the key schedule followed by drop discarded bytes
+static void rc4_init_drop(rc4_ctx *ctx, const uint8_t *key, size_t key_len, size_t drop) {
+    rc4_init(ctx, key, key_len);
+    rc4_skip(ctx, drop);
+}
+
+/*
+Multi-stream RC4. A single RC4 stream is one long dependency chain: each
+byte's j depends on the previous swap, so a core runs it at roughly the
+latency of a load, add and store per byte and leaves most of its execution
+ports idle. Stepping several independent states in the same loop body gives
+the out-of-order core that many chains to overlap. Each lane is a separate
+stream with its own key and its own buffers (one connection, one record
+stream), and every call advances all lanes by the same length. Lanes are
+bit-for-bit the same as rc4_xor on each state.
+*/
+#define RC4_MAX_LANES 8
+
+typedef struct {
+    rc4_ctx lane[RC4_MAX_LANES];
+    int lanes;
+} rc4_multi_ctx;
+
+// lanes is 1..RC4_MAX_LANES; lane l is keyed with keys[l] (key_lens[l] bytes) and drops drop bytes
+static void rc4_multi_init(rc4_multi_ctx *ctx, int lanes, const uint8_t *const keys[], const size_t key_lens[],
+                           size_t drop) {
+    ctx->lanes = lanes;
+    for (int l = 0; l < lanes; l++) rc4_init_drop(&ctx->lane[l], keys[l], key_lens[l], drop);
+}
+
+/*
+The lane loop has a constant trip count once inlined, so it unrolls into
+straight-line code. Keeping every lane's i, j and buffer pointers live at
+once is more than x86-64 has registers for, and a spilled j puts a store and
+reload on the one chain that matters. So only j stays in a register: i is
+recomputed from the lane's starting i and the byte index, and the lanes
+write keystream into a stack block that is XORed into the buffers
+afterwards.
+*/
+#define RC4_MULTI_BLOCK 256
+
+static inline __attribute__((always_inline))
+void rc4_multi_step(rc4_ctx *lane, int lanes, const uint8_t *const in[], uint8_t *const out[], size_t len) {
+    uint8_t keystream[RC4_MAX_LANES][RC4_MULTI_BLOCK];
+    uint32_t j[RC4_MAX_LANES];
+
+    for (int l = 0; l < lanes; l++) j[l] = lane[l].j;
+    for (size_t done = 0; done < len; done += RC4_MULTI_BLOCK) {
+        size_t n = len - done < RC4_MULTI_BLOCK ? len - done : RC4_MULTI_BLOCK;
+
+        for (size_t k = 0; k < n; k++) {
+            for (int l = 0; l < lanes; l++) {
+                uint32_t *S = lane[l].S;
+                uint32_t i = (lane[l].i + (uint32_t)k + 1) & 255;
+                uint32_t a = S[i];
+                j[l] = (j[l] + a) & 255;
+                uint32_t b = S[j[l]];
+                S[i] = b;
+                S[j[l]] = a;
+                keystream[l][k] = (uint8_t)S[(a + b) & 255];
+            }
+        }
+        for (int l = 0; l < lanes; l++) {
+            lane[l].i = (lane[l].i + (uint32_t)n) & 255;
+            for (size_t k = 0; k < n; k++) out[l][done + k] = in[l][done + k] ^ keystream[l][k];
+        }
+    }
+    for (int l = 0; l < lanes; l++) lane[l].j = j[l];
+    memset(keystream, 0, sizeof keystream);
+}
+
+// Encrypts or decrypts len bytes of every lane: in[l] to out[l], which may be the same buffer
+static void rc4_multi_xor(rc4_multi_ctx *ctx, const uint8_t *const in[], uint8_t *const out[], size_t len) {
+    switch (ctx->lanes) {
+    case 1: rc4_multi_step(ctx->lane, 1, in, out, len); break;
+    case 2: rc4_multi_step(ctx->lane, 2, in, out, len); break;
+    case 3: rc4_multi_step(ctx->lane, 3, in, out, len); break;
+    case 4: rc4_multi_step(ctx->lane, 4, in, out, len); break;
+    case 5: rc4_multi_step(ctx->lane, 5, in, out, len); break;
+    case 6: rc4_multi_step(ctx->lane, 6, in, out, len); break;
+    case 7: rc4_multi_step(ctx->lane, 7, in, out, len); break;
+    case 8: rc4_multi_step(ctx->lane, 8, in, out, len); break;
+    }
+}
+
+#endif
@@ -6,6 +6,8 @@
 #include <unistd.h>
 #include <x86intrin.h> // for __rdtsc and __rdtscp
 #include <math.h>
+#include "chacha_rng.h"
+#include "prime_sieve.h"
 
 #define PRIME_BITS 1024
 #define MSG_BITS 1023
@@ -44,22 +46,22 @@ static long double u128_to_ld(__uint128_t v) {
 }
 
 int main(void) {
-    gmp_randstate_t state;
-
-    // Better entropy seed: try /dev/urandom first
-    unsigned long seed = 0;
-    FILE *ur = fopen("/dev/urandom", "rb");
-    if (ur) {
-        if (fread(&seed, sizeof(seed), 1, ur) != 1) {
-            seed = (unsigned long)time(NULL) ^ (unsigned long)getpid();
-        }
-        fclose(ur);
-    } else {
-        seed = (unsigned long)time(NULL) ^ (unsigned long)getpid();
+    // ChaCha20 CSPRNG seeded from getrandom (see chacha_rng.h); prime
+    // candidates are drawn straight into the mpz limbs
+    chacha_rng rng;
+    if (chacha_rng_init(&rng) != 0) {
+        perror("getrandom");
+        return 1;
     }
 
-    gmp_randinit_mt(state);
-    gmp_randseed_ui(state, seed);
+    // Candidates come from a sieve that also strikes out p = 1 mod 65537, so
+    // no prime is thrown away for gcd(p - 1, e) != 1 (see prime_sieve.h)
+    prime_sieve sieve;
+    int reps = PRIME_SIEVE_GMP_REPS;
+    if (prime_sieve_init(&sieve, PRIME_BITS, 65537) != 0) {
+        fprintf(stderr, "prime_sieve_init failed\n");
+        return 1;
+    }
 
     // stats variables
     uint64_t p_min, p_max, q_min, q_max, n_min, n_max, phi_min, phi_max;
@@ -79,33 +81,19 @@ int main(void) {
         mpz_inits(p, q, n, phi, e, d, tmp, p1, q1, NULL);
 
         // --- generate p ---
-        uint64_t start = 0, end = 0;
-        do {
-            start = rdtsc_serialized_begin();
-            mpz_urandomb(tmp, state, PRIME_BITS);
-            mpz_setbit(tmp, PRIME_BITS - 1); // guarantee bit-length
-            mpz_setbit(tmp, 0); // Setting the LSB to 1
-            mpz_nextprime(p, tmp);
-            end = rdtsc_serialized_end();
-
-            // check if (p-1) divisible by e (65537); if so, reject and loop
-            mpz_sub_ui(tmp, p, 1);
-        } while (mpz_divisible_ui_p(tmp, 65537));
+        uint64_t start = rdtsc_serialized_begin();
+        prime_sieve_next(&sieve, p, &rng, prime_sieve_gmp, &reps);
+        uint64_t end = rdtsc_serialized_end();
         UPDATE_STATS(end - start, p_min, p_max, p_total);
 
         // --- generate q ---
         uint64_t q_cycles = 0;
         do {
             start = rdtsc_serialized_begin();
-            mpz_urandomb(tmp, state, PRIME_BITS);
-            mpz_setbit(tmp, PRIME_BITS - 1); // guarantee bit-length
-            mpz_setbit(tmp, 0); // Setting the LSB to 1
-            mpz_nextprime(q, tmp);
+            prime_sieve_next(&sieve, q, &rng, prime_sieve_gmp, &reps);
             end = rdtsc_serialized_end();
-
-            mpz_sub_ui(tmp, q, 1);
             q_cycles = end - start;
-        } while (mpz_cmp(p, q) == 0 || mpz_divisible_ui_p(tmp, 65537));
+        } while (mpz_cmp(p, q) == 0);
         UPDATE_STATS(q_cycles, q_min, q_max, q_total);
 
         // --- compute n ---
@@ -161,26 +149,17 @@ int main(void) {
            (unsigned long long)n_min, (unsigned long long)n_max, n_avg_ld);
     printf("phi computation:    min=%llu, max=%llu, avg=%.2Lf\n\n",
            (unsigned long long)phi_min, (unsigned long long)phi_max, phi_avg_ld);
+    prime_sieve_report(&sieve, "Prime sieve (p and q)");
+    printf("\n");
 
     // --- Now do encryption/decryption timing on one random example ---
     mpz_t p, q, n, phi, e, d, tmp, p1, q1, msg, encrypted, rec;
     mpz_inits(p, q, n, phi, e, d, tmp, p1, q1, msg, encrypted, rec, NULL);
 
+    prime_sieve_next(&sieve, p, &rng, prime_sieve_gmp, &reps);
     do {
-        mpz_urandomb(tmp, state, PRIME_BITS);
-        mpz_setbit(tmp, PRIME_BITS - 1);
-        mpz_setbit(tmp, 0);
-        mpz_nextprime(p, tmp);
-        mpz_sub_ui(tmp, p, 1);
-    } while (mpz_divisible_ui_p(tmp, 65537));
-
-    do {
-        mpz_urandomb(tmp, state, PRIME_BITS);
-        mpz_setbit(tmp, PRIME_BITS - 1);
-        mpz_setbit(tmp, 0);
-        mpz_nextprime(q, tmp);
-        mpz_sub_ui(tmp, q, 1);
-    } while (mpz_cmp(p, q) == 0 || mpz_divisible_ui_p(tmp, 65537));
+        prime_sieve_next(&sieve, q, &rng, prime_sieve_gmp, &reps);
+    } while (mpz_cmp(p, q) == 0);
 
     mpz_mul(n, p, q);
     mpz_sub_ui(p1, p, 1);
@@ -199,7 +178,7 @@ int main(void) {
            (unsigned long long)(end - start));
 
     do {
-        mpz_urandomb(msg, state, MSG_BITS);
+        chacha_rng_urandomb(msg, &rng, MSG_BITS);
         mpz_setbit(msg, MSG_BITS - 1);
     } while (mpz_cmp(msg, n) >= 0);
 
@@ -253,7 +232,8 @@ int main(void) {
 
     mpz_clears(p, q, n, phi, e, d, tmp, p1, q1, msg, encrypted, rec, NULL);
     mpz_clears(dP, dQ, qInv, m1, m2, h, NULL);
-    gmp_randclear(state);
+    prime_sieve_free(&sieve);
+    chacha_rng_wipe(&rng, sizeof rng);
     return 0;
 }
 
@@ -0,0 +1,131 @@
+/*
+ * Throughput of the parallel RSA key generator in rsa_keygen_pool.h:
+ * keypairs per second against the number of worker threads, for 512, 768,
+ * 1024 and 2048-bit moduli, plus the latency of a single keypair (p and q
+ * searched by all threads at once). Every generated key is checked with a
+ * CRT encrypt/decrypt round trip outside the timed region.
+ *
+ * Thread counts go 1, 2, 4, ... up to the number of online CPUs, and one
+ * oversubscribed row at twice that, where throughput should stop growing.
+ *
+ * powm/prime is the exponentiation count from prime_sieve_gmp (see
+ * prime_sieve.h for what it counts), summed over the workers, including
+ * searches abandoned once a request had all its primes, and divided by the
+ * primes found.
+ *
+ * Build:
+ *   gcc -O2 -Wall -Wextra -pthread rsa_keygen_benchmarked.c -lgmp -o rsa_keygen
+ *   (chacha_rng.h, prime_sieve.h and rsa_keygen_pool.h must be next to the source)
+ * Run:
+ *   ./rsa_keygen
+ */
+
+#include <gmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "rsa_keygen_pool.h"
+
+#define E 65537
+
+// Keypairs per timed batch, and single-keypair requests timed for latency
+static const struct {
+    int bits;
+    size_t batch;
+    int single;
+} sizes[] = {
+    {512, 1000, 50},
+    {768, 400, 20},
+    {1024, 200, 10},
+    {2048, 20, 4},
+};
+
+// Encrypts a random message with (n, e) and decrypts it with the CRT values
+static int keypair_ok(const rsa_keypair *kp, int bits, chacha_rng *rng) {
+    mpz_t m, c, m1, m2, h;
+    mpz_inits(m, c, m1, m2, h, NULL);
+
+    int ok = mpz_sizeinbase(kp->p, 2) == (size_t)bits / 2 && mpz_sizeinbase(kp->q, 2) == (size_t)bits / 2 &&
+             mpz_cmp(kp->p, kp->q) != 0;
+    chacha_rng_urandomm(m, rng, kp->n);
+    mpz_powm(c, m, kp->e, kp->n);
+    mpz_powm(m1, c, kp->dp, kp->p);
+    mpz_powm(m2, c, kp->dq, kp->q);
+    mpz_sub(h, m1, m2);
+    mpz_mul(h, h, kp->qinv);
+    mpz_mod(h, h, kp->p);
+    mpz_mul(h, h, kp->q);
+    mpz_add(h, h, m2);
+    ok = ok && mpz_cmp(h, m) == 0;
+
+    mpz_clears(m, c, m1, m2, h, NULL);
+    return ok;
+}
+
+int main(void) {
+    chacha_rng rng;
+    if (chacha_rng_init(&rng) != 0) {
+        perror("getrandom");
+        return 1;
+    }
+
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    int counts[16], ncounts = 0;
+    for (int t = 1; t < cpus && ncounts < 14; t *= 2) counts[ncounts++] = t;
+    counts[ncounts++] = cpus;
+    counts[ncounts++] = 2 * cpus;
+
+    printf("RSA keygen pool, e = %d, %d online CPU(s)\n\n", E, cpus);
+    printf("%6s %8s %7s %12s %8s %14s %12s\n", "bits", "threads", "batch", "keypairs/s", "speedup",
+           "1 keypair ms", "powm/prime");
+
+    int all_ok = 1;
+    for (size_t s = 0; s < sizeof sizes / sizeof sizes[0]; s++) {
+        int bits = sizes[s].bits;
+        size_t batch = sizes[s].batch;
+        rsa_keypair *keys = malloc(batch * sizeof *keys);
+        if (!keys) {
+            perror("malloc");
+            return 1;
+        }
+        for (size_t i = 0; i < batch; i++) rsa_keypair_init(&keys[i]);
+
+        double base_rate = 0;
+        for (int c = 0; c < ncounts; c++) {
+            rsa_keygen_pool pool;
+            if (rsa_keygen_pool_init(&pool, counts[c], bits, E) != 0) {
+                fprintf(stderr, "rsa_keygen_pool_init failed (%d threads, %d bits)\n", counts[c], bits);
+                return 1;
+            }
+
+            // --- single keypairs: latency ---
+            double start = prime_sieve_now();
+            for (int i = 0; i < sizes[s].single; i++) rsa_keygen(&pool, &keys[i]);
+            double single_ms = (prime_sieve_now() - start) / sizes[s].single * 1e3;
+            for (int i = 0; i < sizes[s].single; i++) all_ok &= keypair_ok(&keys[i], bits, &rng);
+
+            // --- one batch: throughput ---
+            start = prime_sieve_now();
+            rsa_keygen_batch(&pool, keys, batch);
+            double rate = (double)batch / (prime_sieve_now() - start);
+            for (size_t i = 0; i < batch; i++) all_ok &= keypair_ok(&keys[i], bits, &rng);
+
+            prime_sieve_stats st = rsa_keygen_pool_stats(&pool);
+            if (c == 0) base_rate = rate;
+            printf("%6d %8d %7zu %12.2f %7.2fx %14.2f %12.2f\n", bits, counts[c], batch, rate, rate / base_rate,
+                   single_ms, st.primes ? (double)st.powm / (double)st.primes : 0.0);
+            fflush(stdout);
+            rsa_keygen_pool_free(&pool);
+        }
+        printf("\n");
+
+        for (size_t i = 0; i < batch; i++) rsa_keypair_clear(&keys[i]);
+        free(keys);
+    }
+
+    printf("%s\n", all_ok ? "All keypairs passed the CRT round trip." : "Some keypair FAILED the CRT round trip!");
+    chacha_rng_wipe(&rng, sizeof rng);
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,276 @@
+/*
+ * Parallel RSA key generation on a pool of worker threads. Include <gmp.h>
+ * first; build with -pthread -lgmp.
+ *
+ * A request for 'count' keypairs is a request for 2 * count primes. Every
+ * worker searches for primes on its own (its own prime_sieve and its own
+ * ChaCha20 stream), and the primes are handed out in the order they are
+ * found: the first becomes keypair 0's p, the second its q, the third
+ * keypair 1's p, and so on. The worker that supplies a q also computes n, d
+ * and the CRT values for that keypair. So a single keypair has p and q
+ * searched by all threads at once, and a batch keeps every thread busy
+ * until the last prime rather than leaving the tail of the batch to
+ * whichever threads drew the last pairs. Once the last prime is in, the
+ * other workers abandon their searches at their next survivor test
+ * (prime_sieve_next's negative-return path), within about one
+ * exponentiation.
+ *
+ * RNG: the pool draws one getrandom seed and worker i uses ChaCha20 stream
+ * i + 1 under it (chacha_rng_init_seed), so workers never share generator
+ * state and take no lock to draw candidates.
+ *
+ * Keys are built as in rsa*.c: p and q have exactly bits / 2 bits each, so
+ * n has bits or bits - 1 bits; d = e^-1 mod (p - 1)(q - 1). The sieve
+ * strikes out p = 1 mod any prime factor of e, so that inverse always
+ * exists. Primes are checked by prime_sieve_gmp with PRIME_SIEVE_GMP_REPS,
+ * as in rsa*.c; prime_sieve.h says what that test runs and how its
+ * exponentiations are counted.
+ */
+
+#ifndef RSA_KEYGEN_POOL_H
+#define RSA_KEYGEN_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "chacha_rng.h"
+#include "prime_sieve.h"
+
+typedef struct {
+    mpz_t n, e, d, p, q;
+    mpz_t dp, dq, qinv;                 // d mod (p - 1), d mod (q - 1), q^-1 mod p
+} rsa_keypair;
+
+static inline void rsa_keypair_init(rsa_keypair *kp) {
+    mpz_inits(kp->n, kp->e, kp->d, kp->p, kp->q, kp->dp, kp->dq, kp->qinv, NULL);
+}
+
+static inline void rsa_keypair_clear(rsa_keypair *kp) {
+    mpz_clears(kp->n, kp->e, kp->d, kp->p, kp->q, kp->dp, kp->dq, kp->qinv, NULL);
+}
+
+typedef struct rsa_keygen_pool rsa_keygen_pool;
+
+typedef struct {
+    rsa_keygen_pool *pool;
+    pthread_t thread;
+    chacha_rng rng;
+    prime_sieve sieve;
+    mpz_t prime;
+} rsa_keygen_worker;
+
+struct rsa_keygen_pool {
+    int bits;                           // modulus bits
+    unsigned long e;
+    int threads;
+    rsa_keygen_worker *workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;                // a new request or shutdown
+    pthread_cond_t done;                // the last busy worker finished
+    uint64_t request;                   // bumped for every request
+    int shutdown;
+
+    // The current request, under 'lock'
+    rsa_keypair *out;
+    size_t primes_wanted, primes_found;
+    int busy;                           // workers not yet back from this request
+    atomic_int cancel;                  // every prime is in: abandon searches
+};
+
+// n, d and the CRT values once p and q are set
+static inline void rsa_keygen_finish(rsa_keypair *kp, unsigned long e) {
+    mpz_t p1, q1, phi;
+    mpz_inits(p1, q1, phi, NULL);
+
+    mpz_set_ui(kp->e, e);
+    mpz_mul(kp->n, kp->p, kp->q);
+    mpz_sub_ui(p1, kp->p, 1);
+    mpz_sub_ui(q1, kp->q, 1);
+    mpz_mul(phi, p1, q1);
+    mpz_invert(kp->d, kp->e, phi);      // cannot fail: the sieve keeps gcd(p - 1, e) = gcd(q - 1, e) = 1
+    mpz_mod(kp->dp, kp->d, p1);
+    mpz_mod(kp->dq, kp->d, q1);
+    mpz_invert(kp->qinv, kp->q, kp->p);
+
+    mpz_clears(p1, q1, phi, NULL);
+}
+
+static inline int rsa_keygen_test(const mpz_t n, void *arg, uint64_t *powm_calls) {
+    rsa_keygen_pool *pool = arg;
+    int reps = PRIME_SIEVE_GMP_REPS;
+
+    if (atomic_load_explicit(&pool->cancel, memory_order_relaxed)) return -1;
+    return prime_sieve_gmp(n, &reps, powm_calls);
+}
+
+// Hands a found prime to the current request; returns 0 once no more are wanted
+static inline int rsa_keygen_deposit(rsa_keygen_pool *pool, const mpz_t prime) {
+    rsa_keypair *kp = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->primes_found < pool->primes_wanted) {
+        rsa_keypair *slot = &pool->out[pool->primes_found / 2];
+        if (pool->primes_found % 2 == 0) {
+            mpz_set(slot->p, prime);
+            pool->primes_found++;
+        } else if (mpz_cmp(slot->p, prime) != 0) {     // p = q: keep searching for q
+            mpz_set(slot->q, prime);
+            pool->primes_found++;
+            kp = slot;
+        }
+        if (pool->primes_found == pool->primes_wanted) atomic_store(&pool->cancel, 1);
+    }
+    int more = pool->primes_found < pool->primes_wanted;
+    pthread_mutex_unlock(&pool->lock);
+
+    // p and q of this slot are final now, and only this worker touches the rest
+    if (kp) rsa_keygen_finish(kp, pool->e);
+    return more;
+}
+
+static inline void *rsa_keygen_worker_main(void *arg) {
+    rsa_keygen_worker *w = arg;
+    rsa_keygen_pool *pool = w->pool;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && pool->request == seen) pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->shutdown) break;
+        seen = pool->request;
+        pthread_mutex_unlock(&pool->lock);
+
+        while (prime_sieve_next(&w->sieve, w->prime, &w->rng, rsa_keygen_test, pool) == 0 &&
+               rsa_keygen_deposit(pool, w->prime))
+            ;
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static inline void rsa_keygen_pool_free(rsa_keygen_pool *pool);
+
+/*
+Starts 'threads' workers (0: one per online CPU) for moduli of 'bits' bits
+(even, at least 128) and public exponent e (odd, at least 3). Returns 0, or
+-1 if the arguments are bad, getrandom fails or a thread cannot be started.
+*/
+static inline int rsa_keygen_pool_init(rsa_keygen_pool *pool, int threads, int bits, unsigned long e) {
+    memset(pool, 0, sizeof *pool);
+    if (bits < 128 || bits % 2 != 0 || e < 3 || e % 2 == 0) return -1;
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+    pool->bits = bits;
+    pool->e = e;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    atomic_init(&pool->cancel, 0);
+
+    chacha_rng seeder;
+    uint8_t seed[32];
+    if (chacha_rng_init(&seeder) != 0) {
+        rsa_keygen_pool_free(pool);
+        return -1;
+    }
+    chacha_rng_fill(&seeder, seed, sizeof seed);
+    chacha_rng_wipe(&seeder, sizeof seeder);
+
+    int rc = 0;
+    pool->workers = calloc((size_t)threads, sizeof *pool->workers);
+    if (!pool->workers) rc = -1;
+    for (int i = 0; rc == 0 && i < threads; i++) {
+        rsa_keygen_worker *w = &pool->workers[i];
+        w->pool = pool;
+        chacha_rng_init_seed(&w->rng, seed, (uint64_t)i + 1);
+        if (prime_sieve_init(&w->sieve, bits / 2, e) != 0) {
+            rc = -1;
+            break;
+        }
+        mpz_init(w->prime);
+        if (pthread_create(&w->thread, NULL, rsa_keygen_worker_main, w) != 0) {
+            prime_sieve_free(&w->sieve);
+            mpz_clear(w->prime);
+            rc = -1;
+            break;
+        }
+        pool->threads++;
+    }
+    chacha_rng_wipe(seed, sizeof seed);
+    if (rc != 0) rsa_keygen_pool_free(pool);
+    return rc;
+}
+
+/*
+Generates 'count' keypairs into out[0 .. count), each already
+rsa_keypair_init'ed, using every worker. Blocks until all are done. One
+request at a time per pool.
+*/
+static inline void rsa_keygen_batch(rsa_keygen_pool *pool, rsa_keypair *out, size_t count) {
+    if (count == 0) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->out = out;
+    pool->primes_wanted = 2 * count;
+    pool->primes_found = 0;
+    pool->busy = pool->threads;
+    atomic_store(&pool->cancel, 0);
+    pool->request++;
+    pthread_cond_broadcast(&pool->work);
+    while (pool->busy > 0) pthread_cond_wait(&pool->done, &pool->lock);
+    pool->out = NULL;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// One keypair, with p and q searched by all workers at once
+static inline void rsa_keygen(rsa_keygen_pool *pool, rsa_keypair *kp) {
+    rsa_keygen_batch(pool, kp, 1);
+}
+
+/*
+Sieve statistics summed over the workers, between requests only. 'seconds'
+is summed too, so it is thread time spent searching, not wall time.
+*/
+static inline prime_sieve_stats rsa_keygen_pool_stats(rsa_keygen_pool *pool) {
+    prime_sieve_stats sum = {0};
+
+    for (int i = 0; i < pool->threads; i++) {
+        const prime_sieve_stats *s = &pool->workers[i].sieve.stats;
+        sum.windows += s->windows;
+        sum.candidates += s->candidates;
+        sum.tests += s->tests;
+        sum.powm += s->powm;
+        sum.primes += s->primes;
+        sum.seconds += s->seconds;
+    }
+    return sum;
+}
+
+// Stops and joins the workers and wipes their generators
+static inline void rsa_keygen_pool_free(rsa_keygen_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->threads; i++) {
+        rsa_keygen_worker *w = &pool->workers[i];
+        pthread_join(w->thread, NULL);
+        prime_sieve_free(&w->sieve);
+        mpz_clear(w->prime);
+        chacha_rng_wipe(&w->rng, sizeof w->rng);
+    }
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->threads = 0;
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+}
+
+#endif